@@ -0,0 +1,52 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+
+// comparison operands logged by the target (with -cmplog).
+// The layout of the shared memory is the same on both sides,
+// sancovclient.cpp fills it and the instrumentation reads it
+
+#define CMPLOG_SHM_SIZE 0x100000
+
+// longer operands of memory comparisons are truncated
+#define CMPLOG_OPERAND_SIZE 32
+
+#define CMPLOG_INTEGER 0
+#define CMPLOG_MEMORY 1
+
+struct CmpLogEntry {
+  // CMPLOG_INTEGER or CMPLOG_MEMORY
+  uint8_t type;
+  // operand sizes in bytes, the same for integers.
+  // For strings, the size doesn't include the terminator
+  uint8_t size1;
+  uint8_t size2;
+  // integers are stored in the byte order of the target
+  uint8_t op1[CMPLOG_OPERAND_SIZE];
+  uint8_t op2[CMPLOG_OPERAND_SIZE];
+};
+
+struct CmpLogShmemData {
+  // set by the fuzzer for the runs that should be logged
+  uint32_t enabled;
+  uint32_t num_entries;
+  CmpLogEntry entries[];
+};
+
+#define CMPLOG_MAX_ENTRIES ((CMPLOG_SHM_SIZE - sizeof(CmpLogShmemData)) / sizeof(CmpLogEntry))
@@ -0,0 +1,296 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "common.h"
+#include "coveragebitmap.h"
+
+static inline uint32_t PopCount(uint64_t word) {
+#if defined(_MSC_VER)
+  return (uint32_t)__popcnt64(word);
+#else
+  return (uint32_t)__builtin_popcountll(word);
+#endif
+}
+
+static inline uint32_t CountTrailingZeros(uint64_t word) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, word);
+  return index;
+#else
+  return (uint32_t)__builtin_ctzll(word);
+#endif
+}
+
+static inline uint64_t MixHash(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+uint64_t HashCoverage(Coverage &coverage) {
+  uint64_t hash = 0;
+  for (ModuleCoverage &module : coverage) {
+    // FNV-1a of the module name
+    uint64_t module_hash = 0xcbf29ce484222325ULL;
+    for (char c : module.module_name) {
+      module_hash = (module_hash ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+    for (uint64_t offset : module.offsets) {
+      hash += MixHash(module_hash ^ offset);
+    }
+  }
+  return hash ? hash : 1;
+}
+
+AtomicCoverage::Page::Page() {
+  for (int i = 0; i < OFFSET_BITMAP_WORDS; i++) {
+    words[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+AtomicCoverage::Node::Node() {
+  for (int i = 0; i < ATOMIC_COVERAGE_LEVEL_SIZE; i++) {
+    children[i].store(NULL, std::memory_order_relaxed);
+  }
+}
+
+AtomicCoverage::AtomicCoverage() : num_modules(0), num_offsets(0) { }
+
+AtomicCoverage::~AtomicCoverage() {
+  uint32_t count = num_modules.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < count; i++) {
+    for (int j = 0; j < ATOMIC_COVERAGE_LEVEL_SIZE; j++) {
+      Node *child = (Node *)modules[i]->root.children[j].load(std::memory_order_relaxed);
+      if (child) FreeNode(child, 1);
+    }
+    delete modules[i];
+  }
+}
+
+void AtomicCoverage::FreeNode(Node *node, int level) {
+  for (int i = 0; i < ATOMIC_COVERAGE_LEVEL_SIZE; i++) {
+    void *child = node->children[i].load(std::memory_order_relaxed);
+    if (!child) continue;
+    if (level == ATOMIC_COVERAGE_LEVELS - 1) {
+      delete (Page *)child;
+    } else {
+      FreeNode((Node *)child, level + 1);
+    }
+  }
+  delete node;
+}
+
+AtomicCoverage::Module *AtomicCoverage::GetModule(std::string &name, bool create) {
+  uint32_t count = num_modules.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < count; i++) {
+    if (modules[i]->name == name) return modules[i];
+  }
+
+  if (!create) return NULL;
+
+  module_mutex.Lock();
+
+  // another thread could have added it in the meantime
+  Module *module = NULL;
+  count = num_modules.load(std::memory_order_relaxed);
+  for (uint32_t i = 0; i < count; i++) {
+    if (modules[i]->name == name) {
+      module = modules[i];
+      break;
+    }
+  }
+
+  if (!module) {
+    if (count == ATOMIC_COVERAGE_MAX_MODULES) {
+      FATAL("Too many modules in coverage");
+    }
+    module = new Module();
+    module->name = name;
+    modules[count] = module;
+    num_modules.store(count + 1, std::memory_order_release);
+  }
+
+  module_mutex.Unlock();
+
+  return module;
+}
+
+AtomicCoverage::Page *AtomicCoverage::GetPage(Module *module, uint64_t key, bool create) {
+  Node *node = &module->root;
+  for (int level = 0; level < ATOMIC_COVERAGE_LEVELS; level++) {
+    int shift = (ATOMIC_COVERAGE_LEVELS - 1 - level) * ATOMIC_COVERAGE_LEVEL_BITS;
+    size_t index = (key >> shift) & (ATOMIC_COVERAGE_LEVEL_SIZE - 1);
+    bool last_level = (level == ATOMIC_COVERAGE_LEVELS - 1);
+
+    void *child = node->children[index].load(std::memory_order_acquire);
+    if (!child) {
+      if (!create) return NULL;
+      void *new_child;
+      if (last_level) {
+        new_child = new Page();
+      } else {
+        new_child = new Node();
+      }
+      if (node->children[index].compare_exchange_strong(child, new_child,
+            std::memory_order_acq_rel, std::memory_order_acquire))
+      {
+        child = new_child;
+      } else {
+        // another thread allocated it first, child now points to its copy
+        if (last_level) {
+          delete (Page *)new_child;
+        } else {
+          delete (Node *)new_child;
+        }
+      }
+    }
+
+    if (last_level) return (Page *)child;
+    node = (Node *)child;
+  }
+  return NULL;
+}
+
+void AtomicCoverage::Claim(Coverage &coverage, Coverage *new_coverage) {
+  for (ModuleCoverage &module_coverage : coverage) {
+    if (module_coverage.offsets.empty()) continue;
+
+    Module *module = GetModule(module_coverage.module_name, true);
+    ModuleCoverage *new_module_coverage = NULL;
+
+    Page *page = NULL;
+    uint64_t page_key = 0;
+
+    auto iter = module_coverage.offsets.begin();
+    while (iter != module_coverage.offsets.end()) {
+      uint64_t key = *iter >> OFFSET_CONTAINER_BITS;
+      if (!page || key != page_key) {
+        page = GetPage(module, key, true);
+        page_key = key;
+      }
+
+      // offsets are sorted, so all of the offsets
+      // falling into the same word are consecutive
+      uint64_t word_base = *iter & ~63ULL;
+      uint64_t mask = 0;
+      while ((iter != module_coverage.offsets.end()) && ((*iter & ~63ULL) == word_base)) {
+        mask |= 1ULL << (*iter & 63);
+        iter++;
+      }
+
+      std::atomic<uint64_t> &word = page->words[(word_base & (OFFSET_CONTAINER_SIZE - 1)) >> 6];
+
+      // most of the time, everything is already there and
+      // a plain load avoids taking the cache line exclusively
+      if (!(mask & ~word.load(std::memory_order_acquire))) continue;
+
+      uint64_t new_bits = mask & ~word.fetch_or(mask, std::memory_order_acq_rel);
+      if (!new_bits) continue;
+
+      num_offsets.fetch_add(PopCount(new_bits), std::memory_order_relaxed);
+
+      if (!new_coverage) continue;
+      if (!new_module_coverage) {
+        new_coverage->push_back({module_coverage.module_name, std::set<uint64_t>()});
+        new_module_coverage = &new_coverage->back();
+      }
+      while (new_bits) {
+        new_module_coverage->offsets.insert(new_module_coverage->offsets.end(), word_base + CountTrailingZeros(new_bits));
+        new_bits &= new_bits - 1;
+      }
+    }
+  }
+}
+
+void AtomicCoverage::Difference(Coverage &coverage, Coverage &result) {
+  result.clear();
+  for (ModuleCoverage &module_coverage : coverage) {
+    if (module_coverage.offsets.empty()) continue;
+
+    Module *module = GetModule(module_coverage.module_name, false);
+    if (!module) {
+      result.push_back(module_coverage);
+      continue;
+    }
+
+    std::set<uint64_t> missing;
+
+    Page *page = NULL;
+    uint64_t page_key = 0;
+    bool have_page = false;
+
+    for (uint64_t offset : module_coverage.offsets) {
+      uint64_t key = offset >> OFFSET_CONTAINER_BITS;
+      if (!have_page || key != page_key) {
+        page = GetPage(module, key, false);
+        page_key = key;
+        have_page = true;
+      }
+      uint16_t value = (uint16_t)(offset & (OFFSET_CONTAINER_SIZE - 1));
+      if (!page || !((page->words[value >> 6].load(std::memory_order_acquire) >> (value & 63)) & 1)) {
+        missing.insert(missing.end(), offset);
+      }
+    }
+
+    if (!missing.empty()) {
+      result.push_back({module_coverage.module_name, missing});
+    }
+  }
+}
+
+void AtomicCoverage::CollectOffsets(Node *node, int level, uint64_t key, std::set<uint64_t> &offsets) {
+  for (int i = 0; i < ATOMIC_COVERAGE_LEVEL_SIZE; i++) {
+    void *child = node->children[i].load(std::memory_order_acquire);
+    if (!child) continue;
+
+    uint64_t child_key = (key << ATOMIC_COVERAGE_LEVEL_BITS) | i;
+
+    if (level < ATOMIC_COVERAGE_LEVELS - 1) {
+      CollectOffsets((Node *)child, level + 1, child_key, offsets);
+      continue;
+    }
+
+    Page *page = (Page *)child;
+    uint64_t base = child_key << OFFSET_CONTAINER_BITS;
+    for (int j = 0; j < OFFSET_BITMAP_WORDS; j++) {
+      uint64_t word = page->words[j].load(std::memory_order_relaxed);
+      while (word) {
+        offsets.insert(offsets.end(), base + j * 64 + CountTrailingZeros(word));
+        word &= word - 1;
+      }
+    }
+  }
+}
+
+void AtomicCoverage::ToCoverage(Coverage &result) {
+  result.clear();
+  uint32_t count = num_modules.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < count; i++) {
+    std::set<uint64_t> offsets;
+    CollectOffsets(&modules[i]->root, 0, 0, offsets);
+    if (!offsets.empty()) {
+      result.push_back({modules[i]->name, offsets});
+    }
+  }
+}
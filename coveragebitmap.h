@@ -0,0 +1,101 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <string>
+#include <atomic>
+
+#include "coverage.h"
+#include "mutex.h"
+
+// offsets are grouped into containers by their upper bits,
+// each container holds up to 2^16 offsets in a bitmap
+#define OFFSET_CONTAINER_BITS 16
+#define OFFSET_CONTAINER_SIZE (1 << OFFSET_CONTAINER_BITS)
+#define OFFSET_BITMAP_WORDS (OFFSET_CONTAINER_SIZE / 64)
+
+// a hash of the coverage that doesn't depend on the order
+// of the modules. Never 0, so that 0 can mean "no hash"
+uint64_t HashCoverage(Coverage &coverage);
+
+// AtomicCoverage keeps offsets in lazily allocated bitmap pages
+// (one page per offset container) found through a radix tree
+// indexed by the container key
+#define ATOMIC_COVERAGE_LEVEL_BITS 12
+#define ATOMIC_COVERAGE_LEVEL_SIZE (1 << ATOMIC_COVERAGE_LEVEL_BITS)
+// (64 - OFFSET_CONTAINER_BITS) / ATOMIC_COVERAGE_LEVEL_BITS
+#define ATOMIC_COVERAGE_LEVELS 4
+
+#define ATOMIC_COVERAGE_MAX_MODULES 1024
+
+// A coverage set that can be updated and queried by many threads
+// without locking. Adding coverage is a fetch_or on every affected
+// bitmap word, and the bits that weren't previously set tell
+// the caller which offsets it was the first to add.
+// Offsets can only be added, never removed.
+class AtomicCoverage {
+public:
+  AtomicCoverage();
+  ~AtomicCoverage();
+
+  // adds coverage to the set. If new_coverage is not NULL,
+  // it receives the offsets that weren't in the set before.
+  // Every offset is reported as new to exactly one caller.
+  // Wait-free, except for the first time a module is seen.
+  void Claim(Coverage &coverage, Coverage *new_coverage);
+  void Merge(Coverage &coverage) { Claim(coverage, NULL); }
+
+  // result contains offsets in coverage that are not in the set
+  void Difference(Coverage &coverage, Coverage &result);
+
+  // a copy of the set. If other threads are adding coverage
+  // concurrently, some of the new offsets might be missing
+  void ToCoverage(Coverage &result);
+
+  size_t Size() { return (size_t)num_offsets.load(std::memory_order_relaxed); }
+
+protected:
+  struct Page {
+    Page();
+    std::atomic<uint64_t> words[OFFSET_BITMAP_WORDS];
+  };
+
+  struct Node {
+    Node();
+    // Node * on the inner levels, Page * on the last level
+    std::atomic<void *> children[ATOMIC_COVERAGE_LEVEL_SIZE];
+  };
+
+  struct Module {
+    std::string name;
+    Node root;
+  };
+
+  Module *GetModule(std::string &name, bool create);
+  Page *GetPage(Module *module, uint64_t key, bool create);
+  void CollectOffsets(Node *node, int level, uint64_t key, std::set<uint64_t> &offsets);
+  void FreeNode(Node *node, int level);
+
+  // modules are only added under module_mutex and are
+  // published to readers by incrementing num_modules
+  Mutex module_mutex;
+  Module *modules[ATOMIC_COVERAGE_MAX_MODULES];
+  std::atomic<uint32_t> num_modules;
+
+  std::atomic<uint64_t> num_offsets;
+};
@@ -0,0 +1,251 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+#include <ctype.h>
+
+#include "common.h"
+#include "sample.h"
+#include "dictionary.h"
+
+// the slot has a hash, but the token isn't added yet
+#define TOKEN_INDEX_PENDING 0xFFFFFFFF
+
+static int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// parses the quoted value starting at p, returns false on error
+static bool ParseDictionaryValue(const char *p, std::string &value) {
+  if (*p != '"') return false;
+  p++;
+  while (*p && (*p != '"')) {
+    if (*p != '\\') {
+      value.push_back(*p);
+      p++;
+      continue;
+    }
+    p++;
+    if ((*p == '\\') || (*p == '"')) {
+      value.push_back(*p);
+      p++;
+    } else if (*p == 'x') {
+      int high = HexValue(p[1]);
+      if (high < 0) return false;
+      int low = HexValue(p[2]);
+      if (low < 0) return false;
+      value.push_back((char)((high << 4) | low));
+      p += 3;
+    } else {
+      return false;
+    }
+  }
+  if (*p != '"') return false;
+  p++;
+  while (isspace((unsigned char)*p)) p++;
+  return (*p == 0);
+}
+
+void LoadDictionary(const char *filename, std::vector<std::string> &tokens) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    FATAL("Error opening dictionary %s", filename);
+  }
+
+  char line[4096];
+  int line_number = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    line_number++;
+
+    const char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    if (!*p || (*p == '#')) continue;
+
+    // skip the name
+    if (*p != '"') {
+      while (*p && (*p != '=')) p++;
+      if (!*p) {
+        FATAL("Error parsing dictionary %s, line %d", filename, line_number);
+      }
+      p++;
+      while (isspace((unsigned char)*p)) p++;
+    }
+
+    std::string value;
+    if (!ParseDictionaryValue(p, value)) {
+      FATAL("Error parsing dictionary %s, line %d", filename, line_number);
+    }
+    if (value.empty()) continue;
+    if (value.size() > TOKEN_MAX_SIZE) {
+      WARN("Dictionary entry on line %d is longer than %d bytes, skipping", line_number, TOKEN_MAX_SIZE);
+      continue;
+    }
+    tokens.push_back(value);
+  }
+
+  fclose(fp);
+}
+
+TokenTable::TokenTable() {
+  num_tokens = 0;
+  for (size_t i = 0; i < TOKEN_TABLE_SIZE; i++) {
+    tokens[i].ready = 0;
+  }
+  for (size_t i = 0; i < TOKEN_TABLE_HASH_SIZE; i++) {
+    slots[i].hash = 0;
+    slots[i].index = TOKEN_INDEX_PENDING;
+  }
+}
+
+void TokenTable::Add(const char *data, size_t size, uint32_t count) {
+  if (!size || (size > TOKEN_MAX_SIZE)) return;
+
+  // 0 marks an empty slot
+  uint64_t hash = Sample::HashBytes(data, size) | 1;
+
+  size_t slot = hash % TOKEN_TABLE_HASH_SIZE;
+  for (size_t probe = 0; probe < TOKEN_TABLE_HASH_SIZE; probe++) {
+    uint64_t slot_hash = slots[slot].hash.load(std::memory_order_acquire);
+
+    if (slot_hash == 0) {
+      // don't use up hash slots for tokens that can't be stored
+      if (num_tokens.load(std::memory_order_relaxed) >= TOKEN_TABLE_SIZE) return;
+      if (!slots[slot].hash.compare_exchange_strong(slot_hash, hash)) {
+        // another thread took the slot, look at it again
+        probe--;
+        continue;
+      }
+      uint32_t index = num_tokens.fetch_add(1);
+      if (index >= TOKEN_TABLE_SIZE) return;
+      Token &token = tokens[index];
+      token.size = (uint32_t)size;
+      memcpy(token.data, data, size);
+      token.seen.store(count, std::memory_order_relaxed);
+      token.uses.store(0, std::memory_order_relaxed);
+      token.finds.store(0, std::memory_order_relaxed);
+      token.ready.store(1, std::memory_order_release);
+      slots[slot].index.store(index, std::memory_order_release);
+      return;
+    }
+
+    if (slot_hash == hash) {
+      uint32_t index = slots[slot].index.load(std::memory_order_acquire);
+      // sightings while the token is being added get lost
+      if (index >= TOKEN_TABLE_SIZE) return;
+      tokens[index].seen.fetch_add(count, std::memory_order_relaxed);
+      return;
+    }
+
+    slot = (slot + 1) % TOKEN_TABLE_HASH_SIZE;
+  }
+}
+
+size_t TokenTable::Size() {
+  uint32_t size = num_tokens.load(std::memory_order_acquire);
+  if (size > TOKEN_TABLE_SIZE) size = TOKEN_TABLE_SIZE;
+  return size;
+}
+
+int64_t TokenTable::Select(PRNG *prng) {
+  size_t size = Size();
+  if (!size) return -1;
+
+  int64_t best = -1;
+  double best_yield = 0;
+  for (int i = 0; i < TOKEN_SELECT_CANDIDATES; i++) {
+    uint32_t index = prng->Rand() % size;
+    Token &token = tokens[index];
+    if (!token.ready.load(std::memory_order_acquire)) continue;
+    if (token.seen.load(std::memory_order_relaxed) < TOKEN_MIN_SEEN) continue;
+    double yield = (double)(token.finds.load(std::memory_order_relaxed) + TOKEN_PRIOR_FINDS) /
+                   (double)(token.uses.load(std::memory_order_relaxed) + TOKEN_PRIOR_USES);
+    if ((best < 0) || (yield > best_yield)) {
+      best = index;
+      best_yield = yield;
+    }
+  }
+  return best;
+}
+
+size_t TokenTable::GetToken(int64_t index, const char **data) {
+  *data = tokens[index].data;
+  return tokens[index].size;
+}
+
+void TokenTable::RecordResult(int64_t index, bool found) {
+  tokens[index].uses.fetch_add(1, std::memory_order_relaxed);
+  if (found) tokens[index].finds.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TokenTable::Save(FILE *fp) {
+  // other threads can still be adding tokens,
+  // only the ones that are fully written get saved
+  std::vector<size_t> ready_tokens;
+  size_t num_ready = Size();
+  for (size_t i = 0; i < num_ready; i++) {
+    if (tokens[i].ready.load(std::memory_order_acquire)) {
+      ready_tokens.push_back(i);
+    }
+  }
+
+  uint64_t size = ready_tokens.size();
+  fwrite(&size, sizeof(size), 1, fp);
+  for (size_t i : ready_tokens) {
+    Token &token = tokens[i];
+    fwrite(&token.size, sizeof(token.size), 1, fp);
+    fwrite(token.data, 1, token.size, fp);
+    uint32_t seen = token.seen;
+    uint64_t uses = token.uses;
+    uint64_t finds = token.finds;
+    fwrite(&seen, sizeof(seen), 1, fp);
+    fwrite(&uses, sizeof(uses), 1, fp);
+    fwrite(&finds, sizeof(finds), 1, fp);
+  }
+}
+
+void TokenTable::Load(FILE *fp) {
+  uint64_t size;
+  fread(&size, sizeof(size), 1, fp);
+  for (uint64_t i = 0; i < size; i++) {
+    uint32_t token_size;
+    char data[TOKEN_MAX_SIZE];
+    uint32_t seen;
+    uint64_t uses, finds;
+    fread(&token_size, sizeof(token_size), 1, fp);
+    if (token_size > TOKEN_MAX_SIZE) {
+      FATAL("Error loading the token table");
+    }
+    fread(data, 1, token_size, fp);
+    fread(&seen, sizeof(seen), 1, fp);
+    fread(&uses, sizeof(uses), 1, fp);
+    fread(&finds, sizeof(finds), 1, fp);
+
+    // the state is loaded into every thread's mutators,
+    // so the statistics are overwritten rather than added
+    Add(data, token_size, 0);
+    uint64_t hash = Sample::HashBytes(data, token_size) | 1;
+    size_t slot = hash % TOKEN_TABLE_HASH_SIZE;
+    while (slots[slot].hash != hash) slot = (slot + 1) % TOKEN_TABLE_HASH_SIZE;
+    uint32_t index = slots[slot].index;
+    if (index >= TOKEN_TABLE_SIZE) continue;
+    tokens[index].seen = seen;
+    tokens[index].uses = uses;
+    tokens[index].finds = finds;
+  }
+}
@@ -0,0 +1,96 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "prng.h"
+
+#define TOKEN_MAX_SIZE 32
+// harvested strings shorter than this aren't tokens
+#define TOKEN_MIN_SIZE 3
+#define TOKEN_TABLE_SIZE 16384
+#define TOKEN_TABLE_HASH_SIZE (TOKEN_TABLE_SIZE * 4)
+// a harvested string is only used once it was seen this many times,
+// so that the table doesn't fill with strings that came from the input
+#define TOKEN_MIN_SEEN 3
+// number of tokens a selection picks from
+#define TOKEN_SELECT_CANDIDATES 4
+// uses and finds every token starts with, new tokens
+// get tried a few times before their yield counts
+#define TOKEN_PRIOR_USES 64
+#define TOKEN_PRIOR_FINDS 1
+
+// reads an AFL/libFuzzer dictionary file, where each line is
+// name="value" (name is optional, AFL's name@level is accepted)
+// and values can contain \\, \" and \xNN escapes
+void LoadDictionary(const char *filename, std::vector<std::string> &tokens);
+
+// Tokens (from a dictionary, or harvested while fuzzing) shared by
+// the mutators of all threads. Tokens are only ever added, and adding,
+// selecting and updating the statistics of tokens are lock-free.
+// Once the table is full, new tokens are dropped.
+class TokenTable {
+public:
+  TokenTable();
+
+  // adds a token, or counts count more sightings of it
+  void Add(const char *data, size_t size, uint32_t count);
+
+  // picks a token that was seen at least TOKEN_MIN_SEEN times,
+  // preferring tokens whose mutations found new coverage more often.
+  // Returns -1 if there is none
+  int64_t Select(PRNG *prng);
+
+  // returns the size of the token, data is valid as long as the table
+  size_t GetToken(int64_t index, const char **data);
+
+  void RecordResult(int64_t index, bool found);
+
+  size_t Size();
+
+  // used when saving and restoring the fuzzer state.
+  // Save can run while other threads add tokens, Load can not
+  void Save(FILE *fp);
+  void Load(FILE *fp);
+
+protected:
+  struct Token {
+    // set once the token data can be read
+    std::atomic<uint32_t> ready;
+    uint32_t size;
+    char data[TOKEN_MAX_SIZE];
+    std::atomic<uint32_t> seen;
+    std::atomic<uint64_t> uses;
+    std::atomic<uint64_t> finds;
+  };
+
+  // open addressing index from the token hash to the token
+  struct Slot {
+    std::atomic<uint64_t> hash;
+    std::atomic<uint32_t> index;
+  };
+
+  Token tokens[TOKEN_TABLE_SIZE];
+  Slot slots[TOKEN_TABLE_HASH_SIZE];
+  // can grow past TOKEN_TABLE_SIZE when threads race to add the last tokens
+  std::atomic<uint32_t> num_tokens;
+};
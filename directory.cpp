@@ -14,6 +14,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <string>
 #include <list>
@@ -56,6 +57,16 @@ int CreateDirectory(std::string &directory) {
   return(!_mkdir(directory.c_str()));
 }
 
+int RenameFile(std::string &from, std::string &to) {
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
+uint64_t GetFileSize(std::string &filename) {
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes)) return 0;
+  return ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+}
+
 
 #else
 
@@ -81,8 +92,22 @@ int CreateDirectory(std::string &directory) {
   return(!mkdir(directory.c_str(), 0755));
 }
 
+int RenameFile(std::string &from, std::string &to) {
+  return(!rename(from.c_str(), to.c_str()));
+}
+
+uint64_t GetFileSize(std::string &filename) {
+  struct stat st;
+  if (stat(filename.c_str(), &st)) return 0;
+  return st.st_size;
+}
+
 #endif
 
+int RemoveFile(std::string &filename) {
+  return(!remove(filename.c_str()));
+}
+
 std::string DirJoin(std::string dir1, std::string dir2) {
   if (dir1.empty()) return dir2;
 
@@ -16,6 +16,7 @@ limitations under the License.
 
 #pragma once
 
+#include <inttypes.h>
 #include <string>
 #include <vector>
 
@@ -37,4 +38,9 @@ limitations under the License.
 size_t GetFilesInDirectory(std::string directory, std::list<std::string> &list);
 std::string DirJoin(std::string dir1, std::string dir2);
 int CreateDirectory(std::string &directory);
+// renames a file, replacing the destination if it exists
+int RenameFile(std::string &from, std::string &to);
+int RemoveFile(std::string &filename);
+// returns 0 if the file doesn't exist
+uint64_t GetFileSize(std::string &filename);
 
@@ -18,6 +18,9 @@ limitations under the License.
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <chrono>
+#include <algorithm>
 #include "common.h"
 #include "sample.h"
 #include "fuzzer.h"
@@ -32,6 +35,22 @@ limitations under the License.
 
 using namespace std;
 
+// current time in microseconds, used for measuring
+// sample execution times
+static uint64_t GetCurTimeUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// total number of offsets in a coverage object
+static size_t CoverageSize(Coverage &coverage) {
+  size_t size = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    size += iter->offsets.size();
+  }
+  return size;
+}
+
 void Fuzzer::PrintUsage() {
   printf("Incorrect usage, please refer to the documentation\n");
   exit(0);
@@ -81,6 +100,12 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
   
   corpus_timeout = GetIntOption("-t_corpus", argc, argv, timeout);
 
+  // derive the hang timeout from the measured execution times,
+  // -t becomes the upper bound in this case
+  auto_timeout = GetBinaryOption("-auto_timeout", argc, argv, false);
+  auto_timeout_multiplier = GetIntOption("-auto_timeout_multiplier", argc, argv, DEFAULT_AUTO_TIMEOUT_MULTIPLIER);
+  corpus_auto_timeout = timeout;
+
   if (GetOption("-server", argc, argv)) {
     server = new CoverageClient();
     server->Init(argc, argv);
@@ -98,19 +123,48 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
 
   clean_target_on_coverage = GetBinaryOption("-clean_target_on_coverage", argc, argv, true);
   coverage_reproduce_retries = GetIntOption("-coverage_retry", argc, argv, DEFAULT_COVERAGE_REPRODUCE_RETRIES);
+  adaptive_coverage_retry = GetBinaryOption("-adaptive_coverage_retry", argc, argv, false);
   crash_reproduce_retries = GetIntOption("-crash_retry", argc, argv, DEFAULT_CRASH_REPRODUCE_RETRIES);
 
   minimize_samples = GetBinaryOption("-minimize_samples", argc, argv, true);
 
   keep_samples_in_memory = GetBinaryOption("-keep_samples_in_memory", argc, argv, true);
 
+  pack_samples = GetBinaryOption("-pack_samples", argc, argv, false);
+  // packed samples are always accessible through the mapped pack files
+  if (pack_samples) keep_samples_in_memory = true;
+
   track_ranges = GetBinaryOption("-track_ranges", argc, argv, false);
 
+  zero_copy = GetBinaryOption("-zero_copy", argc, argv, false);
+
+  patch_mutants = GetBinaryOption("-patch_mutants", argc, argv, false);
+
+  dedup_mutants = GetBinaryOption("-dedup_mutants", argc, argv, false);
+
+  pipeline_mutants = GetIntOption("-pipeline_mutants", argc, argv, 0);
+
   Sample::max_size = (size_t)GetIntOption("-max_sample_size", argc, argv, DEFAULT_MAX_SAMPLE_SIZE);
 
   dry_run = GetBinaryOption("-dry_run", argc, argv, false);
   
   incremental_coverage = GetBinaryOption("-incremental_coverage", argc, argv, true);
+
+  // the effector map compares the full coverage of runs,
+  // incremental coverage only reports the new offsets
+  effector_map = GetBinaryOption("-effector_map", argc, argv, false);
+  if (effector_map && incremental_coverage) {
+    FATAL("-effector_map requires -incremental_coverage=0");
+  }
+
+  // helping threads read the sample while the
+  // thread that owns the entry might free it
+  share_deterministic = GetBinaryOption("-share_deterministic", argc, argv, false);
+  if (share_deterministic && !keep_samples_in_memory) {
+    FATAL("-share_deterministic requires -keep_samples_in_memory");
+  }
+
+  cmplog = GetBinaryOption("-cmplog", argc, argv, false);
   
   add_all_inputs = GetBinaryOption("-add_all_inputs", argc, argv, false);
 }
@@ -126,6 +180,21 @@ void Fuzzer::SetupDirectories() {
   CreateDirectory(sample_dir);
 }
 
+const char *fuzzer_stage_names[NUM_FUZZER_STAGES] = {
+  "mutation",
+  "execution",
+  "reproduction",
+  "minimization",
+  "saving",
+  "sync",
+};
+
+ThreadCounters::ThreadCounters() : execs(0), crashes(0), hangs(0), skipped_duplicates(0) {
+  for (int i = 0; i < NUM_FUZZER_STAGES; i++) {
+    stage_time[i] = 0;
+  }
+}
+
 void *StartFuzzThread(void *arg) {
   Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
   tc->fuzzer->RunFuzzerThread(tc);
@@ -138,6 +207,10 @@ Fuzzer::ThreadContext::~ThreadContext() {
   if (mutator) delete mutator;
   if (instrumentation) delete instrumentation;
   if (target_argv) free(target_argv);
+  if (restore_file) fclose(restore_file);
+  // the pipeline uses the mutator and recent_samples
+  if (pipeline) delete pipeline;
+  if (recent_samples) delete recent_samples;
 }
 
 void Fuzzer::Run(int argc, char **argv) {
@@ -154,19 +227,34 @@ void Fuzzer::Run(int argc, char **argv) {
 
   samples_pending = 0;
   
-  num_crashes = 0;
   num_unique_crashes = 0;
-  num_hangs = 0;
   num_samples = 0;
   num_samples_discarded = 0;
-  total_execs = 0;
+  restored_execs = 0;
+  hang_file_index = 0;
+  save_mutator_state = false;
+
+  num_flaky_edges = 0;
+  stable_reproductions = 0;
 
   ParseOptions(argc, argv);
 
   SetupDirectories();
 
+  journal.Init(out_dir, should_restore_state);
+
+  if (pack_samples) {
+    sample_pack.Init(sample_dir, should_restore_state);
+  }
+
+  // create all thread contexts before starting any of the threads
+  // so that the stats loop can read thread_contexts without locking
+  for (int i = 1; i <= num_threads; i++) {
+    thread_contexts.push_back(CreateThreadContext(argc, argv, i));
+  }
+
   if(should_restore_state) {
-    state = RESTORE_NEEDED;
+    RestoreState();
   } else {
     GetFilesInDirectory(in_dir, input_files);
 
@@ -175,21 +263,38 @@ void Fuzzer::Run(int argc, char **argv) {
     } else {
       SAY("%d input files read\n", (int)input_files.size());
     }
-    state = INPUT_SAMPLE_PROCESSING;
+
+    // smaller inputs are faster to run and tend to be better
+    // starting points, so when several inputs hit the same coverage
+    // the smallest one gets into the corpus
+    std::vector<std::pair<uint64_t, std::string>> sized_files;
+    for (std::string &filename : input_files) {
+      sized_files.push_back({GetFileSize(filename), filename});
+    }
+    std::stable_sort(sized_files.begin(), sized_files.end(),
+      [](const std::pair<uint64_t, std::string> &a, const std::pair<uint64_t, std::string> &b) {
+        return a.first < b.first;
+      });
+    input_files.clear();
+    for (auto &sized_file : sized_files) {
+      input_files.push_back(sized_file.second);
+    }
   }
+  state = INPUT_SAMPLE_PROCESSING;
   
   last_save_time = GetCurTime();
-  
-  for (int i = 1; i <= num_threads; i++) {
-    ThreadContext *tc = CreateThreadContext(argc, argv, i);
+
+  for (ThreadContext *tc : thread_contexts) {
     CreateThread(StartFuzzThread, tc);
   }
 
-  uint64_t last_execs = 0;
-  
+  FuzzerStats stats, last_stats, last_saved_stats;
+  GetStats(&last_stats);
+  last_saved_stats = last_stats;
+
   uint32_t secs_to_sleep = 1;
   
-  uint64_t last_stats_time = 0;
+  uint64_t last_stats_time = GetCurTime();
   
   while (1) {
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
@@ -197,15 +302,18 @@ void Fuzzer::Run(int argc, char **argv) {
 #else
     usleep(secs_to_sleep * 1000000);
 #endif
-    
-    size_t num_offsets = 0;
-    coverage_mutex.Lock();
-    for(auto iter = fuzzer_coverage.begin(); iter != fuzzer_coverage.end(); iter++) {
-      num_offsets += iter->offsets.size();
-    }
-    coverage_mutex.Unlock();
-    
+
+    GetStats(&stats);
+
     uint64_t cur_time = GetCurTime();
+
+    // only save state while fuzzing
+    if ((state == FUZZING) && (cur_time > last_save_time) &&
+        (((cur_time - last_save_time) / 1000) > FUZZER_SAVE_INERVAL))
+    {
+      Checkpoint();
+      last_save_time = cur_time;
+    }
     if ((cur_time > last_stats_time && (cur_time - last_stats_time) / 1000 > FUZZER_STATS_SAVE_INTERVAL)
         || (state == FUZZING && dry_run)) {
       std::string out_file = DirJoin(out_dir, std::string("fuzzer_stats"));
@@ -213,15 +321,33 @@ void Fuzzer::Run(int argc, char **argv) {
       if (!fp) {
         FATAL("Error saving stats");
       }
-      
-      fprintf(fp, "\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nOffsets: %zu\nExecs/s: %lld\n", total_execs, num_samples, num_samples_discarded, num_crashes, num_unique_crashes, num_hangs, num_offsets, (total_execs - last_execs) / secs_to_sleep);
-      
+
+      // per-thread numbers are averaged over the whole save interval
+      double secs = (double)(cur_time - last_stats_time) / 1000;
+      PrintStats(fp, &stats, &last_saved_stats, secs);
+      fprintf(fp, "\n");
+      for (size_t i = 0; i < stats.threads.size(); i++) {
+        FuzzerStats::ThreadStats &thread_stats = stats.threads[i];
+        FuzzerStats::ThreadStats &last_thread_stats = last_saved_stats.threads[i];
+        uint64_t total_time = 0;
+        for (int stage = 0; stage < NUM_FUZZER_STAGES; stage++) {
+          total_time += thread_stats.stage_time[stage] - last_thread_stats.stage_time[stage];
+        }
+        fprintf(fp, "Thread %zu: %.0lf execs/s,", i + 1, (thread_stats.execs - last_thread_stats.execs) / secs);
+        for (int stage = 0; stage < NUM_FUZZER_STAGES; stage++) {
+          uint64_t stage_time = thread_stats.stage_time[stage] - last_thread_stats.stage_time[stage];
+          fprintf(fp, " %s %.1lf%%", fuzzer_stage_names[stage], total_time ? (100.0 * stage_time / total_time) : 0);
+        }
+        fprintf(fp, "\n");
+      }
+
       last_stats_time = cur_time;
+      last_saved_stats = stats;
       fclose(fp);
     }
     
-    printf("\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nOffsets: %zu\nExecs/s: %lld\n", total_execs, num_samples, num_samples_discarded, num_crashes, num_unique_crashes, num_hangs, num_offsets, (total_execs - last_execs) / secs_to_sleep);
-    last_execs = total_execs;
+    PrintStats(stdout, &stats, &last_stats, secs_to_sleep);
+    last_stats = stats;
     
     if (state == FUZZING && dry_run) {
       printf("\nDry run done\n");
@@ -230,15 +356,76 @@ void Fuzzer::Run(int argc, char **argv) {
   }
 }
 
+void Fuzzer::PrintStats(FILE *fp, FuzzerStats *stats, FuzzerStats *last_stats, double secs) {
+  fprintf(fp, "\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nOffsets: %lld\nExecs/s: %lld\n",
+          stats->total_execs, stats->num_samples, stats->num_samples_discarded,
+          stats->num_crashes, stats->num_unique_crashes, stats->num_hangs,
+          stats->num_offsets, (uint64_t)((stats->total_execs - last_stats->total_execs) / secs));
+  if (dedup_mutants) {
+    fprintf(fp, "Skipped duplicates: %lld\n", stats->num_skipped_duplicates);
+  }
+}
+
+// doesn't take any of the fuzzer locks, the individual
+// counters are exact but not necessarily consistent
+// with each other
+void Fuzzer::GetStats(FuzzerStats *stats) {
+  stats->total_execs = restored_execs;
+  stats->num_samples = num_samples;
+  stats->num_samples_discarded = num_samples_discarded;
+  stats->num_crashes = 0;
+  stats->num_unique_crashes = num_unique_crashes;
+  stats->num_hangs = 0;
+  stats->num_offsets = fuzzer_coverage.Size();
+  stats->num_skipped_duplicates = 0;
+
+  stats->threads.resize(thread_contexts.size());
+  for (size_t i = 0; i < thread_contexts.size(); i++) {
+    ThreadCounters &counters = thread_contexts[i]->counters;
+    FuzzerStats::ThreadStats &thread_stats = stats->threads[i];
+
+    thread_stats.execs = counters.execs.load(std::memory_order_relaxed);
+    for (int stage = 0; stage < NUM_FUZZER_STAGES; stage++) {
+      thread_stats.stage_time[stage] = counters.stage_time[stage].load(std::memory_order_relaxed);
+    }
+
+    stats->total_execs += thread_stats.execs;
+    stats->num_crashes += counters.crashes.load(std::memory_order_relaxed);
+    stats->num_hangs += counters.hangs.load(std::memory_order_relaxed);
+    stats->num_skipped_duplicates += counters.skipped_duplicates.load(std::memory_order_relaxed);
+  }
+}
+
+uint64_t Fuzzer::GetTotalExecs() {
+  uint64_t total_execs = restored_execs;
+  for (ThreadContext *tc : thread_contexts) {
+    total_execs += tc->counters.execs.load(std::memory_order_relaxed);
+  }
+  return total_execs;
+}
+
+// accounts the time since the last stage change to the
+// current stage and switches to the new one.
+// Returns the previous stage.
+FuzzerStage Fuzzer::EnterStage(ThreadContext *tc, FuzzerStage stage) {
+  uint64_t cur_time = GetCurTimeUs();
+  FuzzerStage prev_stage = tc->stage;
+  ThreadCounters::Add(tc->counters.stage_time[prev_stage], cur_time - tc->stage_start_time);
+  tc->stage = stage;
+  tc->stage_start_time = cur_time;
+  return prev_stage;
+}
+
 RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Coverage *coverage, uint32_t init_timeout, uint32_t timeout) {
   // from this point on, the sample could be filtered
-  Sample filteredSample;
-  if (OutputFilter(sample, &filteredSample, tc)) {
-    sample = &filteredSample;
+  if (OutputFilter(sample, &tc->filtered_sample, tc)) {
+    sample = &tc->filtered_sample;
+    // the filtered sample has to be copied to the delivery
+    // buffer anyway, so building samples in it doesn't help
+    tc->zero_copy = false;
   }
 
-  // not protected by a mutex but not important to be perfectly accurate
-  total_execs++;
+  ThreadCounters::Add(tc->counters.execs);
 
   if (!tc->sampleDelivery->DeliverSample(sample)) {
     WARN("Error delivering sample, retrying with a clean target");
@@ -263,7 +450,9 @@ RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Cov
     }
   }
 
+  uint64_t run_start = GetCurTimeUs();
   RunResult result = tc->instrumentation->Run(tc->target_argc, tc->target_argv, init_timeout, timeout);
+  tc->last_exec_time = GetCurTimeUs() - run_start;
   tc->instrumentation->GetCoverage(*coverage, true);
 
   // save crashes and hangs immediately when they are detected
@@ -280,8 +469,9 @@ RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Cov
     bool should_save_crash = false;
     int duplicates = 0;
     
+    ThreadCounters::Add(tc->counters.crashes);
+
     crash_mutex.Lock();
-    num_crashes++;
 
     auto crash_it = unique_crashes.find(crash_desc);
     if(crash_it == unique_crashes.end()) {
@@ -315,13 +505,14 @@ RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Cov
   }
 
   if (result == HANG) {
-    output_mutex.Lock();
+    ThreadCounters::Add(tc->counters.hangs);
     if (save_hangs) {
-      string outfile = DirJoin(hangs_dir, string("hang_") + std::to_string(num_hangs));
+      output_mutex.Lock();
+      string outfile = DirJoin(hangs_dir, string("hang_") + std::to_string(hang_file_index));
       sample->Save(outfile.c_str());
+      hang_file_index++;
+      output_mutex.Unlock();
     }
-    num_hangs++;
-    output_mutex.Unlock();
   }
 
   return result;
@@ -330,8 +521,10 @@ RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Cov
 RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t init_timeout, uint32_t timeout) {
   RunResult result;
 
+  FuzzerStage prev_stage = EnterStage(tc, STAGE_REPRODUCTION);
+
   for (int i = 0; i < crash_reproduce_retries; i++) {
-    total_execs++;
+    ThreadCounters::Add(tc->counters.execs);
 
     if (!tc->sampleDelivery->DeliverSample(sample)) {
       WARN("Error delivering sample, retrying with a clean target");
@@ -344,9 +537,11 @@ RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t
     result = tc->instrumentation->RunWithCrashAnalysis(tc->target_argc, tc->target_argv, init_timeout, timeout);
     tc->instrumentation->ClearCoverage();
 
-    if (result == CRASH) return result;
+    if (result == CRASH) break;
   }
 
+  EnterStage(tc, prev_stage);
+
   return result;
 }
 
@@ -361,35 +556,53 @@ void Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout
     // we'll just mutate the entire sample
     if (result == OK) {
       tc->range_tracker->ExtractRanges(&ranges);
+      tc->calibration_times.Add((double)tc->last_exec_time);
     }
   }
 
+  EnterStage(tc, STAGE_SAVING);
+
   output_mutex.Lock();
+  uint64_t sample_index = num_samples;
   char fileindex[20];
-  sprintf(fileindex, "%05lld", num_samples);
+  sprintf(fileindex, "%05lld", sample_index);
   string filename = string("sample_") + fileindex;
   string outfile = DirJoin(sample_dir, filename);
-  sample->Save(outfile.c_str());
+  if (!pack_samples) sample->Save(outfile.c_str());
   num_samples++;
   output_mutex.Unlock();
 
   SampleQueueEntry *new_entry = new SampleQueueEntry();
-  Sample *new_sample = new Sample(*sample);
+  Sample *new_sample;
+  if (pack_samples) {
+    new_sample = new Sample();
+    sample_pack.Add(sample, new_sample, &new_entry->pack_segment, &new_entry->pack_offset);
+    new_entry->packed = 1;
+    new_entry->pack_size = sample->size;
+  } else {
+    new_sample = new Sample(*sample);
+  }
   new_entry->sample = new_sample;
   new_entry->context = tc->mutator->CreateSampleContext(new_entry->sample);
   if(TrackHotOffsets()) {
     if (keep_samples_in_memory) {
       size_t mutation_offset = sample_trie.AddSample(new_sample);
       tc->mutator->AddHotOffset(new_entry->context, mutation_offset);
+      tc->mutator->AddInterestingSample(new_sample, mutation_offset);
     } else if (original_sample) {
-      size_t mutation_offset = original_sample->FindFirstDiff(*new_sample);
+      size_t mutation_offset = sample->FindFirstPatchDiff(*original_sample);
       tc->mutator->AddHotOffset(new_entry->context, mutation_offset);
+      tc->mutator->AddInterestingSample(sample, mutation_offset);
     }
   }
   new_entry->priority = 0;
-  new_entry->sample_index = num_samples - 1;
+  new_entry->sample_index = sample_index;
   new_entry->sample_filename = filename;
   new_entry->ranges = ranges;
+  new_entry->exec_times = tc->calibration_times;
+  new_entry->stability = tc->calibration_stability;
+
+  JournalEntry(tc, new_entry);
 
   if (!keep_samples_in_memory) {
     new_sample->filename = outfile;
@@ -400,6 +613,7 @@ void Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout
   all_samples.push_back(new_sample);
   all_entries.push_back(new_entry);
   sample_queue.push(new_entry);
+  UpdateAutoTimeout(new_entry);
   queue_mutex.Unlock();
 }
 
@@ -408,9 +622,19 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
     *has_new_coverage = 0;
   }
 
+  // the runs below double as a calibration of the sample
+  tc->calibration_times.Clear();
+  tc->calibration_stability = 1.0;
+
   Coverage initialCoverage;
 
   RunResult result = RunSampleAndGetCoverage(tc, sample, &initialCoverage, init_timeout, timeout);
+  tc->calibration_times.Add((double)tc->last_exec_time);
+
+  if (effector_map) {
+    tc->coverage_hash = HashCoverage(initialCoverage) ^ ((uint64_t)result << 56);
+    if (!tc->coverage_hash) tc->coverage_hash = 1;
+  }
 
   if (result != OK) return result;
 
@@ -429,17 +653,32 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
 
   // the sample returned new coverage
 
+  int retries = GetCoverageRetries(initialCoverage);
+  if (retries == 0) {
+    // all of the coverage was already seen and classified
+    // (e.g. by another thread), no need to reproduce it
+    if(incremental_coverage) {
+      tc->instrumentation->IgnoreCoverage(initialCoverage);
+    } else {
+      MergeCoverage(tc->thread_coverage, initialCoverage);
+    }
+    return result;
+  }
+
   Coverage stableCoverage = initialCoverage;
   Coverage totalCoverage = initialCoverage;
 
+  EnterStage(tc, STAGE_REPRODUCTION);
+
   // have a clean target before retrying the sample
   if(clean_target_on_coverage) tc->instrumentation->CleanTarget();
 
-  for (int i = 0; i < coverage_reproduce_retries; i++) {
+  for (int i = 0; i < retries; i++) {
     Coverage retryCoverage, tmpCoverage;
 
     result = RunSampleAndGetCoverage(tc, sample, &retryCoverage, init_timeout, timeout);
     if (result != OK) return result;
+    tc->calibration_times.Add((double)tc->last_exec_time);
 
     // printf("Retry %d, coverage:\n", i);
     // PrintCoverage(retryCoverage);
@@ -453,6 +692,13 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
   Coverage variableCoverage;
   CoverageDifference(stableCoverage, totalCoverage, variableCoverage);
 
+  size_t total_size = CoverageSize(totalCoverage);
+  if (total_size) {
+    tc->calibration_stability = (double)CoverageSize(stableCoverage) / total_size;
+  }
+
+  UpdateEdgeStability(variableCoverage);
+
   // printf("Stable coverage:\n");
   // PrintCoverage(stableCoverage);
   // printf("Variable coverage:\n");
@@ -463,6 +709,7 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
       *has_new_coverage = 1;
     }
 
+    EnterStage(tc, STAGE_MINIMIZATION);
     if (trim && minimize_samples) MinimizeSample(tc, sample, &stableCoverage, init_timeout, timeout);
 
     if (server && report_to_server) {
@@ -500,6 +747,8 @@ void Fuzzer::MinimizeSample(ThreadContext *tc, Sample *sample, Coverage* stable_
   MinimizerContext* context = minimizer->CreateContext(sample);
 
   Sample test_sample = *sample;
+  Coverage minimized_coverage;
+  uint64_t minimized_exec_time = 0;
 
   while (1) {
     if (!minimizer->MinimizeStep(&test_sample, context)) break;
@@ -517,26 +766,49 @@ void Fuzzer::MinimizeSample(ThreadContext *tc, Sample *sample, Coverage* stable_
     } else {
       minimizer->ReportSuccess(&test_sample, context);
       *sample = test_sample;
+      minimized_coverage = test_coverage;
+      minimized_exec_time = tc->last_exec_time;
     }
   }
 
   delete context;
+
+  if (minimized_coverage.empty()) return;
+
+  // the calibration runs were done on the unminimized sample,
+  // recalibrate on the sample that will be saved from the last
+  // successful minimization step and one more run
+  tc->calibration_times.Clear();
+  tc->calibration_times.Add((double)minimized_exec_time);
+  tc->calibration_stability = 1.0;
+
+  Coverage retry_coverage;
+  RunResult result = RunSampleAndGetCoverage(tc, sample, &retry_coverage, init_timeout, timeout);
+  if (result != OK) return;
+  tc->calibration_times.Add((double)tc->last_exec_time);
+
+  Coverage total_coverage = minimized_coverage;
+  MergeCoverage(total_coverage, retry_coverage);
+  Coverage stable_part;
+  CoverageIntersection(minimized_coverage, retry_coverage, stable_part);
+  size_t total_size = CoverageSize(total_coverage);
+  if (total_size) {
+    tc->calibration_stability = (double)CoverageSize(stable_part) / total_size;
+  }
 }
 
 
 int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stableCoverage, Coverage *variableCoverage) {
-  coverage_mutex.Lock();
-
   Coverage new_stable_coverage;
   Coverage new_variable_coverage;
 
-  CoverageDifference(fuzzer_coverage, *stableCoverage, new_stable_coverage);
-  CoverageDifference(fuzzer_coverage, *variableCoverage, new_variable_coverage);
+  // if several threads find the same coverage at the same time,
+  // only one of them gets to claim it
+  fuzzer_coverage.Claim(*stableCoverage, &new_stable_coverage);
+  fuzzer_coverage.Claim(*variableCoverage, &new_variable_coverage);
 
-  MergeCoverage(fuzzer_coverage, new_stable_coverage);
-  MergeCoverage(fuzzer_coverage, new_variable_coverage);
-
-  coverage_mutex.Unlock();
+  JournalCoverage(new_stable_coverage);
+  JournalCoverage(new_variable_coverage);
 
   // printf("New stable coverage:\n");
   // PrintCoverage(new_stable_coverage);
@@ -551,34 +823,120 @@ int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stabl
   return 0;
 }
 
-void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
-  queue_mutex.Lock();
-  
-  // handle saving and loading first (if needed).
-  // first thread that enters this function restores state
-  if(state == RESTORE_NEEDED) {
-    RestoreState(tc);
-    state = INPUT_SAMPLE_PROCESSING;
+// returns the number of times new coverage should be
+// reproduced before deciding which part of it is stable
+int Fuzzer::GetCoverageRetries(Coverage &coverage) {
+  if (!adaptive_coverage_retry) return coverage_reproduce_retries;
+
+  Coverage unknown_coverage;
+  fuzzer_coverage.Difference(coverage, unknown_coverage);
+
+  // every edge is known, either as stable or as flaky
+  if (unknown_coverage.empty()) return 0;
+
+  int retries = coverage_reproduce_retries;
+
+  edge_stability_mutex.Lock();
+
+  if ((stable_reproductions >= ADAPTIVE_RETRY_STABLE_REPRODUCTIONS) &&
+      !HasFlakyEdges(coverage) && (retries > 1))
+  {
+    // the target has been deterministic so far and the sample
+    // doesn't go through any known flaky edges, a single retry
+    // is enough to tell if the new coverage is stable
+    retries = 1;
   }
-  
-  // only save state while fuzzing
-  if(state == FUZZING) {
-    uint64_t cur_time = GetCurTime();
-    if((cur_time > last_save_time) &&
-       (((cur_time - last_save_time) / 1000) > FUZZER_SAVE_INERVAL))
-    {
-      SaveState(tc);
-      last_save_time = cur_time;
+
+  edge_stability_mutex.Unlock();
+
+  return retries;
+}
+
+// called with edge_stability_mutex held
+bool Fuzzer::HasFlakyEdges(Coverage &coverage) {
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    auto module_iter = flaky_edges.find(iter->module_name);
+    if (module_iter == flaky_edges.end()) continue;
+    for (auto offset_iter = iter->offsets.begin(); offset_iter != iter->offsets.end(); offset_iter++) {
+      if (module_iter->second.count(*offset_iter)) return true;
     }
   }
+  return false;
+}
+
+// records the outcome of reproducing coverage
+void Fuzzer::UpdateEdgeStability(Coverage &variable_coverage) {
+  edge_stability_mutex.Lock();
+
+  for (auto iter = variable_coverage.begin(); iter != variable_coverage.end(); iter++) {
+    std::unordered_set<uint64_t> &module_edges = flaky_edges[iter->module_name];
+    for (auto offset_iter = iter->offsets.begin(); offset_iter != iter->offsets.end(); offset_iter++) {
+      if (module_edges.insert(*offset_iter).second) num_flaky_edges++;
+    }
+  }
+
+  if (variable_coverage.empty()) {
+    stable_reproductions++;
+  } else {
+    stable_reproductions = 0;
+  }
+
+  edge_stability_mutex.Unlock();
+}
+
+// updates the corpus execution time distribution with
+// a new entry and recomputes the automatic timeout
+// called with queue_mutex held
+void Fuzzer::UpdateAutoTimeout(SampleQueueEntry *entry) {
+  if (!entry->exec_times.num_execs) return;
+
+  corpus_exec_times.Add(entry->exec_times.mean);
+
+  if (!auto_timeout) return;
+
+  // typical execution time of a corpus sample in ms
+  double typical = (corpus_exec_times.mean + 2 * sqrt(corpus_exec_times.Variance())) / 1000;
+  double new_timeout = typical * auto_timeout_multiplier;
+  if (new_timeout < AUTO_TIMEOUT_MIN) new_timeout = AUTO_TIMEOUT_MIN;
+  if (new_timeout > timeout) new_timeout = timeout;
+
+  if ((uint32_t)new_timeout != corpus_auto_timeout) {
+    corpus_auto_timeout = (uint32_t)new_timeout;
+    printf("Adjusting sample timeout to %u ms\n", corpus_auto_timeout);
+  }
+}
+
+// the timeout to use when fuzzing a particular sample
+// called with queue_mutex held
+uint32_t Fuzzer::GetSampleTimeout(SampleQueueEntry *entry) {
+  if (!auto_timeout || !corpus_exec_times.num_execs) return timeout;
+
+  // samples that are known to be slower than the
+  // rest of the corpus get proportionally more time
+  double sample_timeout = entry->exec_times.mean / 1000 * auto_timeout_multiplier;
+  if (sample_timeout < corpus_auto_timeout) return corpus_auto_timeout;
+  if (sample_timeout > timeout) return timeout;
+  return (uint32_t)sample_timeout;
+}
+
+void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
+  job->input_file = false;
+
+  if (save_mutator_state.exchange(false)) {
+    FILE *fp = journal.BeginRecord(JOURNAL_RECORD_MUTATOR_STATE);
+    tc->mutator->SaveGlobalState(fp);
+    journal.EndRecord();
+  }
+
+  queue_mutex.Lock();
   
   // after restoring the state
   // ignore the previously seen (restored) coverage
   if(!tc->coverage_initialized) {
     if(incremental_coverage) {
-      coverage_mutex.Lock();
-      tc->instrumentation->IgnoreCoverage(fuzzer_coverage);
-      coverage_mutex.Unlock();
+      Coverage restored_coverage;
+      fuzzer_coverage.ToCoverage(restored_coverage);
+      tc->instrumentation->IgnoreCoverage(restored_coverage);
     }
     tc->coverage_initialized = true;
   }
@@ -599,7 +957,7 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   {
     last_server_update_time_ms = GetCurTime();
     server_mutex.Lock();
-    server->GetUpdates(server_samples, total_execs);
+    server->GetUpdates(server_samples, GetTotalExecs());
     server_mutex.Unlock();
     state = SERVER_SAMPLE_PROCESSING;
   }
@@ -608,11 +966,11 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
     if (input_files.empty() && !samples_pending) {
       if (server) {
         server_mutex.Lock();
-        coverage_mutex.Lock();
-        server->ReportNewCoverage(&fuzzer_coverage, NULL);
-        coverage_mutex.Unlock();
+        Coverage input_coverage;
+        fuzzer_coverage.ToCoverage(input_coverage);
+        server->ReportNewCoverage(&input_coverage, NULL);
         last_server_update_time_ms = GetCurTime();
-        server->GetUpdates(server_samples, total_execs);
+        server->GetUpdates(server_samples, GetTotalExecs());
         server_mutex.Unlock();
         state = SERVER_SAMPLE_PROCESSING;
       } else {
@@ -646,11 +1004,21 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
 
   // create a job according to the state
   if (state == FUZZING && !dry_run) {
-    if (sample_queue.empty()) {
+    if (sample_queue.empty() && !shared_entries.empty()) {
+      // rather than waiting, help with the deterministic
+      // mutations of a sample another thread is fuzzing
+      job->type = FUZZ_SHARED;
+      job->entry = shared_entries.front();
+      job->timeout = GetSampleTimeout(job->entry);
+      // the next idle thread gets a different sample
+      shared_entries.pop_front();
+      shared_entries.push_back(job->entry);
+    } else if (sample_queue.empty()) {
       job->type = WAIT;
     } else {
       job->type = FUZZ;
       job->entry = sample_queue.top();
+      job->timeout = GetSampleTimeout(job->entry);
       sample_queue.pop();
     }
   } else if (state == INPUT_SAMPLE_PROCESSING) {
@@ -658,15 +1026,11 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
       job->type = WAIT;
     } else {
       job->type = PROCESS_SAMPLE;
-      std::string filename = input_files.front();
-      input_files.pop_front();
-      printf("Running input sample %s\n", filename.c_str());
+      // the file is loaded by the worker, see LoadInputSample
       job->sample = new Sample();
-      job->sample->Load(filename.c_str());
-      if (job->sample->size > Sample::max_size) {
-        WARN("Input sample larger than maximum sample size. Will be trimmed");
-        job->sample->Trim(Sample::max_size);
-      }
+      job->sample->filename = input_files.front();
+      job->input_file = true;
+      input_files.pop_front();
       samples_pending++;
     }
   } else if (state == SERVER_SAMPLE_PROCESSING) {
@@ -694,16 +1058,25 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   queue_mutex.Unlock();
 }
 
-void Fuzzer::JobDone(FuzzerJob* job) {
+void Fuzzer::JobDone(ThreadContext *tc, FuzzerJob* job) {
+  if (job->type == FUZZ) {
+    if (job->discard_sample) job->entry->discarded = 1;
+    // the entry is still owned by this thread
+    JournalEntry(tc, job->entry);
+  }
+
   queue_mutex.Lock();
 
   if (job->type == FUZZ) {
+    if (share_deterministic) shared_entries.remove(job->entry);
     if (job->discard_sample) {
-      job->entry->discarded = 1;
       num_samples_discarded++;
     } else {
       sample_queue.push(job->entry);
     }
+  } else if (job->type == FUZZ_SHARED) {
+    // all the shared work was claimed
+    shared_entries.remove(job->entry);
   } else if (job->type == PROCESS_SAMPLE) {
     delete job->sample;
     samples_pending--;
@@ -714,6 +1087,8 @@ void Fuzzer::JobDone(FuzzerJob* job) {
 
 void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
   SampleQueueEntry* entry = job->entry;
+
+  if (entry->restore_pending) FinishRestore(tc, entry);
   
   tc->mutator->InitRound(entry->sample, entry->context);
 
@@ -725,53 +1100,240 @@ void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
 
   entry->sample->EnsureLoaded();
 
+  if (cmplog && tc->mutator->NeedsCmpLog(entry->context)) {
+    RunCmpLog(tc, entry, job->timeout);
+  }
+
+  if (share_deterministic) {
+    // the entry is only shared once its sample and context are loaded
+    queue_mutex.Lock();
+    shared_entries.push_back(entry);
+    queue_mutex.Unlock();
+  }
+
+  if (tc->pipeline) {
+    FuzzJobPipelined(tc, job);
+    if (!keep_samples_in_memory) {
+      entry->sample->FreeMemory();
+    }
+    return;
+  }
+
+  bool patch_mutants = this->patch_mutants && tc->mutator->SupportsPatching();
+  // set once mutated_sample holds a (patched) copy of entry->sample
+  bool have_base = false;
+
   while (1) {
-    Sample mutated_sample = *entry->sample;
-    if (!tc->mutator->Mutate(&mutated_sample, tc->prng, tc->all_samples_local)) break;
-    if (mutated_sample.size > Sample::max_size) {
+    EnterStage(tc, STAGE_MUTATION);
+    // reuses the memory of the previous iteration
+    Sample *mutated_sample = &tc->mutated_sample;
+    if (tc->zero_copy) {
+      // the sample gets copied to the delivery buffer
+      // once and is mutated there
+      tc->zero_copy = tc->sampleDelivery->AttachSample(mutated_sample);
+    }
+    if (!have_base || !mutated_sample->RevertPatches(*entry->sample)) {
+      *mutated_sample = *entry->sample;
+    }
+    if (patch_mutants) {
+      mutated_sample->StartPatchLog();
+      have_base = true;
+    }
+    if (!tc->mutator->Mutate(mutated_sample, tc->prng, tc->all_samples_local)) break;
+    if (mutated_sample->size > Sample::max_size) {
+      continue;
+    }
+
+    if (tc->recent_samples &&
+        tc->recent_samples->CheckAndAdd(mutated_sample->Hash()))
+    {
+      // the same input was run recently, so
+      // running it again won't find anything new
+      ThreadCounters::Add(tc->counters.skipped_duplicates);
+      if (effector_map) tc->mutator->NotifyCoverageHash(0);
+      tc->mutator->NotifyResult(OK, false);
       continue;
     }
 
+    EnterStage(tc, STAGE_EXECUTION);
+
     int has_new_coverage;
-    RunResult result = RunSample(tc, &mutated_sample, &has_new_coverage, true, true, init_timeout, timeout, entry->sample);
+    RunResult result = RunSample(tc, mutated_sample, &has_new_coverage, true, true, init_timeout, job->timeout, entry->sample);
     AdjustSamplePriority(tc, entry, has_new_coverage);
+    if (effector_map) tc->mutator->NotifyCoverageHash(tc->coverage_hash);
     tc->mutator->NotifyResult(result, has_new_coverage);
 
-    entry->num_runs++;
-    if (has_new_coverage) {
-      entry->num_newcoverage++;
-      if(TrackHotOffsets()) {
-        size_t diff_offset = entry->sample->FindFirstDiff(mutated_sample);
-        tc->mutator->AddHotOffset(entry->context, diff_offset);
-      }
+    if (has_new_coverage && TrackHotOffsets()) {
+      size_t diff_offset = mutated_sample->FindFirstPatchDiff(*entry->sample);
+      tc->mutator->AddHotOffset(entry->context, diff_offset);
     }
-    
-    if (result == HANG) entry->num_hangs++;
-    if (result == CRASH) entry->num_crashes++;
-    if ((entry->num_hangs > 10) &&
-      (entry->num_hangs > (entry->num_runs * acceptable_hang_ratio)))
-    {
-      WARN("Sample %lld produces too many hangs. Discarding\n", entry->sample_index);
+
+    if (UpdateEntryStats(entry, result, has_new_coverage)) {
       job->discard_sample = true;
       break;
     }
-    if ((entry->num_crashes > 100) &&
-      (entry->num_crashes > (entry->num_runs * acceptable_crash_ratio)))
+  }
+
+  if (!keep_samples_in_memory) {
+    entry->sample->FreeMemory();
+  }
+}
+
+// Runs the deterministic mutations of an entry owned by another
+// thread, chunk by chunk, until all of them are claimed.
+// The entry statistics and hot offsets are left to the owner,
+// new coverage found here is saved as usual.
+void Fuzzer::FuzzSharedJob(ThreadContext* tc, FuzzerJob* job) {
+  SampleQueueEntry* entry = job->entry;
+
+  printf("Sharing deterministic mutations of sample %05lld\n", entry->sample_index);
+
+  while (1) {
+    EnterStage(tc, STAGE_MUTATION);
+    Sample *mutated_sample = &tc->mutated_sample;
+    if (tc->zero_copy) {
+      tc->zero_copy = tc->sampleDelivery->AttachSample(mutated_sample);
+    }
+    *mutated_sample = *entry->sample;
+    Mutator *mutator = tc->mutator->MutateShared(mutated_sample, entry->context, tc->prng, tc->all_samples_local);
+    if (!mutator) break;
+    if (mutated_sample->size > Sample::max_size) {
+      continue;
+    }
+
+    if (tc->recent_samples &&
+        tc->recent_samples->CheckAndAdd(mutated_sample->Hash()))
     {
-      WARN("Sample %lld produces too many crashes. Discarding\n", entry->sample_index);
+      ThreadCounters::Add(tc->counters.skipped_duplicates);
+      if (effector_map) mutator->NotifyCoverageHash(0);
+      mutator->NotifyResult(OK, false);
+      continue;
+    }
+
+    EnterStage(tc, STAGE_EXECUTION);
+
+    int has_new_coverage;
+    RunResult result = RunSample(tc, mutated_sample, &has_new_coverage, true, true, init_timeout, job->timeout, entry->sample);
+    if (effector_map) mutator->NotifyCoverageHash(tc->coverage_hash);
+    mutator->NotifyResult(result, has_new_coverage);
+  }
+}
+
+// the mutator is only used by the pipeline until EndRound(),
+// results and hot offsets are passed to it through Done()
+void Fuzzer::FuzzJobPipelined(ThreadContext* tc, FuzzerJob* job) {
+  SampleQueueEntry* entry = job->entry;
+
+  tc->pipeline->StartRound(entry->sample, entry->context,
+                           &tc->all_samples_local, tc->recent_samples);
+
+  while (1) {
+    // time spent waiting for the next mutant
+    EnterStage(tc, STAGE_MUTATION);
+    Mutant *mutant = tc->pipeline->Next();
+    if (!mutant) break;
+
+    if (mutant->duplicate) {
+      ThreadCounters::Add(tc->counters.skipped_duplicates);
+      tc->pipeline->Done(mutant, OK, false, SIZE_MAX, 0);
+      continue;
+    }
+
+    EnterStage(tc, STAGE_EXECUTION);
+
+    int has_new_coverage;
+    RunResult result = RunSample(tc, &mutant->sample, &has_new_coverage, true, true, init_timeout, job->timeout, entry->sample);
+    AdjustSamplePriority(tc, entry, has_new_coverage);
+
+    size_t hot_offset = SIZE_MAX;
+    if (has_new_coverage && TrackHotOffsets()) {
+      hot_offset = mutant->sample.FindFirstDiff(*entry->sample);
+    }
+    tc->pipeline->Done(mutant, result, has_new_coverage, hot_offset,
+                       effector_map ? tc->coverage_hash : 0);
+
+    if (UpdateEntryStats(entry, result, has_new_coverage)) {
       job->discard_sample = true;
       break;
     }
   }
 
-  if (!keep_samples_in_memory) {
-    entry->sample->FreeMemory();
+  tc->pipeline->EndRound();
+}
+
+// runs the sample once more with comparison logging,
+// the result is cached in the mutator context.
+// timeout comes from the job, as computing it needs queue_mutex
+void Fuzzer::RunCmpLog(ThreadContext* tc, SampleQueueEntry* entry, uint32_t timeout) {
+  std::vector<CmpLogEntry> entries;
+  Coverage coverage;
+
+  EnterStage(tc, STAGE_EXECUTION);
+  tc->instrumentation->SetCmpLog(true);
+  RunResult result = RunSampleAndGetCoverage(tc, entry->sample, &coverage, init_timeout, timeout);
+  tc->instrumentation->SetCmpLog(false);
+  if (result == OK) tc->instrumentation->GetCmpLog(entries);
+
+  // a sample that didn't run normally doesn't get another try
+  tc->mutator->AddCmpLog(entry->context, entry->sample, entries);
+}
+
+bool Fuzzer::UpdateEntryStats(SampleQueueEntry* entry, RunResult result, int has_new_coverage) {
+  entry->num_runs++;
+  if (has_new_coverage) entry->num_newcoverage++;
+  if (result == HANG) entry->num_hangs++;
+  if (result == CRASH) entry->num_crashes++;
+
+  if ((entry->num_hangs > 10) &&
+    (entry->num_hangs > (entry->num_runs * acceptable_hang_ratio)))
+  {
+    WARN("Sample %lld produces too many hangs. Discarding\n", entry->sample_index);
+    return true;
+  }
+  if ((entry->num_crashes > 100) &&
+    (entry->num_crashes > (entry->num_runs * acceptable_crash_ratio)))
+  {
+    WARN("Sample %lld produces too many crashes. Discarding\n", entry->sample_index);
+    return true;
+  }
+  return false;
+}
+
+bool Fuzzer::LoadInputSample(ThreadContext* tc, FuzzerJob* job) {
+  Sample *sample = job->sample;
+
+  // the sample shouldn't keep pointing to the input directory
+  std::string filename = sample->filename;
+  sample->filename.clear();
+
+  if (!sample->Load(filename.c_str())) {
+    WARN("Error reading input sample %s", filename.c_str());
+    return false;
   }
+
+  input_hashes_mutex.Lock();
+  bool duplicate = !input_hashes.insert(sample->Hash()).second;
+  input_hashes_mutex.Unlock();
+
+  if (duplicate) {
+    printf("Skipping input sample %s, same as a previous input\n", filename.c_str());
+    return false;
+  }
+
+  printf("Running input sample %s\n", filename.c_str());
+  if (sample->size > Sample::max_size) {
+    WARN("Input sample larger than maximum sample size. Will be trimmed");
+    sample->Trim(Sample::max_size);
+  }
+
+  return true;
 }
 
 void Fuzzer::ProcessSample(ThreadContext* tc, FuzzerJob* job) {
   int has_new_coverage = 0;
+  if (job->input_file && !LoadInputSample(tc, job)) return;
   job->sample->EnsureLoaded();
+  EnterStage(tc, STAGE_EXECUTION);
   RunResult result = RunSample(tc, job->sample, &has_new_coverage, false, false, init_timeout, corpus_timeout, NULL);
   if (result == CRASH) {
     WARN("Input sample resulted in a crash");
@@ -790,6 +1352,7 @@ void Fuzzer::RunFuzzerThread(ThreadContext *tc) {
   while (1) {
     FuzzerJob job;
 
+    EnterStage(tc, STAGE_SYNC);
     SynchronizeAndGetJob(tc, &job);
 
     switch (job.type) {
@@ -806,115 +1369,173 @@ void Fuzzer::RunFuzzerThread(ThreadContext *tc) {
     case FUZZ:
       FuzzJob(tc, &job);
       break;
+    case FUZZ_SHARED:
+      FuzzSharedJob(tc, &job);
+      break;
     default:
       FATAL("Unknown job type");
       break;
     }
 
-    JobDone(&job);
+    EnterStage(tc, STAGE_SYNC);
+    JobDone(tc, &job);
   }
 }
 
-void Fuzzer::SaveState(ThreadContext *tc) {
-  // don't save during input sample processing
-  if(state == INPUT_SAMPLE_PROCESSING) return;
-
-  output_mutex.Lock();
-  coverage_mutex.Lock();
- 
-  std::string out_file = DirJoin(out_dir, std::string("state.dat"));
-  FILE *fp = fopen(out_file.c_str(), "wb");
-  if (!fp) {
-    FATAL("Error saving state");
-  }
-
-  fwrite(&num_samples, sizeof(num_samples), 1, fp);
-  fwrite(&num_samples_discarded, sizeof(num_samples_discarded), 1, fp);
+// writes the parts of the state that are not journaled as
+// they change, then folds the journal into state.dat.
+// Called from the main thread, doesn't block the fuzzing threads
+// except for the short time it takes to append the records.
+void Fuzzer::Checkpoint() {
+  FILE *fp = journal.BeginRecord(JOURNAL_RECORD_COUNTERS);
+  uint64_t saved_num_samples = num_samples;
+  uint64_t saved_num_samples_discarded = num_samples_discarded;
+  uint64_t total_execs = GetTotalExecs();
+  fwrite(&saved_num_samples, sizeof(saved_num_samples), 1, fp);
+  fwrite(&saved_num_samples_discarded, sizeof(saved_num_samples_discarded), 1, fp);
   fwrite(&total_execs, sizeof(total_execs), 1, fp);
+  journal.EndRecord();
 
-  WriteCoverageBinary(fuzzer_coverage, fp);
-  
-  tc->mutator->SaveGlobalState(fp);
-  
-  uint64_t num_entries = all_entries.size();
-  fwrite(&num_entries, sizeof(num_entries), 1, fp);
-  for(SampleQueueEntry *entry : all_entries) {
-    entry->Save(fp);
-    tc->mutator->SaveContext(entry->context, fp);
-  }
+  // global mutator state is shared by the mutators of all threads,
+  // but a mutator can only be used by the thread that owns it.
+  // The record goes into the next segment.
+  save_mutator_state = true;
 
-  if (server) server->SaveState(fp);
+  if (server) {
+    server_mutex.Lock();
+    fp = journal.BeginRecord(JOURNAL_RECORD_SERVER_STATE);
+    server->SaveState(fp);
+    journal.EndRecord();
+    server_mutex.Unlock();
+  }
 
-  // let every correctly saved state end with
-  // hex('fuzzstat');
-  uint64_t sentry = 0x66757a7a73746174;
-  fwrite(&sentry, sizeof(sentry), 1, fp);
+  // compacting rewrites the whole state,
+  // so it's only done once enough changes piled up
+  journal.Rotate();
+  if (journal.NeedsCompaction()) journal.Compact();
+}
 
-  fclose(fp);
+void Fuzzer::JournalEntry(ThreadContext *tc, SampleQueueEntry *entry) {
+  FILE *fp = journal.BeginRecord(JOURNAL_RECORD_ENTRY, entry->sample_index);
+  entry->Save(fp);
+  tc->mutator->SaveContext(entry->context, fp);
+  journal.EndRecord();
+}
 
-  coverage_mutex.Unlock();
-  output_mutex.Unlock();
+void Fuzzer::JournalCoverage(Coverage &coverage) {
+  if (coverage.empty()) return;
+  FILE *fp = journal.BeginRecord(JOURNAL_RECORD_COVERAGE);
+  WriteCoverageBinary(coverage, fp);
+  journal.EndRecord();
 }
 
-void Fuzzer::RestoreState(ThreadContext *tc) {
-  output_mutex.Lock();
-  coverage_mutex.Lock();
-  
-  std::string out_file = DirJoin(out_dir, std::string("state.dat"));
-  FILE *fp = fopen(out_file.c_str(), "rb");
-  if (!fp) {
+// restores the fuzzer state before the fuzzing threads are started.
+// Entry metadata, coverage and, when samples are kept in memory,
+// the sample data are restored here, so that all samples (including
+// the discarded ones) are available for splicing right away.
+// Mutator contexts are loaded by FinishRestore() once the entry
+// gets scheduled, in parallel by the fuzzing threads
+void Fuzzer::RestoreState() {
+  uint64_t start_time = GetCurTime();
+
+  JournalSnapshot snapshot;
+  if (!journal.Load(&snapshot)) {
     FATAL("Error restoring state. Did the previous session run long enough for state to be saved?");
   }
 
-  fread(&num_samples, sizeof(num_samples), 1, fp);
-  fread(&num_samples_discarded, sizeof(num_samples_discarded), 1, fp);
-  fread(&total_execs, sizeof(total_execs), 1, fp);
- 
-  ReadCoverageBinary(fuzzer_coverage, fp);
-  
-  tc->mutator->LoadGlobalState(fp);
+  FILE *fp;
+
+  if (snapshot.counters.Exists()) {
+    fp = snapshot.SeekRecord(snapshot.counters);
+    uint64_t saved_num_samples, saved_num_samples_discarded, saved_total_execs;
+    fread(&saved_num_samples, sizeof(saved_num_samples), 1, fp);
+    fread(&saved_num_samples_discarded, sizeof(saved_num_samples_discarded), 1, fp);
+    fread(&saved_total_execs, sizeof(saved_total_execs), 1, fp);
+    num_samples = saved_num_samples;
+    restored_execs = saved_total_execs;
+  }
 
-  uint64_t num_entries;
-  fread(&num_entries, sizeof(num_entries), 1, fp);
+  for (JournalRecord &record : snapshot.coverage) {
+    Coverage record_coverage;
+    ReadCoverageBinary(record_coverage, snapshot.SeekRecord(record));
+    fuzzer_coverage.Merge(record_coverage);
+  }
+
+  if (snapshot.mutator_state.Exists()) {
+    for (ThreadContext *tc : thread_contexts) {
+      tc->mutator->LoadGlobalState(snapshot.SeekRecord(snapshot.mutator_state));
+    }
+  }
+
+  // entries journaled after the last checkpoint
+  // aren't accounted for in the counters
+  uint64_t restored_discarded = 0;
+
+  for (auto iter = snapshot.entries.begin(); iter != snapshot.entries.end(); iter++) {
+    fp = snapshot.SeekRecord(iter->second);
 
-  for (uint64_t i = 0; i < num_entries; i++) {
-    Sample *sample = new Sample();
     SampleQueueEntry *entry = new SampleQueueEntry;
     entry->Load(fp);
-    string outfile = DirJoin(sample_dir, entry->sample_filename);
-    sample->Load(outfile.c_str());
-    entry->sample = sample;
-    entry->context = tc->mutator->CreateSampleContext(sample);
-    tc->mutator->LoadContext(entry->context, fp);
-
-    if (TrackHotOffsets()) {
-      if (keep_samples_in_memory) {
-        sample_trie.AddSample(entry->sample);
-      }
-    }
+    snapshot.ReadRecordTail(iter->second, entry->context_data);
+    entry->restore_pending = true;
 
-    if (!keep_samples_in_memory) {
-      entry->sample->filename = outfile;
-      entry->sample->FreeMemory();
+    entry->sample = new Sample();
+    entry->sample->filename = DirJoin(sample_dir, entry->sample_filename);
+
+    if (entry->sample_index >= num_samples) num_samples = entry->sample_index + 1;
+    if (entry->discarded) restored_discarded++;
+
+    if (keep_samples_in_memory) {
+      LoadRestoredSample(entry);
+      if (TrackHotOffsets()) sample_trie.AddSample(entry->sample);
     }
 
-    all_samples.push_back(sample);
+    all_samples.push_back(entry->sample);
     all_entries.push_back(entry);
     if(!entry->discarded) sample_queue.push(entry);
+    UpdateAutoTimeout(entry);
   }
+
+  num_samples_discarded = restored_discarded;
   
-  if (server) server->LoadState(fp);
+  if (server && snapshot.server_state.Exists()) {
+    server->LoadState(snapshot.SeekRecord(snapshot.server_state));
+  }
+
+  SAY("Restored %zu samples in %llu ms\n", all_entries.size(), (unsigned long long)(GetCurTime() - start_time));
+}
+
+void Fuzzer::LoadRestoredSample(SampleQueueEntry *entry) {
+  Sample *sample = entry->sample;
+  if (entry->packed) {
+    if (!sample_pack.Get(entry->pack_segment, entry->pack_offset, entry->pack_size, sample)) {
+      FATAL("Error loading sample %s from the sample pack", entry->sample_filename.c_str());
+    }
+  } else if (!sample->Load()) {
+    FATAL("Error loading sample %s", sample->filename.c_str());
+  }
+}
+
+// loads the mutator context of a restored entry (and the sample,
+// if RestoreState() didn't already).
+// Called by the thread the entry is scheduled on.
+void Fuzzer::FinishRestore(ThreadContext *tc, SampleQueueEntry *entry) {
+  Sample *sample = entry->sample;
+  if (!keep_samples_in_memory) LoadRestoredSample(entry);
+
+  entry->context = tc->mutator->CreateSampleContext(sample);
 
-  uint64_t sentry;
-  fread(&sentry, sizeof(sentry), 1, fp);
-  if (sentry != 0x66757a7a73746174) {
-    FATAL("State could not be restored correctly");
+  if (!tc->restore_file) {
+    tc->restore_file = tmpfile();
+    if (!tc->restore_file) FATAL("Error creating a temporary file");
   }
+  rewind(tc->restore_file);
+  fwrite(entry->context_data.data(), 1, entry->context_data.size(), tc->restore_file);
+  rewind(tc->restore_file);
+  tc->mutator->LoadContext(entry->context, tc->restore_file);
 
-  fclose(fp);
-  
-  coverage_mutex.Unlock();
-  output_mutex.Unlock();
+  std::string().swap(entry->context_data);
+  entry->restore_pending = false;
 }
 
 void Fuzzer::AdjustSamplePriority(ThreadContext *tc, SampleQueueEntry *entry, int found_new_coverage) {
@@ -938,10 +1559,30 @@ Fuzzer::ThreadContext *Fuzzer::CreateThreadContext(int argc, char **argv, int th
   tc->prng = CreatePRNG(argc, argv, tc);
   tc->mutator = CreateMutator(argc, argv, tc);
   tc->instrumentation = CreateInstrumentation(argc, argv, tc);
+  if (cmplog && !tc->instrumentation->SupportsCmpLog()) {
+    FATAL("-cmplog is not supported by the instrumentation");
+  }
   tc->sampleDelivery = CreateSampleDelivery(argc, argv, tc);
   tc->minimizer = CreateMinimizer(argc, argv, tc);
   tc->range_tracker = CreateRangeTracker(argc, argv, tc);
   tc->coverage_initialized = false;
+  tc->last_exec_time = 0;
+  tc->calibration_stability = 1.0;
+  tc->stage = STAGE_SYNC;
+  tc->stage_start_time = GetCurTimeUs();
+  tc->restore_file = NULL;
+  tc->zero_copy = zero_copy;
+  tc->recent_samples = NULL;
+  if (dedup_mutants) {
+    tc->recent_samples = new RecentSampleSet(RECENT_SAMPLES_SIZE_LOG2);
+  }
+  tc->coverage_hash = 0;
+  tc->pipeline = NULL;
+  if (pipeline_mutants > 0) {
+    tc->pipeline = new MutantPipeline(tc->mutator, tc->prng, pipeline_mutants);
+    // pipelined mutants are built in the pipeline slots
+    tc->zero_copy = false;
+  }
   
   return tc;
 }
@@ -993,12 +1634,35 @@ SampleDelivery *Fuzzer::CreateSampleDelivery(int argc, char **argv, ThreadContex
       extension = string(".") + string(extension_opt);
     }
 
-    string outfile = DirJoin(out_dir, string("input_") + std::to_string(tc->thread_id) + extension);
-    ReplaceTargetCmdArg(tc, "@@", outfile.c_str());
-
     FileSampleDelivery* sampleDelivery = new FileSampleDelivery();
     sampleDelivery->Init(argc, argv);
-    sampleDelivery->SetFilename(outfile);
+
+    if (GetBinaryOption("-delivery_memfd", argc, argv, false)) {
+      if (extension_opt) {
+        WARN("-file_extension is ignored with -delivery_memfd");
+      }
+      if (!sampleDelivery->UseMemoryFile()) {
+        FATAL("-delivery_memfd is not supported on this platform");
+      }
+    } else {
+      string outfile;
+      char *delivery_dir = GetOption("-delivery_dir", argc, argv);
+      if (delivery_dir) {
+        // the directory (e.g. on tmpfs) might be shared
+        // with other fuzzer instances
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+        string pid = std::to_string(GetCurrentProcessId());
+#else
+        string pid = std::to_string(getpid());
+#endif
+        outfile = DirJoin(delivery_dir, string("input_") + pid + "_" + std::to_string(tc->thread_id) + extension);
+      } else {
+        outfile = DirJoin(out_dir, string("input_") + std::to_string(tc->thread_id) + extension);
+      }
+      sampleDelivery->SetFilename(outfile);
+    }
+
+    ReplaceTargetCmdArg(tc, "@@", sampleDelivery->GetFilename().c_str());
     return sampleDelivery;
 
   } else if (!strcmp(option, "shmem")) {
@@ -1059,6 +1723,16 @@ void Fuzzer::SampleQueueEntry::Save(FILE *fp) {
   uint64_t ranges_size = ranges.size();
   fwrite(&ranges_size, sizeof(ranges_size), 1, fp);
   fwrite(ranges.data(), sizeof(ranges[0]), ranges_size, fp);
+
+  fwrite(&exec_times.num_execs, sizeof(exec_times.num_execs), 1, fp);
+  fwrite(&exec_times.mean, sizeof(exec_times.mean), 1, fp);
+  fwrite(&exec_times.m2, sizeof(exec_times.m2), 1, fp);
+  fwrite(&stability, sizeof(stability), 1, fp);
+
+  fwrite(&packed, sizeof(packed), 1, fp);
+  fwrite(&pack_segment, sizeof(pack_segment), 1, fp);
+  fwrite(&pack_offset, sizeof(pack_offset), 1, fp);
+  fwrite(&pack_size, sizeof(pack_size), 1, fp);
 }
 
 void Fuzzer::SampleQueueEntry::Load(FILE *fp) {
@@ -1082,4 +1756,14 @@ void Fuzzer::SampleQueueEntry::Load(FILE *fp) {
   fread(&ranges_size, sizeof(ranges_size), 1, fp);
   ranges.resize(ranges_size);
   fread(ranges.data(), sizeof(ranges[0]), ranges_size, fp);
+
+  fread(&exec_times.num_execs, sizeof(exec_times.num_execs), 1, fp);
+  fread(&exec_times.mean, sizeof(exec_times.mean), 1, fp);
+  fread(&exec_times.m2, sizeof(exec_times.m2), 1, fp);
+  fread(&stability, sizeof(stability), 1, fp);
+
+  fread(&packed, sizeof(packed), 1, fp);
+  fread(&pack_segment, sizeof(pack_segment), 1, fp);
+  fread(&pack_offset, sizeof(pack_offset), 1, fp);
+  fread(&pack_size, sizeof(pack_size), 1, fp);
 }
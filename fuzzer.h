@@ -21,6 +21,8 @@ limitations under the License.
 #include <vector>
 #include <queue>
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 #include "prng.h"
 #include "mutex.h"
 #include "coverage.h"
@@ -28,6 +30,10 @@ limitations under the License.
 #include "minimizer.h"
 #include "range.h"
 #include "rangetracker.h"
+#include "statejournal.h"
+#include "samplepack.h"
+#include "mutantpipeline.h"
+#include "coveragebitmap.h"
 
 #ifdef linux
 #include "sancovinstrumentation.h"
@@ -46,11 +52,20 @@ class CoverageClient;
 #define DEFAULT_CRASH_REPRODUCE_RETRIES 10
 #define DEFAULT_COVERAGE_REPRODUCE_RETRIES 3
 
+// with -adaptive_coverage_retry, new coverage is reproduced
+// only once after this many reproductions in a row
+// didn't produce any flaky edges
+#define ADAPTIVE_RETRY_STABLE_REPRODUCTIONS 20
+
 #define DELIVERY_RETRY_TIMES 100
 
+// with -dedup_mutants, each thread remembers
+// (approximately) the last 64K mutants it ran
+#define RECENT_SAMPLES_SIZE_LOG2 16
+
 #define MAX_IDENTICAL_CRASHES 4
 
-// save state every 5 minutes
+// fold the state journal into state.dat every 5 minutes
 #define FUZZER_SAVE_INERVAL (5 * 60)
 
 // save stats every minute
@@ -58,6 +73,97 @@ class CoverageClient;
 
 #define MIN_SAMPLES_TO_GENERATE 10
 
+// with -auto_timeout, the hang timeout is a multiple
+// of the typical sample execution time in the corpus
+#define DEFAULT_AUTO_TIMEOUT_MULTIPLIER 5
+// but never lower than this (in ms)
+#define AUTO_TIMEOUT_MIN 20
+
+// running mean and variance of sample execution times
+// (in microseconds), computed using Welford's algorithm
+class ExecTimeStats {
+public:
+  ExecTimeStats() { Clear(); }
+
+  void Clear() {
+    num_execs = 0;
+    mean = 0;
+    m2 = 0;
+  }
+
+  void Add(double exec_time) {
+    num_execs++;
+    double delta = exec_time - mean;
+    mean += delta / num_execs;
+    m2 += delta * (exec_time - mean);
+  }
+
+  double Variance() {
+    if (num_execs < 2) return 0;
+    return m2 / (num_execs - 1);
+  }
+
+  uint64_t num_execs;
+  double mean;
+  double m2;
+};
+
+#define CACHE_LINE_SIZE 64
+
+// what a fuzzing thread is spending its time on
+enum FuzzerStage {
+  STAGE_MUTATION = 0,
+  STAGE_EXECUTION,
+  STAGE_REPRODUCTION,
+  STAGE_MINIMIZATION,
+  STAGE_SAVING,
+  STAGE_SYNC,
+  NUM_FUZZER_STAGES
+};
+
+extern const char *fuzzer_stage_names[NUM_FUZZER_STAGES];
+
+// counters of a single fuzzing thread. Only the owning thread
+// writes to them (so increments don't need to be atomic
+// read-modify-write operations), while the stats loop reads
+// them without taking any locks. Each block gets its own
+// cache lines so that threads don't contend on them.
+class alignas(CACHE_LINE_SIZE) ThreadCounters {
+public:
+  ThreadCounters();
+
+  static void Add(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> execs;
+  std::atomic<uint64_t> crashes;
+  std::atomic<uint64_t> hangs;
+  // mutants that weren't run because they were run recently
+  std::atomic<uint64_t> skipped_duplicates;
+  // time spent in each FuzzerStage, in microseconds
+  std::atomic<uint64_t> stage_time[NUM_FUZZER_STAGES];
+};
+
+// a point-in-time copy of fuzzer statistics
+class FuzzerStats {
+public:
+  struct ThreadStats {
+    uint64_t execs;
+    uint64_t stage_time[NUM_FUZZER_STAGES];
+  };
+
+  uint64_t total_execs;
+  uint64_t num_samples;
+  uint64_t num_samples_discarded;
+  uint64_t num_crashes;
+  uint64_t num_unique_crashes;
+  uint64_t num_hangs;
+  uint64_t num_offsets;
+  uint64_t num_skipped_duplicates;
+  std::vector<ThreadStats> threads;
+};
+
 class Fuzzer {
 public:
   void Run(int argc, char **argv);
@@ -85,6 +191,41 @@ public:
     
     bool coverage_initialized;
 
+    // execution time of the last run, in microseconds
+    uint64_t last_exec_time;
+
+    // calibration data collected by RunSample
+    // for the sample currently being run
+    ExecTimeStats calibration_times;
+    double calibration_stability;
+
+    ThreadCounters counters;
+    FuzzerStage stage;
+    uint64_t stage_start_time;
+
+    // scratch samples reused across iterations
+    // so that their memory doesn't get reallocated
+    // for every execution
+    Sample mutated_sample;
+    Sample filtered_sample;
+
+    // mutate samples directly in the delivery buffer
+    bool zero_copy;
+
+    // hashes of recently run mutants (with -dedup_mutants)
+    RecentSampleSet *recent_samples;
+
+    // produces mutants ahead of time (with -pipeline_mutants)
+    MutantPipeline *pipeline;
+
+    // HashCoverage() of the first run in the last RunSample call
+    // (with -effector_map), combined with the run result
+    uint64_t coverage_hash;
+
+    // scratch file used to pass restored
+    // mutator contexts to LoadContext()
+    FILE *restore_file;
+
     ~ThreadContext();
   };
 
@@ -93,7 +234,6 @@ public:
 protected:
 
   enum FuzzerState {
-    RESTORE_NEEDED,
     INPUT_SAMPLE_PROCESSING,
     SERVER_SAMPLE_PROCESSING,
     GENERATING_SAMPLES,
@@ -103,6 +243,9 @@ protected:
   enum JobType {
     PROCESS_SAMPLE,
     FUZZ,
+    // deterministic mutations of an entry owned
+    // by another thread (with -share_deterministic)
+    FUZZ_SHARED,
     WAIT,
   };
 
@@ -111,7 +254,8 @@ protected:
     SampleQueueEntry() : sample(NULL), context(NULL),
       priority(0), sample_index(0), num_runs(0),
       num_crashes(0), num_hangs(0), num_newcoverage(0),
-      discarded(0) {}
+      discarded(0), stability(1.0), packed(0), pack_segment(0),
+      pack_offset(0), pack_size(0), restore_pending(false) {}
 
     void Save(FILE *fp);
     void Load(FILE *fp);
@@ -128,6 +272,25 @@ protected:
     uint64_t num_hangs;
     uint64_t num_newcoverage;
     int32_t discarded;
+
+    // measured while reproducing coverage, before
+    // the sample was added to the corpus
+    ExecTimeStats exec_times;
+    // fraction of the sample coverage that was stable
+    double stability;
+
+    // location of the sample in the sample pack
+    // (with -pack_samples)
+    int32_t packed;
+    uint64_t pack_segment;
+    uint64_t pack_offset;
+    uint64_t pack_size;
+
+    // restored entries get their sample and mutator context
+    // loaded only once they are scheduled for the first time.
+    // Until then, the saved context is kept here.
+    bool restore_pending;
+    std::string context_data;
   };
   
   struct CmpEntryPtrs
@@ -144,6 +307,9 @@ protected:
   std::vector<Sample *> all_samples;
   std::vector<SampleQueueEntry *> all_entries;
   std::priority_queue<SampleQueueEntry *, std::vector<SampleQueueEntry *>, CmpEntryPtrs> sample_queue;
+  // entries being fuzzed whose deterministic mutations
+  // idle threads can help with (with -share_deterministic)
+  std::list<SampleQueueEntry *> shared_entries;
   
   struct FuzzerJob {
     JobType type;
@@ -152,6 +318,9 @@ protected:
       SampleQueueEntry* entry;
     };
     bool discard_sample;
+    // sample still needs to be loaded from sample->filename
+    bool input_file;
+    uint32_t timeout;
   };
 
   void PrintUsage();
@@ -187,21 +356,62 @@ protected:
 
   int InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stableCoverage, Coverage *variableCoverage);
 
+  int GetCoverageRetries(Coverage &coverage);
+  bool HasFlakyEdges(Coverage &coverage);
+  void UpdateEdgeStability(Coverage &variable_coverage);
+
+  void UpdateAutoTimeout(SampleQueueEntry *entry);
+  uint32_t GetSampleTimeout(SampleQueueEntry *entry);
+
   void SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job);
-  void JobDone(FuzzerJob* job);
+  void JobDone(ThreadContext *tc, FuzzerJob* job);
   void FuzzJob(ThreadContext* tc, FuzzerJob* job);
+  // the FuzzJob loop with mutants produced by tc->pipeline
+  void FuzzJobPipelined(ThreadContext* tc, FuzzerJob* job);
+  void FuzzSharedJob(ThreadContext* tc, FuzzerJob* job);
+  void RunCmpLog(ThreadContext* tc, SampleQueueEntry* entry, uint32_t timeout);
+  // updates the entry after one of its mutants ran,
+  // returns true if the entry should be discarded
+  bool UpdateEntryStats(SampleQueueEntry* entry, RunResult result, int has_new_coverage);
   void ProcessSample(ThreadContext* tc, FuzzerJob* job);
+  // loads an input file into job->sample outside of queue_mutex.
+  // Returns false if the file couldn't be read or is a
+  // byte-identical copy of an input that was already processed
+  bool LoadInputSample(ThreadContext* tc, FuzzerJob* job);
 
-  uint64_t num_crashes;
-  uint64_t num_unique_crashes;
-  uint64_t num_hangs;
-  uint64_t num_samples;
-  uint64_t num_samples_discarded;
+  FuzzerStage EnterStage(ThreadContext *tc, FuzzerStage stage);
+
+  void GetStats(FuzzerStats *stats);
+  uint64_t GetTotalExecs();
+  void PrintStats(FILE *fp, FuzzerStats *stats, FuzzerStats *last_stats, double secs);
+
+  // all thread contexts, only modified before the
+  // fuzzing threads are started
+  std::vector<ThreadContext *> thread_contexts;
+
+  // executions done in the previous sessions
+  std::atomic<uint64_t> restored_execs;
+
+  std::atomic<uint64_t> num_unique_crashes;
+  std::atomic<uint64_t> num_samples;
+  std::atomic<uint64_t> num_samples_discarded;
   uint64_t num_threads;
-  uint64_t total_execs;
+
+  // set by Checkpoint(), the next fuzzing thread that asks
+  // for a job saves the global state of its mutator
+  std::atomic<bool> save_mutator_state;
+
+  // index of the next hang file, protected by output_mutex
+  uint64_t hang_file_index;
   
-  void SaveState(ThreadContext *tc);
-  void RestoreState(ThreadContext *tc);
+  void Checkpoint();
+  void JournalEntry(ThreadContext *tc, SampleQueueEntry *entry);
+  void JournalCoverage(Coverage &coverage);
+  void RestoreState();
+  void FinishRestore(ThreadContext *tc, SampleQueueEntry *entry);
+  void LoadRestoredSample(SampleQueueEntry *entry);
+
+  StateJournal journal;
 
   std::string in_dir;
   std::string out_dir;
@@ -216,18 +426,38 @@ protected:
   uint32_t init_timeout;
   uint32_t corpus_timeout;
 
+  bool auto_timeout;
+  int auto_timeout_multiplier;
+  // distribution of mean execution times of corpus samples
+  ExecTimeStats corpus_exec_times;
+  // timeout derived from corpus_exec_times (in ms)
+  uint32_t corpus_auto_timeout;
+
   Mutex queue_mutex;
   Mutex output_mutex;
-  Mutex coverage_mutex;
-
-  Coverage fuzzer_coverage;
+  // coverage seen by all threads
+  AtomicCoverage fuzzer_coverage;
+
+  // edges that showed up in only some of the retries
+  // when reproducing coverage, per module.
+  // protected by edge_stability_mutex
+  Mutex edge_stability_mutex;
+  std::unordered_map<std::string, std::unordered_set<uint64_t>> flaky_edges;
+  uint64_t num_flaky_edges;
+  // number of consecutive reproductions without flaky edges
+  uint64_t stable_reproductions;
 
   Mutex server_mutex;
   CoverageClient *server;
   uint64_t last_server_update_time_ms;
   uint64_t server_update_interval_ms;
 
+  // sorted by file size, so that small inputs
+  // get to claim the coverage first
   std::list<std::string> input_files;
+  // hashes of the input samples seen so far
+  Mutex input_hashes_mutex;
+  std::unordered_set<uint64_t> input_hashes;
   std::list<Sample *> server_samples;
   FuzzerState state;
   size_t samples_pending;
@@ -240,9 +470,21 @@ protected:
 
   bool keep_samples_in_memory;
 
+  bool pack_samples;
+  SamplePack sample_pack;
+
   bool track_ranges;
 
+  bool zero_copy;
+  bool patch_mutants;
+  bool dedup_mutants;
+  int pipeline_mutants;
+  bool effector_map;
+  bool share_deterministic;
+  bool cmplog;
+
   int coverage_reproduce_retries;
+  bool adaptive_coverage_retry;
   int crash_reproduce_retries;
   bool clean_target_on_coverage;
   
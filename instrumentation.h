@@ -18,8 +18,10 @@ limitations under the License.
 
 #include <inttypes.h>
 #include <string>
+#include <vector>
 #include "coverage.h"
 #include "runresult.h"
+#include "cmplog.h"
 
 class Instrumentation {
 public:
@@ -43,6 +45,13 @@ public:
 
   virtual uint64_t GetReturnValue() { return 0; }
 
+  // with -cmplog, the runs made while the logging is enabled
+  // record the operands of the comparisons in the target
+  virtual bool SupportsCmpLog() { return false; }
+  virtual void SetCmpLog(bool enabled) { }
+  // the comparisons recorded during the last run
+  virtual void GetCmpLog(std::vector<CmpLogEntry> &entries) { }
+
   std::string AnonymizeAddress(void* addr);
 };
 
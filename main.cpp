@@ -20,11 +20,25 @@ limitations under the License.
 #include "mutators/grammar/grammar.h"
 #include "mutators/grammar/grammarmutator.h"
 #include "mutators/grammar/grammarminimizer.h"
+#include "mutators/chunk/chunkmutator.h"
 
 
 class BinaryFuzzer : public Fuzzer {
+public:
+  BinaryFuzzer() : dictionary_loaded(false) { }
+protected:
   Mutator *CreateMutator(int argc, char **argv, ThreadContext *tc) override;
   bool TrackHotOffsets() override { return true; }
+
+  // shared by the mutators of all threads
+  MutatorYieldStats pselect_stats;
+  RepeatMutatorStats repeat_stats;
+  TokenTable tokens;
+
+  // loaded by the first CreateMutator call
+  // (thread contexts are created one after another)
+  bool dictionary_loaded;
+  std::vector<std::string> dictionary;
 };
 
 Mutator * BinaryFuzzer::CreateMutator(int argc, char **argv, ThreadContext *tc) {
@@ -43,9 +57,27 @@ Mutator * BinaryFuzzer::CreateMutator(int argc, char **argv, ThreadContext *tc)
 
   int nrounds = GetIntOption("-iterations_per_round", argc, argv, 1000);
 
+  // tokens from the dictionary are used right away,
+  // harvested tokens once they are seen often enough
+  char *dictionary_file = GetOption("-dict", argc, argv);
+  if (dictionary_file && !dictionary_loaded) {
+    LoadDictionary(dictionary_file, dictionary);
+    for (std::string &token : dictionary) {
+      tokens.Add(token.data(), token.size(), TOKEN_MIN_SEEN);
+    }
+  }
+  dictionary_loaded = true;
+  bool use_tokens = dictionary_file || GetBinaryOption("-auto_dict", argc, argv, false);
+
   // a pretty simple mutation strategy
 
-  PSelectMutator *pselect = new PSelectMutator();
+  PSelectMutator *pselect;
+  if (GetBinaryOption("-adaptive_mutator_selection", argc, argv, false)) {
+    // the probabilities below are only the starting point
+    pselect = new AdaptivePSelectMutator(&pselect_stats);
+  } else {
+    pselect = new PSelectMutator();
+  }
 
   // select one of the mutators below with corresponding
   // probablilities
@@ -57,12 +89,30 @@ Mutator * BinaryFuzzer::CreateMutator(int argc, char **argv, ThreadContext *tc)
   pselect->AddMutator(new BlockFlipMutator(16, 64), 0.1);
   pselect->AddMutator(new BlockFlipMutator(1, 64, true), 0.1);
   pselect->AddMutator(new BlockDuplicateMutator(1, 128, 1, 8), 0.1);
-  pselect->AddMutator(new InterestingValueMutator(true), 0.1);
+  pselect->AddMutator(new InterestingValueMutator(true, use_tokens ? &tokens : NULL), 0.1);
+
+  // chunk-level mutations that keep the container format valid
+  char *chunk_format_spec = GetOption("-chunk_format", argc, argv);
+  if (chunk_format_spec) {
+    ChunkFormat chunk_format;
+    if (!chunk_format.Parse(chunk_format_spec)) {
+      FATAL("Error parsing chunk format %s", chunk_format_spec);
+    }
+    // a chunk mutant keeps the structure valid and gets past the
+    // format checks, so by default chunk mutations make up about
+    // a fifth of the mutations (the weights above add up to 1.8)
+    double chunk_weight = 0.5;
+    char *chunk_weight_opt = GetOption("-chunk_weight", argc, argv);
+    if (chunk_weight_opt) chunk_weight = strtod(chunk_weight_opt, NULL);
+    pselect->AddMutator(new ChunkMutator(chunk_format), chunk_weight);
+  }
 
   // SpliceMutator is not compatible with -keep_samples_in_memory=0
   // as it requires other samples in memory besides the one being
-  // fuzzed.
-  if (GetBinaryOption("-keep_samples_in_memory", argc, argv, true)) {
+  // fuzzed. Packed samples are always accessible.
+  if (GetBinaryOption("-keep_samples_in_memory", argc, argv, true) ||
+      GetBinaryOption("-pack_samples", argc, argv, false))
+  {
     pselect->AddMutator(new SpliceMutator(1, 0.5), 0.1);
     pselect->AddMutator(new SpliceMutator(2, 0.5), 0.1);
   }
@@ -79,21 +129,44 @@ Mutator * BinaryFuzzer::CreateMutator(int argc, char **argv, ThreadContext *tc)
   // potentially repeat the mutation
   // (do two or more mutations in a single cycle
   // 0 indicates that actual mutation rate will be adapted
-  RepeatMutator *repeater = new RepeatMutator(pselect_or_range, 0);
+  RepeatMutator *repeater = new RepeatMutator(pselect_or_range, 0, &repeat_stats);
+
+  // input-to-state replacements, tried once per sample
+  // before the other mutations
+  bool use_cmplog = GetBinaryOption("-cmplog", argc, argv, false);
 
   if(!use_deterministic_mutations && !deterministic_only) {
     
+    Mutator *round_mutator = repeater;
+    if (use_cmplog) {
+      MutatorSequence *sequence = new MutatorSequence(false);
+      sequence->AddMutator(new CmpLogMutator());
+      sequence->AddMutator(repeater);
+      round_mutator = sequence;
+    }
+
     // and have nrounds of this per sample cycle
-    NRoundMutator *mutator = new NRoundMutator(repeater, nrounds);
+    NRoundMutator *mutator = new NRoundMutator(round_mutator, nrounds);
     return mutator;
     
   } else {
     
     MutatorSequence *deterministic_sequence = new MutatorSequence(false, true);
+    bool use_effector_map = GetBinaryOption("-effector_map", argc, argv, false);
+    if (use_cmplog) {
+      deterministic_sequence->AddMutator(new CmpLogMutator());
+    }
     // do deterministic byte flip mutations (around hot bits)
-    deterministic_sequence->AddMutator(new DeterministicByteFlipMutator());
+    DeterministicByteFlipMutator *byte_flip_mutator = new DeterministicByteFlipMutator();
+    byte_flip_mutator->SetUseEffectorMap(use_effector_map);
+    deterministic_sequence->AddMutator(byte_flip_mutator);
     // ..followed by deterministc interesting values
-    deterministic_sequence->AddMutator(new DeterministicInterestingValueMutator(true));
+    DeterministicInterestingValueMutator *interesting_value_mutator = new DeterministicInterestingValueMutator(true);
+    interesting_value_mutator->SetUseEffectorMap(use_effector_map);
+    // bytes probed for the byte flips aren't probed again
+    interesting_value_mutator->ShareEffectorMap(byte_flip_mutator);
+    interesting_value_mutator->AddDictionary(dictionary);
+    deterministic_sequence->AddMutator(interesting_value_mutator);
     
     size_t deterministic_rounds, nondeterministic_rounds;
     if (deterministic_only) {
@@ -0,0 +1,163 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "common.h"
+#include "thread.h"
+#include "mutantpipeline.h"
+
+MutantPipeline::MutantPipeline(Mutator *mutator, PRNG *prng, size_t depth) :
+  mutator(mutator), prng(prng), sample(NULL), context(NULL),
+  all_samples(NULL), recent_samples(NULL), slots(depth),
+  produced(0), consumed(0), completed(0), notified(0),
+  round_active(false), mutator_done(false), stopping(false),
+  exiting(false), exited(false)
+{
+  if (!depth) FATAL("Mutant pipeline needs at least one slot");
+  CreateThread(StartProducer, this);
+}
+
+MutantPipeline::~MutantPipeline() {
+  std::unique_lock<std::mutex> lock(mutex);
+  exiting = true;
+  producer_cond.notify_one();
+  consumer_cond.wait(lock, [this] { return exited; });
+}
+
+void *MutantPipeline::StartProducer(void *arg) {
+  ((MutantPipeline *)arg)->RunProducer();
+  return NULL;
+}
+
+void MutantPipeline::StartRound(Sample *sample, MutatorSampleContext *context,
+                                std::vector<Sample *> *all_samples,
+                                RecentSampleSet *recent_samples)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  this->sample = sample;
+  this->context = context;
+  this->all_samples = all_samples;
+  this->recent_samples = recent_samples;
+  produced = consumed = completed = notified = 0;
+  mutator_done = false;
+  stopping = false;
+  round_active = true;
+  producer_cond.notify_one();
+}
+
+Mutant *MutantPipeline::Next() {
+  std::unique_lock<std::mutex> lock(mutex);
+  consumer_cond.wait(lock, [this] { return (consumed < produced) || mutator_done; });
+  if (consumed == produced) return NULL;
+  Mutant *mutant = &slots[consumed % slots.size()];
+  consumed++;
+  return mutant;
+}
+
+void MutantPipeline::Done(Mutant *mutant, RunResult result, bool has_new_coverage,
+                          size_t hot_offset, uint64_t coverage_hash)
+{
+  mutant->result = result;
+  mutant->has_new_coverage = has_new_coverage;
+  mutant->hot_offset = hot_offset;
+  mutant->coverage_hash = coverage_hash;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  completed++;
+  producer_cond.notify_one();
+}
+
+void MutantPipeline::EndRound() {
+  std::unique_lock<std::mutex> lock(mutex);
+  stopping = true;
+  producer_cond.notify_one();
+  consumer_cond.wait(lock, [this] { return !round_active; });
+}
+
+bool MutantPipeline::ProduceMutant(Mutant *mutant) {
+  while (1) {
+    mutant->sample = *sample;
+    if (!mutator->Mutate(&mutant->sample, prng, *all_samples)) return false;
+
+    mutant->record.clear();
+    mutator->RecordMutation(mutant->record);
+
+    // oversized mutants are dropped without a result,
+    // same as when the mutants aren't pipelined
+    if (mutant->sample.size > Sample::max_size) continue;
+
+    mutant->duplicate = recent_samples &&
+      recent_samples->CheckAndAdd(mutant->sample.Hash());
+    return true;
+  }
+}
+
+void MutantPipeline::NotifyCompleted(std::unique_lock<std::mutex> &lock) {
+  while (notified < completed) {
+    // the slot isn't reused before notified is incremented
+    Mutant *mutant = &slots[notified % slots.size()];
+    lock.unlock();
+
+    size_t pos = 0;
+    mutator->NotifyCoverageHash(mutant->coverage_hash);
+    mutator->NotifyRecordedResult(mutant->record, &pos, mutant->result, mutant->has_new_coverage);
+    if (mutant->hot_offset != SIZE_MAX) {
+      mutator->AddHotOffset(context, mutant->hot_offset);
+    }
+
+    lock.lock();
+    notified++;
+  }
+}
+
+void MutantPipeline::RunProducer() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (1) {
+    producer_cond.wait(lock, [this] { return round_active || exiting; });
+    if (exiting) break;
+
+    while (1) {
+      NotifyCompleted(lock);
+      if (stopping) break;
+
+      if (mutator_done || ((produced - notified) == slots.size())) {
+        producer_cond.wait(lock, [this] {
+          return stopping || (completed > notified) ||
+            (!mutator_done && ((produced - notified) < slots.size()));
+        });
+        continue;
+      }
+
+      Mutant *mutant = &slots[produced % slots.size()];
+      lock.unlock();
+      bool produced_mutant = ProduceMutant(mutant);
+      lock.lock();
+
+      if (produced_mutant) {
+        produced++;
+      } else {
+        mutator_done = true;
+      }
+      consumer_cond.notify_one();
+    }
+
+    round_active = false;
+    consumer_cond.notify_one();
+  }
+
+  exited = true;
+  consumer_cond.notify_one();
+}
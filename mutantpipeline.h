@@ -0,0 +1,119 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "sample.h"
+#include "prng.h"
+#include "mutator.h"
+#include "runresult.h"
+
+// a mutant produced by MutantPipeline, together with what
+// is needed to report its result to the mutators
+class Mutant {
+public:
+  Sample sample;
+  // identical to one of the recently produced mutants
+  bool duplicate;
+  // see Mutator::RecordMutation
+  std::vector<uint64_t> record;
+
+  RunResult result;
+  bool has_new_coverage;
+  // passed to Mutator::AddHotOffset, SIZE_MAX if none
+  size_t hot_offset;
+  // passed to Mutator::NotifyCoverageHash
+  uint64_t coverage_hash;
+};
+
+// Produces mutants on a separate thread, up to depth mutants
+// ahead of the fuzzing thread that runs them, so that mutating
+// the next sample overlaps with running the current one.
+// While a round is in progress, the mutator is only called from
+// the producer thread. Results are passed back to it and reported
+// in order, to the mutators that produced each mutant.
+// The fuzzing thread can still create and update contexts
+// of new samples (CreateSampleContext, AddHotOffset) during
+// a round, mutators must allow that.
+class MutantPipeline {
+public:
+  MutantPipeline(Mutator *mutator, PRNG *prng, size_t depth);
+  // must not be called while a round is in progress
+  ~MutantPipeline();
+
+  // starts producing mutants of sample. The mutator must
+  // already be set up for the round (InitRound, SetRanges).
+  // If recent_samples is not NULL, mutants identical to
+  // recent ones are marked as duplicates
+  void StartRound(Sample *sample, MutatorSampleContext *context,
+                  std::vector<Sample *> *all_samples,
+                  RecentSampleSet *recent_samples);
+
+  // waits for the next mutant. Returns NULL
+  // once the mutator has no more mutants
+  Mutant *Next();
+
+  // reports the result of a mutant returned by Next().
+  // Must be called before the next call to Next()
+  void Done(Mutant *mutant, RunResult result, bool has_new_coverage,
+            size_t hot_offset, uint64_t coverage_hash);
+
+  // stops producing mutants and waits until all reported
+  // results are passed to the mutator. Mutants that were
+  // produced, but not run, are dropped
+  void EndRound();
+
+protected:
+  static void *StartProducer(void *arg);
+  void RunProducer();
+  // returns false if the mutator has no more mutants
+  bool ProduceMutant(Mutant *mutant);
+  // reports the completed results, called with the lock held
+  void NotifyCompleted(std::unique_lock<std::mutex> &lock);
+
+  Mutator *mutator;
+  PRNG *prng;
+
+  // set for the duration of a round
+  Sample *sample;
+  MutatorSampleContext *context;
+  std::vector<Sample *> *all_samples;
+  RecentSampleSet *recent_samples;
+
+  std::mutex mutex;
+  std::condition_variable producer_cond;
+  std::condition_variable consumer_cond;
+
+  // mutant i is in slots[i % slots.size()]. The counters
+  // below only increase during a round, and produced - notified
+  // never exceeds the number of slots
+  std::vector<Mutant> slots;
+  uint64_t produced;
+  uint64_t consumed;
+  uint64_t completed;
+  uint64_t notified;
+
+  bool round_active;
+  bool mutator_done;
+  bool stopping;
+  bool exiting;
+  bool exited;
+};
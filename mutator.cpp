@@ -16,17 +16,41 @@ limitations under the License.
 
 #include "stdlib.h"
 #include "string.h"
+#include "ctype.h"
 #include "common.h"
 #include "mutator.h"
 
 #include <algorithm>
 
-Mutex RepeatMutator::stats_mutex;
-uint64_t RepeatMutator::stats[REPEAT_STATS];
-uint64_t RepeatMutator::nstats = 0;
-uint64_t RepeatMutator::next_stat = 0;
-uint64_t RepeatMutator::median_num_repeats = 2;
-float RepeatMutator::adapted_repeat_p = 0.75;
+// the yield of every option is estimated from its finds per execution,
+// starting from ADAPTIVE_SELECT_PRIOR_FINDS at the average yield.
+// The weights are the prior probabilities scaled by the yields,
+// with ADAPTIVE_SELECT_EXPLORATION of the weight following the prior
+static void ComputeYieldWeights(size_t n, const double *prior,
+                                const double *execs, const double *finds,
+                                double *weights)
+{
+  double psum = 0, execs_sum = 0, finds_sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    psum += prior[i];
+    execs_sum += execs[i];
+    finds_sum += finds[i];
+  }
+  double average_yield = (finds_sum + 1) / (execs_sum + 1);
+
+  double score_sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    double yield = (finds[i] + ADAPTIVE_SELECT_PRIOR_FINDS) /
+      (execs[i] + ADAPTIVE_SELECT_PRIOR_FINDS / average_yield);
+    weights[i] = prior[i] * yield;
+    score_sum += weights[i];
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    weights[i] = ADAPTIVE_SELECT_EXPLORATION * prior[i] / psum +
+      (1 - ADAPTIVE_SELECT_EXPLORATION) * weights[i] / score_sum;
+  }
+}
 
 int Mutator::GetRandBlock(size_t samplesize, size_t minblocksize, size_t maxblocksize, size_t *blockstart, size_t *blocksize, PRNG *prng) {
   if (samplesize == 0) return 0;
@@ -42,6 +66,7 @@ bool ByteFlipMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sampl
   if (inout_sample->size == 0) return true;
   int charpos = prng->Rand(0, (int)(inout_sample->size - 1));
   char c = (char)prng->Rand(0, 255);
+  inout_sample->Patch(charpos, 1);
   inout_sample->bytes[charpos] = c;
   return true;
 }
@@ -80,6 +105,7 @@ bool ArithmeticMutator::MutateArithmeticValue(Sample *inout_sample,
   int change = prng->Rand(-256, 256);
   value += change;
   if(flip_endian) value = FlipEndian(value);
+  inout_sample->Patch(blockstart, sizeof(T));
   *(T *)(inout_sample->bytes + blockstart) = value;
   return true;
 }
@@ -88,6 +114,7 @@ bool BlockFlipMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Samp
   // printf("In BlockFlipMutator::Mutate\n");
   size_t blocksize, blockpos;
   if (!GetRandBlock(inout_sample->size, min_block_size, max_block_size, &blockpos, &blocksize, prng)) return true;
+  inout_sample->Patch(blockpos, blocksize);
   if (uniform) {
     char c = (char)prng->Rand(0, 255);
     for (size_t i = 0; i<blocksize; i++) {
@@ -111,9 +138,7 @@ bool AppendMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample
   }
   if (append <= 0) return true;
   size_t new_size = old_size + append;
-  inout_sample->bytes =
-    (char *)realloc(inout_sample->bytes, new_size);
-  inout_sample->size = new_size;
+  inout_sample->Splice(old_size, 0, append);
   for (size_t i = old_size; i < new_size; i++) {
     inout_sample->bytes[i] = (char)prng->Rand(0, 255);
   }
@@ -129,22 +154,15 @@ bool BlockInsertMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sa
     to_insert = Sample::max_size - old_size;
   }
   size_t where = prng->Rand(0, (int)old_size);
-  size_t new_size = old_size + to_insert;
   if (to_insert <= 0) return true;
   
-  char *old_bytes = inout_sample->bytes;
-  char *new_bytes = (char *)malloc(new_size);
-  memcpy(new_bytes, old_bytes, where);
-  
+  // insert in place
+  inout_sample->Splice(where, 0, to_insert);
+  char *bytes = inout_sample->bytes;
   for (size_t i = 0; i < to_insert; i++) {
-    new_bytes[where + i] = (char)prng->Rand(0, 255);
+    bytes[where + i] = (char)prng->Rand(0, 255);
   }
-  
-  memcpy(new_bytes + where + to_insert, old_bytes + where, old_size - where);
 
-  if (old_bytes) free(old_bytes);
-  inout_sample->bytes = new_bytes;
-  inout_sample->size = new_size;
   return true;
 }
 
@@ -157,18 +175,12 @@ bool BlockDuplicateMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector
   if ((inout_sample->size + blockcount * blocksize) > Sample::max_size)
     blockcount = (Sample::max_size - (int64_t)inout_sample->size) / blocksize;
   if (blockcount <= 0) return true;
-  char *newbytes;
-  newbytes = (char *)malloc(inout_sample->size + blockcount * blocksize);
-  memcpy(newbytes, inout_sample->bytes, blockpos + blocksize);
+  // the copies go right after the block
+  inout_sample->Splice(blockpos + blocksize, 0, blockcount * blocksize);
+  char *bytes = inout_sample->bytes;
   for (int64_t i = 0; i<blockcount; i++) {
-    memcpy(newbytes + blockpos + (i + 1)*blocksize, inout_sample->bytes + blockpos, blocksize);
-  }
-  memcpy(newbytes + blockpos + (blockcount + 1)*blocksize, 
-         inout_sample->bytes + blockpos + blocksize,
-         inout_sample->size - blockpos - blocksize);
-  if (inout_sample->bytes) free(inout_sample->bytes);
-  inout_sample->bytes = newbytes;
-  inout_sample->size = inout_sample->size + blockcount * blocksize;
+    memcpy(bytes + blockpos + (i + 1)*blocksize, bytes + blockpos, blocksize);
+  }
   return true;
 }
 
@@ -180,15 +192,19 @@ void Mutator::AddInterestingValue(char *data, size_t size, std::vector<Sample>&
 
 bool InterestingValueMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
   // printf("In InterestingValueMutator::Mutate\n");
+  if (tokens && (prng->Rand() % 2) && MutateToken(inout_sample, prng)) return true;
   if (interesting_values.empty()) return true;
   Sample *interesting_sample = &interesting_values[prng->Rand(0, (int)interesting_values.size() - 1)];
   size_t blockstart, blocksize;
   if (!GetRandBlock(inout_sample->size, interesting_sample->size, interesting_sample->size, &blockstart, &blocksize, prng)) return true;
+  inout_sample->Patch(blockstart, interesting_sample->size);
   memcpy(inout_sample->bytes + blockstart, interesting_sample->bytes, interesting_sample->size);
   return true;
 }
 
-InterestingValueMutator::InterestingValueMutator(bool use_default_values) {
+InterestingValueMutator::InterestingValueMutator(bool use_default_values, TokenTable *tokens) :
+  tokens(tokens), last_token(-1)
+{
   if (use_default_values) {
     AddDefaultInterestingValues<uint16_t>(interesting_values);
     AddDefaultInterestingValues<uint32_t>(interesting_values);
@@ -196,6 +212,118 @@ InterestingValueMutator::InterestingValueMutator(bool use_default_values) {
   }
 }
 
+bool InterestingValueMutator::MutateToken(Sample *inout_sample, PRNG *prng) {
+  int64_t index = tokens->Select(prng);
+  if (index < 0) return false;
+
+  const char *data;
+  size_t size = tokens->GetToken(index, &data);
+
+  if (prng->Rand() % 2) {
+    // overwrite
+    size_t blockstart, blocksize;
+    if (!GetRandBlock(inout_sample->size, size, size, &blockstart, &blocksize, prng)) return false;
+    inout_sample->Patch(blockstart, size);
+    memcpy(inout_sample->bytes + blockstart, data, size);
+  } else {
+    // insert in place
+    size_t old_size = inout_sample->size;
+    if ((old_size + size) > Sample::max_size) return false;
+    size_t where = prng->Rand(0, (int)old_size);
+    inout_sample->Splice(where, 0, size);
+    memcpy(inout_sample->bytes + where, data, size);
+  }
+
+  last_token = index;
+  return true;
+}
+
+void InterestingValueMutator::NotifyResult(RunResult result, bool has_new_coverage) {
+  if (last_token >= 0) {
+    tokens->RecordResult(last_token, has_new_coverage || (result == CRASH));
+  }
+  last_token = -1;
+}
+
+void InterestingValueMutator::RecordMutation(std::vector<uint64_t> &record) {
+  record.push_back((uint64_t)(last_token + 1));
+  last_token = -1;
+}
+
+void InterestingValueMutator::NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) {
+  last_token = (int64_t)record[(*pos)++] - 1;
+  NotifyResult(result, has_new_coverage);
+}
+
+// operands that are also in the sample likely came from the sample
+static bool SampleContains(Sample *sample, const std::string &data) {
+  if (data.size() > sample->size) return false;
+  return std::search(sample->bytes, sample->bytes + sample->size,
+                     data.begin(), data.end()) != (sample->bytes + sample->size);
+}
+
+static bool IsPrintable(const std::string &data) {
+  for (char c : data) {
+    if (!isprint((unsigned char)c)) return false;
+  }
+  return true;
+}
+
+void InterestingValueMutator::AddCmpLog(MutatorSampleContext *context, Sample *sample, std::vector<CmpLogEntry> &entries) {
+  if (!tokens) return;
+
+  // a token is counted once per sample
+  std::set<std::string> harvested;
+
+  for (CmpLogEntry &entry : entries) {
+    for (int i = 0; i < 2; i++) {
+      uint8_t *op = i ? entry.op2 : entry.op1;
+      size_t size = i ? entry.size2 : entry.size1;
+      if (size > CMPLOG_OPERAND_SIZE) size = CMPLOG_OPERAND_SIZE;
+      std::string token((char *)op, size);
+
+      if (entry.type == CMPLOG_INTEGER) {
+        // only integers that are really short strings (magic values)
+        if (!IsPrintable(token)) continue;
+      } else {
+        while (!token.empty() && (token.back() == 0)) token.pop_back();
+      }
+
+      if ((token.size() < TOKEN_MIN_SIZE) || (token.size() > TOKEN_MAX_SIZE)) continue;
+      if (harvested.count(token)) continue;
+      if (SampleContains(sample, token)) continue;
+      harvested.insert(token);
+
+      tokens->Add(token.data(), token.size(), 1);
+    }
+  }
+}
+
+void InterestingValueMutator::AddInterestingSample(Sample *sample, size_t hot_offset) {
+  if (!tokens) return;
+  if (hot_offset >= sample->size) return;
+  if (!isprint((unsigned char)sample->bytes[hot_offset])) return;
+
+  // the printable run around the hot offset
+  size_t start = hot_offset;
+  while ((start > 0) && isprint((unsigned char)sample->bytes[start - 1])) start--;
+  size_t end = hot_offset + 1;
+  while ((end < sample->size) && isprint((unsigned char)sample->bytes[end])) end++;
+
+  size_t size = end - start;
+  if ((size < TOKEN_MIN_SIZE) || (size > TOKEN_MAX_SIZE)) return;
+
+  tokens->Add(sample->bytes + start, size, 1);
+}
+
+void InterestingValueMutator::SaveGlobalState(FILE *fp) {
+  if (tokens) tokens->Save(fp);
+}
+
+void InterestingValueMutator::LoadGlobalState(FILE *fp) {
+  if (tokens) tokens->Load(fp);
+}
+
 template<typename T> void Mutator::AddDefaultInterestingValues(std::vector<Sample>& interesting_values) {
   uint32_t M[] = {2, 3, 4, 6, 8, 10, 12, 16, 24, 32, 40, 48,
                   56, 64, 72, 80, 88, 96, 104, 112, 120, 128,
@@ -245,9 +373,10 @@ bool SpliceMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample
   if(inout_sample->size == 0) return false;
   if(other_sample->size == 0) return false;
 
+  // all splices are done in place, with the sizes clamped
+  // to max_size before anything is copied
   if(points == 1) {
     size_t point1, point2;
-    char *new_bytes;
     size_t new_sample_size;
     if(displace) {
       point1 = prng->Rand(0, (int)(inout_sample->size - 1));
@@ -260,16 +389,17 @@ bool SpliceMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample
     }
     new_sample_size = point1 + (other_sample->size - point2);
     if(new_sample_size == inout_sample->size) {
+      inout_sample->Patch(point1, other_sample->size - point2);
       memcpy(inout_sample->bytes + point1, other_sample->bytes + point2, other_sample->size - point2);
       return true;
     } else {
-      new_bytes = (char *)malloc(new_sample_size);
-      memcpy(new_bytes, inout_sample->bytes, point1);
-      memcpy(new_bytes + point1, other_sample->bytes + point2, other_sample->size - point2);
-      free(inout_sample->bytes);
-      inout_sample->bytes = new_bytes;
-      inout_sample->size = new_sample_size;
-      if (inout_sample->size > Sample::max_size) inout_sample->Trim(Sample::max_size);
+      size_t copy_size = other_sample->size - point2;
+      if (new_sample_size > Sample::max_size) {
+        if (point1 >= Sample::max_size) return true;
+        copy_size = Sample::max_size - point1;
+      }
+      inout_sample->Splice(point1, inout_sample->size - point1, copy_size);
+      memcpy(inout_sample->bytes + point1, other_sample->bytes + point2, copy_size);
       return true;
     }
   } else if(points != 2) {
@@ -284,18 +414,17 @@ bool SpliceMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample
     if(!GetRandBlock(other_sample->size, 1, other_sample->size, &blockstart2, &blocksize2, prng)) return true;
     blockstart3 = blockstart1 + blocksize1;
     blocksize3 = inout_sample->size - blockstart3;
-    size_t new_sample_size = blockstart1 + blocksize2 + blocksize3;
-    char *new_bytes = (char *)malloc(new_sample_size);
-    memcpy(new_bytes, inout_sample->bytes, blockstart1);
-    memcpy(new_bytes + blockstart1, other_sample->bytes + blockstart2, blocksize2);
-    memcpy(new_bytes + blockstart1 + blocksize2, inout_sample->bytes + blockstart3, blocksize3);
-    if(new_sample_size > Sample::max_size) {
-      new_sample_size = Sample::max_size;
-      new_bytes = (char *)realloc(new_bytes, Sample::max_size);
-    }
-    free(inout_sample->bytes);
-    inout_sample->bytes = new_bytes;
-    inout_sample->size = new_sample_size;
+    // whatever doesn't fit into max_size is cut from the end
+    if(blockstart1 >= Sample::max_size) return true;
+    if(blocksize2 > (Sample::max_size - blockstart1)) {
+      blocksize2 = Sample::max_size - blockstart1;
+    }
+    if(blocksize3 > (Sample::max_size - blockstart1 - blocksize2)) {
+      blocksize3 = Sample::max_size - blockstart1 - blocksize2;
+    }
+    inout_sample->Trim(blockstart3 + blocksize3);
+    inout_sample->Splice(blockstart1, blocksize1, blocksize2);
+    memcpy(inout_sample->bytes + blockstart1, other_sample->bytes + blockstart2, blocksize2);
     return true;
   } else {
     size_t blockstart, blocksize;
@@ -305,16 +434,12 @@ bool SpliceMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample
       blockstart = inout_sample->size;
     }
     if((blockstart + blocksize) <= inout_sample->size) {
+      inout_sample->Patch(blockstart, blocksize);
       memcpy(inout_sample->bytes + blockstart, other_sample->bytes + blockstart, blocksize);
       return true;
     }
-    size_t new_sample_size = blockstart + blocksize;
-    char *new_bytes = (char *)malloc(new_sample_size);
-    memcpy(new_bytes, inout_sample->bytes, blockstart);
-    memcpy(new_bytes + blockstart, other_sample->bytes + blockstart, blocksize);
-    free(inout_sample->bytes);
-    inout_sample->bytes = new_bytes;
-    inout_sample->size = new_sample_size;
+    inout_sample->Splice(blockstart, inout_sample->size - blockstart, blocksize);
+    memcpy(inout_sample->bytes + blockstart, other_sample->bytes + blockstart, blocksize);
     return true;
   }
 }
@@ -322,11 +447,7 @@ bool SpliceMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample
 void BaseDeterministicContext::AddHotOffset(size_t offset) {
   mutex.Lock();
 
-  // in any case, restart scan
-  cur_region = 0;
-  
   MutateRegion new_region;
-  new_region.cur_progress = 0;
 
   size_t newregion_start = offset;
   if(newregion_start < DETERMINISTIC_MUTATE_BYTES_PREVIOUS) newregion_start = 0;
@@ -336,7 +457,7 @@ void BaseDeterministicContext::AddHotOffset(size_t offset) {
   for(auto iter = regions.begin(); iter != regions.end(); iter++) {
     if(newregion_start < iter->start) {
       new_region.start = newregion_start;
-      new_region.cur = new_region.start;
+      new_region.claimed = new_region.start;
       if(iter->start > newregion_end) {
         new_region.end = newregion_end;
       } else {
@@ -351,61 +472,302 @@ void BaseDeterministicContext::AddHotOffset(size_t offset) {
         mutex.Unlock();
         return;
       }
-      // extend an existing region
+      // extend an existing region, the new bytes
+      // are handed out after the ones already claimed.
+      // Regions must not overlap, or bytes would get
+      // handed out twice
+      auto next = iter + 1;
+      if((next != regions.end()) && (next->start < newregion_end)) {
+        newregion_end = next->start;
+      }
       iter->end = newregion_end;
       mutex.Unlock();
       return;
     }
   }
   new_region.start = newregion_start;
-  new_region.cur = new_region.start;
+  new_region.claimed = new_region.start;
   new_region.end = newregion_end;
   regions.push_back(new_region);
   mutex.Unlock();
   return;
 }
 
-bool BaseDeterministicContext::GetNextByteToMutate(size_t *pos, size_t *progress, size_t max_progress) {
-  MutateRegion *region = NULL;
-  
-  while(cur_region < regions.size()) {
-    region = &(regions[cur_region]);
+bool BaseDeterministicContext::ClaimChunk(MutateChunk *chunk) {
+  mutex.Lock();
 
-    if(region->cur_progress >= max_progress) {
-      region->cur_progress = 0;
-      region->cur++;
+  bool found = false;
+  if(!released_chunks.empty()) {
+    *chunk = released_chunks.back();
+    released_chunks.pop_back();
+    found = true;
+  } else {
+    for(MutateRegion &region : regions) {
+      if(region.claimed >= region.end) continue;
+      chunk->start = region.claimed;
+      chunk->end = region.claimed + DETERMINISTIC_CHUNK_SIZE;
+      if(chunk->end > region.end) chunk->end = region.end;
+      chunk->cur = chunk->start;
+      chunk->cur_progress = 0;
+      chunk->probe_cur = chunk->start;
+      region.claimed = chunk->end;
+      found = true;
+      break;
     }
+  }
 
-    if(region->cur >= region->end) {
-      cur_region++;
-      continue;
+  if(found) active_chunks.push_back(*chunk);
+
+  mutex.Unlock();
+  return found;
+}
+
+void BaseDeterministicContext::ReleaseChunk(MutateChunk *chunk, bool done) {
+  mutex.Lock();
+
+  // chunks never overlap, so the start identifies the chunk
+  for(auto iter = active_chunks.begin(); iter != active_chunks.end(); iter++) {
+    if(iter->start == chunk->start) {
+      active_chunks.erase(iter);
+      break;
     }
+  }
+  if(!done) released_chunks.push_back(*chunk);
 
-    *pos = region->cur;
-    *progress = region->cur_progress;
-    region->cur_progress++;
-    return true;
+  mutex.Unlock();
+}
+
+bool BaseDeterministicContext::GetNextByteToMutate(MutateChunk *chunk, size_t *pos, size_t *progress, size_t max_progress, bool *probe) {
+  // the chunk belongs to the caller, no need to lock
+
+  if(probe) {
+    while(chunk->probe_cur < chunk->end) {
+      size_t probe_pos = chunk->probe_cur++;
+      if(effector_map->GetEffect(probe_pos) != EFFECTOR_UNKNOWN) continue;
+      *pos = probe_pos;
+      *probe = true;
+      return true;
+    }
   }
-  return false;
+
+  if(chunk->cur_progress >= max_progress) {
+    chunk->cur_progress = 0;
+    chunk->cur++;
+  }
+
+  if(probe && (chunk->cur_progress == 0)) {
+    while((chunk->cur < chunk->end) && (effector_map->GetEffect(chunk->cur) == EFFECTOR_NONE)) {
+      chunk->cur++;
+    }
+  }
+
+  if(chunk->cur >= chunk->end) return false;
+
+  *pos = chunk->cur;
+  *progress = chunk->cur_progress;
+  chunk->cur_progress++;
+  if(probe) *probe = false;
+  return true;
+}
+
+uint8_t EffectorMap::GetEffect(size_t pos) {
+  mutex.Lock();
+  uint8_t effect = EFFECTOR_UNKNOWN;
+  if(pos < effects.size()) effect = effects[pos];
+  mutex.Unlock();
+  return effect;
+}
+
+void EffectorMap::SetEffect(size_t pos, uint8_t effect) {
+  mutex.Lock();
+  if(pos >= effects.size()) {
+    effects.resize(pos + 1, EFFECTOR_UNKNOWN);
+  }
+  effects[pos] = effect;
+  mutex.Unlock();
+}
+
+bool EffectorMap::RequestBaseline() {
+  mutex.Lock();
+  bool ret = !baseline_requested;
+  baseline_requested = true;
+  mutex.Unlock();
+  return ret;
+}
+
+void EffectorMap::ResolveProbe(uint64_t probe, uint64_t coverage_hash) {
+  if(probe == EFFECTOR_PROBE_BASELINE) {
+    mutex.Lock();
+    baseline_hash = coverage_hash;
+    mutex.Unlock();
+    return;
+  }
+
+  mutex.Lock();
+  // without both hashes, assume the byte matters
+  bool effect = !coverage_hash || !baseline_hash ||
+    (coverage_hash != baseline_hash);
+  mutex.Unlock();
+
+  SetEffect(probe - EFFECTOR_PROBE_OFFSET, effect ? EFFECTOR_EFFECT : EFFECTOR_NONE);
+}
+
+void EffectorMap::Save(FILE *fp) {
+  mutex.Lock();
+  uint64_t effects_size = effects.size();
+  fwrite(&effects_size, sizeof(effects_size), 1, fp);
+  if (effects_size) {
+    fwrite(&effects[0], 1, effects_size, fp);
+  }
+  uint8_t baseline_requested_byte = baseline_requested;
+  fwrite(&baseline_requested_byte, sizeof(baseline_requested_byte), 1, fp);
+  fwrite(&baseline_hash, sizeof(baseline_hash), 1, fp);
+  mutex.Unlock();
+}
+
+void EffectorMap::Load(FILE *fp) {
+  mutex.Lock();
+  uint64_t effects_size;
+  fread(&effects_size, sizeof(effects_size), 1, fp);
+  effects.resize(effects_size);
+  if (effects_size) {
+    fread(&effects[0], 1, effects_size, fp);
+  }
+  uint8_t baseline_requested_byte;
+  fread(&baseline_requested_byte, sizeof(baseline_requested_byte), 1, fp);
+  baseline_requested = (baseline_requested_byte != 0);
+  fread(&baseline_hash, sizeof(baseline_hash), 1, fp);
+  mutex.Unlock();
+}
+
+bool BaseDeterministicContext::RequestBaseline() {
+  mutex.Lock();
+  // there is only something to probe if there are hot regions
+  bool has_bytes = !released_chunks.empty();
+  for(MutateRegion &region : regions) {
+    if(region.claimed < region.end) has_bytes = true;
+  }
+  mutex.Unlock();
+  if(!has_bytes) return false;
+  return effector_map->RequestBaseline();
+}
+
+void BaseDeterministicContext::Save(FILE *fp) {
+  mutex.Lock();
+  uint64_t num_regions = regions.size();
+  fwrite(&num_regions, sizeof(num_regions), 1, fp);
+  if (num_regions) {
+    fwrite(&regions[0], sizeof(regions[0]), num_regions, fp);
+  }
+  // chunks that are being worked on are saved as not
+  // started, progress is only checkpointed per chunk
+  std::vector<MutateChunk> chunks = released_chunks;
+  for (MutateChunk chunk : active_chunks) {
+    chunk.cur = chunk.start;
+    chunk.cur_progress = 0;
+    chunk.probe_cur = chunk.start;
+    chunks.push_back(chunk);
+  }
+  uint64_t num_chunks = chunks.size();
+  fwrite(&num_chunks, sizeof(num_chunks), 1, fp);
+  if (num_chunks) {
+    fwrite(&chunks[0], sizeof(chunks[0]), num_chunks, fp);
+  }
+  mutex.Unlock();
+  if (owns_effector_map) effector_map->Save(fp);
+}
+
+void BaseDeterministicContext::Load(FILE *fp) {
+  mutex.Lock();
+  uint64_t num_regions;
+  fread(&num_regions, sizeof(num_regions), 1, fp);
+  regions.resize(num_regions);
+  if (num_regions) {
+    fread(&regions[0], sizeof(regions[0]), num_regions, fp);
+  }
+  uint64_t num_chunks;
+  fread(&num_chunks, sizeof(num_chunks), 1, fp);
+  released_chunks.resize(num_chunks);
+  if (num_chunks) {
+    fread(&released_chunks[0], sizeof(released_chunks[0]), num_chunks, fp);
+  }
+  active_chunks.clear();
+  mutex.Unlock();
+  if (owns_effector_map) effector_map->Load(fp);
 }
 
 
 MutatorSampleContext *BaseDeterministicMutator::CreateSampleContext(Sample *sample) {
   BaseDeterministicContext *context = new BaseDeterministicContext;
+  if(effector_map_source) {
+    std::shared_ptr<EffectorMap> shared_map = effector_map_source->last_effector_map.lock();
+    if(shared_map) {
+      context->effector_map = shared_map;
+      context->owns_effector_map = false;
+    }
+  }
+  last_effector_map = context->effector_map;
   return context;
 }
 
+void BaseDeterministicMutator::SetContext(BaseDeterministicContext *context) {
+  if(chunk_context && (chunk_context != context)) {
+    chunk_context->ReleaseChunk(&chunk, false);
+    chunk_context = NULL;
+  }
+  this->context = context;
+}
+
+bool BaseDeterministicMutator::GetNextMutation(Sample *inout_sample, size_t *pos, size_t *progress, size_t max_progress, bool *probe) {
+  *probe = false;
+
+  if(use_effector_map && context->RequestBaseline()) {
+    // the unmodified sample
+    pending_probe = EFFECTOR_PROBE_BASELINE;
+    *probe = true;
+    return true;
+  }
+
+  while(1) {
+    if(!chunk_context) {
+      if(!context->ClaimChunk(&chunk)) return false;
+      chunk_context = context;
+    }
+
+    if(!context->GetNextByteToMutate(&chunk, pos, progress, max_progress, use_effector_map ? probe : NULL)) {
+      context->ReleaseChunk(&chunk, true);
+      chunk_context = NULL;
+      continue;
+    }
+    if(!*probe) return true;
+
+    // bytes past the end of the sample can't be flipped
+    if(*pos >= inout_sample->size) {
+      context->effector_map->SetEffect(*pos, EFFECTOR_EFFECT);
+      continue;
+    }
+
+    inout_sample->Patch(*pos, 1);
+    inout_sample->bytes[*pos] ^= 0xFF;
+    pending_probe = *pos + EFFECTOR_PROBE_OFFSET;
+    return true;
+  }
+}
+
 bool DeterministicByteFlipMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
   size_t pos;
   size_t value;
+  bool probe;
   
-  if(!context->GetNextByteToMutate(&pos, &value, 256)) {
+  if(!GetNextMutation(inout_sample, &pos, &value, 256, &probe)) {
     return false;
   }
+  if(probe) return true;
   
   if(pos >= inout_sample->size) {
     inout_sample->Resize(pos + 1);
   }
+  inout_sample->Patch(pos, 1);
   inout_sample->bytes[pos] = (char)(value);
   
   return true;
@@ -419,23 +781,199 @@ DeterministicInterestingValueMutator::DeterministicInterestingValueMutator(bool
   }
 }
 
+void DeterministicInterestingValueMutator::AddDictionary(std::vector<std::string> &dictionary) {
+  for (std::string &token : dictionary) {
+    AddInterestingValue((char *)token.data(), token.size(), interesting_values);
+  }
+}
+
 bool DeterministicInterestingValueMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
   size_t pos;
   size_t value_index;
+  bool probe;
   
-  if(!context->GetNextByteToMutate(&pos, &value_index, interesting_values.size())) {
+  if(!GetNextMutation(inout_sample, &pos, &value_index, interesting_values.size(), &probe)) {
     return false;
   }
+  if(probe) return true;
   
   Sample *interesting_sample = &interesting_values[value_index];
   if((pos + interesting_sample->size) > inout_sample->size) {
     inout_sample->Resize(pos + interesting_sample->size);
   }
+  inout_sample->Patch(pos, interesting_sample->size);
   memcpy(inout_sample->bytes + pos, interesting_sample->bytes, interesting_sample->size);
   
   return true;
 }
 
+static std::string IntegerBytes(uint64_t value, size_t size, bool big_endian) {
+  std::string bytes(size, 0);
+  for (size_t i = 0; i < size; i++) {
+    size_t index = big_endian ? (size - i - 1) : i;
+    bytes[index] = (char)(value & 0xFF);
+    value >>= 8;
+  }
+  return bytes;
+}
+
+void CmpLogMutator::AddReplacements(CmpLogContext *context, Sample *sample, const std::string &pattern,
+                                    const std::string &replacement, ReplacementSet &seen)
+{
+  if (pattern.empty() || (pattern.size() > sample->size)) return;
+  if (context->replacements.size() >= CMPLOG_MAX_REPLACEMENTS) return;
+
+  // only the bytes that change are replaced, so that e.g. the same value
+  // found as a 2-byte and a 4-byte integer gives a single replacement
+  size_t prefix = 0, size = pattern.size();
+  std::string data = replacement;
+  if (data.size() == size) {
+    while (size && (pattern[prefix] == data[prefix])) {
+      prefix++;
+      size--;
+    }
+    while (size && (pattern[prefix + size - 1] == data[prefix + size - 1])) size--;
+    if (!size) return;
+    data = data.substr(prefix, size);
+  }
+
+  size_t num_matches = 0;
+  const char *bytes = sample->bytes;
+  const char *end = sample->bytes + sample->size - pattern.size() + 1;
+  for (const char *p = bytes; p < end; p++) {
+    p = (const char *)memchr(p, pattern[0], end - p);
+    if (!p) break;
+    if (memcmp(p, pattern.data(), pattern.size())) continue;
+
+    uint64_t pos = p - bytes + prefix;
+    if (seen.insert({ pos, data }).second) {
+      context->replacements.push_back({ pos, size, data });
+      if (context->replacements.size() >= CMPLOG_MAX_REPLACEMENTS) return;
+    }
+
+    // frequent patterns are unlikely to be the compared bytes
+    if (++num_matches >= CMPLOG_MAX_MATCHES) return;
+  }
+}
+
+void CmpLogMutator::AddIntegerReplacements(CmpLogContext *context, Sample *sample, uint64_t from,
+                                           uint64_t to, size_t size, ReplacementSet &seen)
+{
+  // the target might compare a value computed from the input, e.g.
+  // length - 1, and checks like x < 10 need a value next to the operand
+  struct { int64_t from_delta; int64_t to_delta; } variants[] = {
+    { 0, 0 }, { 0, 1 }, { 0, -1 }, { 1, 1 }, { -1, -1 }
+  };
+
+  for (auto &variant : variants) {
+    uint64_t pattern = from + variant.from_delta;
+    uint64_t replacement = to + variant.to_delta;
+    for (int big_endian = 0; big_endian < ((size > 1) ? 2 : 1); big_endian++) {
+      AddReplacements(context, sample,
+                      IntegerBytes(pattern, size, big_endian != 0),
+                      IntegerBytes(replacement, size, big_endian != 0), seen);
+    }
+  }
+}
+
+void CmpLogMutator::AddCmpLog(MutatorSampleContext *context, Sample *sample, std::vector<CmpLogEntry> &entries) {
+  CmpLogContext *current_context = (CmpLogContext *)context;
+  current_context->has_cmplog = true;
+
+  // the same comparison is typically made many times
+  std::set<std::string> comparisons;
+  ReplacementSet seen;
+
+  for (CmpLogEntry &entry : entries) {
+    std::string op1((char *)entry.op1, entry.size1);
+    std::string op2((char *)entry.op2, entry.size2);
+    if (op1 == op2) continue;
+
+    std::string key = std::string(1, (char)entry.type) + op1 + std::string(1, 0) + op2;
+    if (!comparisons.insert(key).second) continue;
+    if (comparisons.size() > CMPLOG_MAX_COMPARISONS) break;
+
+    if (entry.type == CMPLOG_MEMORY) {
+      AddReplacements(current_context, sample, op1, op2, seen);
+      AddReplacements(current_context, sample, op2, op1, seen);
+      continue;
+    }
+
+    size_t size = entry.size1;
+    if ((size > sizeof(uint64_t)) || (size != entry.size2)) continue;
+    uint64_t value1 = 0, value2 = 0;
+    memcpy(&value1, entry.op1, size);
+    memcpy(&value2, entry.op2, size);
+
+    // wide comparisons often hold values that
+    // are stored in fewer bytes in the input
+    for (size_t width = size; width >= 2; width /= 2) {
+      if ((width < size) && (((value1 | value2) >> (width * 8)) != 0)) break;
+      AddIntegerReplacements(current_context, sample, value1, value2, width, seen);
+      AddIntegerReplacements(current_context, sample, value2, value1, width, seen);
+    }
+    if (size == 1) {
+      AddIntegerReplacements(current_context, sample, value1, value2, 1, seen);
+      AddIntegerReplacements(current_context, sample, value2, value1, 1, seen);
+    }
+  }
+}
+
+bool CmpLogMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
+  while (context->cur < context->replacements.size()) {
+    CmpLogContext::Replacement &replacement = context->replacements[context->cur++];
+    if ((replacement.pos + replacement.size) > inout_sample->size) continue;
+
+    size_t new_size = inout_sample->size - replacement.size + replacement.data.size();
+    if (new_size > Sample::max_size) continue;
+
+    if (replacement.data.size() == replacement.size) {
+      inout_sample->Patch(replacement.pos, replacement.size);
+    } else {
+      // the tail moves, so the mutated sample gets reverted by copying
+      inout_sample->Splice(replacement.pos, replacement.size, replacement.data.size());
+    }
+    memcpy(inout_sample->bytes + replacement.pos, replacement.data.data(), replacement.data.size());
+    return true;
+  }
+  return false;
+}
+
+void CmpLogMutator::SaveContext(MutatorSampleContext *context, FILE *fp) {
+  CmpLogContext *current_context = (CmpLogContext *)context;
+  uint8_t has_cmplog = current_context->has_cmplog;
+  fwrite(&has_cmplog, sizeof(has_cmplog), 1, fp);
+  fwrite(&current_context->cur, sizeof(current_context->cur), 1, fp);
+  uint64_t num_replacements = current_context->replacements.size();
+  fwrite(&num_replacements, sizeof(num_replacements), 1, fp);
+  for (CmpLogContext::Replacement &replacement : current_context->replacements) {
+    fwrite(&replacement.pos, sizeof(replacement.pos), 1, fp);
+    fwrite(&replacement.size, sizeof(replacement.size), 1, fp);
+    uint64_t data_size = replacement.data.size();
+    fwrite(&data_size, sizeof(data_size), 1, fp);
+    fwrite(replacement.data.data(), 1, data_size, fp);
+  }
+}
+
+void CmpLogMutator::LoadContext(MutatorSampleContext *context, FILE *fp) {
+  CmpLogContext *current_context = (CmpLogContext *)context;
+  uint8_t has_cmplog;
+  fread(&has_cmplog, sizeof(has_cmplog), 1, fp);
+  current_context->has_cmplog = (has_cmplog != 0);
+  fread(&current_context->cur, sizeof(current_context->cur), 1, fp);
+  uint64_t num_replacements;
+  fread(&num_replacements, sizeof(num_replacements), 1, fp);
+  current_context->replacements.resize(num_replacements);
+  for (CmpLogContext::Replacement &replacement : current_context->replacements) {
+    fread(&replacement.pos, sizeof(replacement.pos), 1, fp);
+    fread(&replacement.size, sizeof(replacement.size), 1, fp);
+    uint64_t data_size;
+    fread(&data_size, sizeof(data_size), 1, fp);
+    replacement.data.resize(data_size);
+    if (data_size) fread(&replacement.data[0], 1, data_size, fp);
+  }
+}
+
 bool RangeMutator::Mutate(Sample* inout_sample, PRNG* prng, std::vector<Sample*>& all_samples) {
   Mutator* child_mutator = child_mutators[0];
 
@@ -444,13 +982,27 @@ bool RangeMutator::Mutate(Sample* inout_sample, PRNG* prng, std::vector<Sample*>
   }
 
   // pick a range
-  Range& range = (*ranges)[prng->Rand() % ranges->size()];
+  size_t range_index = prng->Rand() % ranges->size();
+  if (range_cdf.size() == ranges->size()) {
+    double p = prng->RandReal() * range_cdf.back();
+    range_index = std::upper_bound(range_cdf.begin(), range_cdf.end(), p) - range_cdf.begin();
+    if (range_index >= ranges->size()) range_index = ranges->size() - 1;
+  }
+  Range& range = (*ranges)[range_index];
+  last_range = range_index;
 
   // printf("Mutating range %zd %zd\n", range.from, range.to);
 
   // extract the part we want to mutate
-  Sample rangesample;
-  inout_sample->Crop(range.from, range.to, &rangesample);
+  // (same as Crop, but reusing the allocation)
+  Sample &rangesample = range_sample;
+  size_t range_to = range.to;
+  if (range_to > inout_sample->size) range_to = inout_sample->size;
+  if (range.from < range_to) {
+    rangesample.Init(inout_sample->bytes + range.from, range_to - range.from);
+  } else {
+    rangesample.Trim(0);
+  }
 
   // mutate the cropped sample (if not empty)
   if (inout_sample->size == 0) {
@@ -463,62 +1015,460 @@ bool RangeMutator::Mutate(Sample* inout_sample, PRNG* prng, std::vector<Sample*>
   if (range.from + rangesample.size > inout_sample->size) {
     inout_sample->Resize(range.from + rangesample.size);
   }
+  inout_sample->Patch(range.from, rangesample.size);
   memcpy(inout_sample->bytes + range.from, rangesample.bytes, rangesample.size);
 
   return true;
 }
 
-void RepeatMutator::UpdateStats() {
-  stats_mutex.Lock();
-  
-  stats[next_stat] = last_num_repeats;
-  next_stat = (next_stat + 1) % REPEAT_STATS;
-  
-  if(nstats >= REPEAT_STATS) {
-    std::vector<size_t> sort_array;
-    sort_array.assign(&(stats[0]), &(stats[REPEAT_STATS]));
-    std::sort(sort_array.begin(), sort_array.end());
-    median_num_repeats = sort_array[REPEAT_STATS/2];
-    
-    float new_adapted_repeat_p = 1.0f - 1.0f/median_num_repeats;
-    if(new_adapted_repeat_p < 0.5) new_adapted_repeat_p = 0.5;
-    
-    if(new_adapted_repeat_p != adapted_repeat_p) {
-      adapted_repeat_p = new_adapted_repeat_p;
-      printf("Adjusting mutation repeat probability to %g\n", adapted_repeat_p);
+void RangeMutator::UpdateWeights() {
+  range_cdf.clear();
+  if (!ranges || ranges->empty()) return;
+
+  size_t n = ranges->size();
+  prior.resize(n);
+  execs.resize(n);
+  finds.resize(n);
+  weights.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    Range &range = (*ranges)[i];
+    prior[i] = (double)range.reads;
+    execs[i] = (double)range.execs;
+    finds[i] = (double)range.finds;
+  }
+
+  ComputeYieldWeights(n, &prior[0], &execs[0], &finds[0], &weights[0]);
+
+  double sum = 0;
+  range_cdf.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    sum += weights[i];
+    range_cdf[i] = sum;
+  }
+}
+
+void RangeMutator::UpdateStats(RunResult result, bool has_new_coverage) {
+  if (!ranges || (last_range < 0) || ((size_t)last_range >= ranges->size())) return;
+
+  Range &range = (*ranges)[last_range];
+  range.execs++;
+  if (has_new_coverage || (result == CRASH)) range.finds++;
+  if (range.execs >= RANGE_YIELD_WINDOW) {
+    range.execs /= 2;
+    range.finds /= 2;
+  }
+
+  num_notifications++;
+  if ((num_notifications % RANGE_WEIGHTS_INTERVAL) == 0) UpdateWeights();
+}
+
+void RangeMutator::NotifyResult(RunResult result, bool has_new_coverage) {
+  UpdateStats(result, has_new_coverage);
+  last_range = -1;
+  HierarchicalMutator::NotifyResult(result, has_new_coverage);
+}
+
+void RangeMutator::RecordMutation(std::vector<uint64_t> &record) {
+  record.push_back((uint64_t)(last_range + 1));
+  last_range = -1;
+  HierarchicalMutator::RecordMutation(record);
+}
+
+void RangeMutator::NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) {
+  last_range = (int64_t)record[(*pos)++] - 1;
+  UpdateStats(result, has_new_coverage);
+  last_range = -1;
+  HierarchicalMutator::NotifyRecordedResult(record, pos, result, has_new_coverage);
+}
+
+RepeatMutatorStats::RepeatMutatorStats() : halving(false) {
+  for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+    total_execs[i] = 0;
+    total_finds[i] = 0;
+  }
+}
+
+void RepeatMutatorStats::Merge(uint64_t *execs, uint64_t *finds) {
+  uint64_t execs_sum = 0;
+  for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+    if (execs[i]) total_execs[i].fetch_add(execs[i], std::memory_order_relaxed);
+    if (finds[i]) total_finds[i].fetch_add(finds[i], std::memory_order_relaxed);
+    execs[i] = 0;
+    finds[i] = 0;
+    execs_sum += total_execs[i].load(std::memory_order_relaxed);
+  }
+
+  // a single thread halves the counts, concurrent
+  // merges are only added to the halved values
+  if (execs_sum > ADAPTIVE_SELECT_WINDOW) {
+    bool expected = false;
+    if (halving.compare_exchange_strong(expected, true)) {
+      for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+        total_execs[i].fetch_sub(total_execs[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        total_finds[i].fetch_sub(total_finds[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+      }
+      halving.store(false);
+    }
+  }
+}
+
+void RepeatMutatorStats::GetDepthDistribution(double *distribution) {
+  double prior[REPEAT_MAX_DEPTH];
+  double execs[REPEAT_MAX_DEPTH];
+  double finds[REPEAT_MAX_DEPTH];
+
+  // geometric distribution of the number of runs
+  // when repeating with REPEAT_INITIAL_P
+  double p = 1.0 - REPEAT_INITIAL_P;
+  for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+    prior[i] = p;
+    p *= REPEAT_INITIAL_P;
+    execs[i] = (double)total_execs[i].load(std::memory_order_relaxed);
+    finds[i] = (double)total_finds[i].load(std::memory_order_relaxed);
+  }
+
+  ComputeYieldWeights(REPEAT_MAX_DEPTH, prior, execs, finds, distribution);
+}
+
+void RepeatMutatorStats::Save(FILE *fp) {
+  uint64_t execs[REPEAT_MAX_DEPTH];
+  uint64_t finds[REPEAT_MAX_DEPTH];
+  for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+    execs[i] = total_execs[i].load(std::memory_order_relaxed);
+    finds[i] = total_finds[i].load(std::memory_order_relaxed);
+  }
+  fwrite(execs, sizeof(execs), 1, fp);
+  fwrite(finds, sizeof(finds), 1, fp);
+}
+
+void RepeatMutatorStats::Load(FILE *fp) {
+  uint64_t execs[REPEAT_MAX_DEPTH] = {};
+  uint64_t finds[REPEAT_MAX_DEPTH] = {};
+  fread(execs, sizeof(execs), 1, fp);
+  fread(finds, sizeof(finds), 1, fp);
+  for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+    total_execs[i].store(execs[i], std::memory_order_relaxed);
+    total_finds[i].store(finds[i], std::memory_order_relaxed);
+  }
+}
+
+RepeatMutator::RepeatMutator(Mutator *mutator, double repeat_p, RepeatMutatorStats *stats) {
+  AddMutator(mutator);
+  this->repeat_p = repeat_p;
+  adaptible = (repeat_p <= 0);
+  last_num_repeats = 0;
+
+  owns_stats = false;
+  if (adaptible && !stats) {
+    stats = new RepeatMutatorStats();
+    owns_stats = true;
+  }
+  this->stats = stats;
+
+  for (size_t i = 0; i < REPEAT_MAX_DEPTH; i++) {
+    execs[i] = 0;
+    finds[i] = 0;
+  }
+  num_notifications = 0;
+  depth_cdf_valid = false;
+}
+
+RepeatMutator::~RepeatMutator() {
+  if (owns_stats) delete stats;
+}
+
+size_t RepeatMutator::GetAdaptedDepth(PRNG *prng) {
+  if (!depth_cdf_valid) {
+    stats->GetDepthDistribution(depth_cdf);
+    for (size_t i = 1; i < REPEAT_MAX_DEPTH; i++) {
+      depth_cdf[i] += depth_cdf[i - 1];
+    }
+    depth_cdf_valid = true;
+  }
+
+  double p = prng->RandReal() * depth_cdf[REPEAT_MAX_DEPTH - 1];
+  size_t index = std::upper_bound(depth_cdf, depth_cdf + REPEAT_MAX_DEPTH, p) - depth_cdf;
+  if (index >= REPEAT_MAX_DEPTH) index = REPEAT_MAX_DEPTH - 1;
+  return index + 1;
+}
+
+bool RepeatMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
+  // run the mutator at least once
+  last_num_repeats = 1;
+  bool ret = child_mutators[0]->Mutate(inout_sample, prng, all_samples);
+  if (!ret) return false;
+
+  if (adaptible) {
+    size_t depth = GetAdaptedDepth(prng);
+    while (last_num_repeats < depth) {
+      last_num_repeats++;
+      child_mutators[0]->Mutate(inout_sample, prng, all_samples);
     }
-    
   } else {
-    nstats++;
+    while (prng->RandReal() < repeat_p) {
+      last_num_repeats++;
+      child_mutators[0]->Mutate(inout_sample, prng, all_samples);
+    }
   }
-  
-  stats_mutex.Unlock();
+  return true;
 }
 
-void RepeatMutator::SaveGlobalState(FILE *fp) {
-  stats_mutex.Lock();
-  
-  fwrite(stats, sizeof(stats), 1, fp);
-  fwrite(&nstats, sizeof(nstats), 1, fp);
-  fwrite(&next_stat, sizeof(next_stat), 1, fp);
-  fwrite(&median_num_repeats, sizeof(median_num_repeats), 1, fp);
-  fwrite(&adapted_repeat_p, sizeof(adapted_repeat_p), 1, fp);
+void RepeatMutator::NotifyResult(RunResult result, bool has_new_coverage) {
+  UpdateStats(result, has_new_coverage);
+  HierarchicalMutator::NotifyResult(result, has_new_coverage);
+}
+
+void RepeatMutator::RecordMutation(std::vector<uint64_t> &record) {
+  record.push_back(last_num_repeats);
+  HierarchicalMutator::RecordMutation(record);
+}
+
+void RepeatMutator::NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) {
+  last_num_repeats = record[(*pos)++];
+  UpdateStats(result, has_new_coverage);
+  HierarchicalMutator::NotifyRecordedResult(record, pos, result, has_new_coverage);
+}
+
+void RepeatMutator::UpdateStats(RunResult result, bool has_new_coverage) {
+  if (adaptible && last_num_repeats) {
+    size_t index = last_num_repeats - 1;
+    if (index >= REPEAT_MAX_DEPTH) index = REPEAT_MAX_DEPTH - 1;
+    execs[index]++;
+    if (has_new_coverage || (result == CRASH)) finds[index]++;
 
-  stats_mutex.Unlock();
+    num_notifications++;
+    if ((num_notifications % ADAPTIVE_SELECT_MERGE_INTERVAL) == 0) {
+      stats->Merge(execs, finds);
+      depth_cdf_valid = false;
+    }
+  }
+}
 
+void RepeatMutator::SaveGlobalState(FILE *fp) {
+  if (adaptible) stats->Save(fp);
   HierarchicalMutator::SaveGlobalState(fp);
 }
 
 void RepeatMutator::LoadGlobalState(FILE *fp) {
-  stats_mutex.Lock();
+  if (adaptible) {
+    stats->Load(fp);
+    depth_cdf_valid = false;
+  }
+  HierarchicalMutator::LoadGlobalState(fp);
+}
+
+void MutatorYieldStats::Merge(std::vector<double> &probabilities,
+                              std::vector<uint64_t> &execs,
+                              std::vector<uint64_t> &finds,
+                              std::vector<double> &weights)
+{
+  mutex.Lock();
+
+  size_t num_mutators = probabilities.size();
+  if (total_execs.size() != num_mutators) {
+    total_execs.assign(num_mutators, 0);
+    total_finds.assign(num_mutators, 0);
+  }
+
+  double execs_sum = 0;
+  for (size_t i = 0; i < num_mutators; i++) {
+    total_execs[i] += execs[i];
+    total_finds[i] += finds[i];
+    execs_sum += total_execs[i];
+  }
+
+  if (execs_sum > ADAPTIVE_SELECT_WINDOW) {
+    for (size_t i = 0; i < num_mutators; i++) {
+      total_execs[i] /= 2;
+      total_finds[i] /= 2;
+    }
+  }
+
+  ComputeWeights(probabilities);
+  weights = this->weights;
+
+  mutex.Unlock();
+}
+
+void MutatorYieldStats::ComputeWeights(std::vector<double> &probabilities) {
+  size_t num_mutators = probabilities.size();
+  weights.resize(num_mutators);
+  if (!num_mutators) return;
+  ComputeYieldWeights(num_mutators, &probabilities[0],
+                      &total_execs[0], &total_finds[0], &weights[0]);
+}
+
+bool MutatorYieldStats::GetWeights(std::vector<double> &weights) {
+  mutex.Lock();
+  bool ret = !this->weights.empty();
+  if (ret) weights = this->weights;
+  mutex.Unlock();
+  return ret;
+}
+
+void MutatorYieldStats::Save(FILE *fp) {
+  mutex.Lock();
+
+  uint64_t num_mutators = weights.size();
+  fwrite(&num_mutators, sizeof(num_mutators), 1, fp);
+  if (num_mutators) {
+    fwrite(&total_execs[0], sizeof(total_execs[0]), num_mutators, fp);
+    fwrite(&total_finds[0], sizeof(total_finds[0]), num_mutators, fp);
+    fwrite(&weights[0], sizeof(weights[0]), num_mutators, fp);
+  }
+
+  mutex.Unlock();
+}
+
+void MutatorYieldStats::Load(FILE *fp) {
+  mutex.Lock();
+
+  uint64_t num_mutators = 0;
+  fread(&num_mutators, sizeof(num_mutators), 1, fp);
+  total_execs.resize(num_mutators);
+  total_finds.resize(num_mutators);
+  weights.resize(num_mutators);
+  if (num_mutators) {
+    fread(&total_execs[0], sizeof(total_execs[0]), num_mutators, fp);
+    fread(&total_finds[0], sizeof(total_finds[0]), num_mutators, fp);
+    fread(&weights[0], sizeof(weights[0]), num_mutators, fp);
+  }
+
+  mutex.Unlock();
+}
+
+// Vose's alias method: every slot holds the probability of
+// selecting its own mutator and the mutator to select otherwise
+void AdaptivePSelectMutator::BuildAliasTable(std::vector<double> &weights) {
+  size_t num_mutators = child_mutators.size();
+
+  alias_p.assign(num_mutators, 1.0);
+  alias_index.resize(num_mutators);
+  for (size_t i = 0; i < num_mutators; i++) {
+    alias_index[i] = i;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < num_mutators; i++) {
+    sum += weights[i];
+  }
+  if (sum <= 0) return;
 
-  fread(stats, sizeof(stats), 1, fp);
-  fread(&nstats, sizeof(nstats), 1, fp);
-  fread(&next_stat, sizeof(next_stat), 1, fp);
-  fread(&median_num_repeats, sizeof(median_num_repeats), 1, fp);
-  fread(&adapted_repeat_p, sizeof(adapted_repeat_p), 1, fp);
+  std::vector<double> scaled(num_mutators);
+  std::vector<size_t> small, large;
+  for (size_t i = 0; i < num_mutators; i++) {
+    scaled[i] = weights[i] * num_mutators / sum;
+    if (scaled[i] < 1.0) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
 
-  stats_mutex.Unlock();
+  while (!small.empty() && !large.empty()) {
+    size_t s = small.back();
+    small.pop_back();
+    size_t l = large.back();
+    large.pop_back();
+
+    alias_p[s] = scaled[s];
+    alias_index[s] = l;
+
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if (scaled[l] < 1.0) {
+      small.push_back(l);
+    } else {
+      large.push_back(l);
+    }
+  }
+}
+
+bool AdaptivePSelectMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
+  size_t num_mutators = child_mutators.size();
+
+  if (alias_p.size() != num_mutators) {
+    used.assign(num_mutators, false);
+    execs.assign(num_mutators, 0);
+    finds.assign(num_mutators, 0);
+
+    // start from what other threads (or the previous session)
+    // learned, if anything
+    std::vector<double> weights;
+    if (!stats->GetWeights(weights) || (weights.size() != num_mutators)) {
+      weights = probabilities;
+    }
+    BuildAliasTable(weights);
+  }
+
+  size_t index = prng->Rand() % num_mutators;
+  if (prng->RandReal() >= alias_p[index]) index = alias_index[index];
+
+  last_mutator_index = (int)index;
+  used[index] = true;
+  return child_mutators[index]->Mutate(inout_sample, prng, all_samples);
+}
+
+void AdaptivePSelectMutator::NotifyResult(RunResult result, bool has_new_coverage) {
+  PSelectMutator::NotifyResult(result, has_new_coverage);
+  UpdateStats(result, has_new_coverage);
+}
+
+// the record holds the last selected mutator,
+// followed by a bitmask of all the used mutators
+void AdaptivePSelectMutator::RecordMutation(std::vector<uint64_t> &record) {
+  record.push_back(last_mutator_index);
+  for (size_t i = 0; i < used.size(); i += 64) {
+    uint64_t mask = 0;
+    for (size_t j = i; (j < used.size()) && (j < i + 64); j++) {
+      if (used[j]) mask |= (1ULL << (j - i));
+      used[j] = false;
+    }
+    record.push_back(mask);
+  }
+  child_mutators[last_mutator_index]->RecordMutation(record);
+}
+
+void AdaptivePSelectMutator::NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) {
+  uint64_t mutator_index = record[(*pos)++];
+  for (size_t i = 0; i < used.size(); i += 64) {
+    uint64_t mask = record[(*pos)++];
+    for (size_t j = i; (j < used.size()) && (j < i + 64); j++) {
+      used[j] = (mask >> (j - i)) & 1;
+    }
+  }
+  child_mutators[mutator_index]->NotifyRecordedResult(record, pos, result, has_new_coverage);
+  UpdateStats(result, has_new_coverage);
+}
+
+void AdaptivePSelectMutator::UpdateStats(RunResult result, bool has_new_coverage) {
+  if (used.empty()) return;
+
+  bool found = has_new_coverage || (result == CRASH);
+  for (size_t i = 0; i < used.size(); i++) {
+    if (!used[i]) continue;
+    execs[i]++;
+    if (found) finds[i]++;
+    used[i] = false;
+  }
+
+  num_notifications++;
+  if ((num_notifications % ADAPTIVE_SELECT_MERGE_INTERVAL) == 0) {
+    std::vector<double> weights;
+    stats->Merge(probabilities, execs, finds, weights);
+    execs.assign(execs.size(), 0);
+    finds.assign(finds.size(), 0);
+    BuildAliasTable(weights);
+  }
+}
+
+void AdaptivePSelectMutator::SaveGlobalState(FILE *fp) {
+  stats->Save(fp);
+  HierarchicalMutator::SaveGlobalState(fp);
+}
 
+void AdaptivePSelectMutator::LoadGlobalState(FILE *fp) {
+  stats->Load(fp);
+  // the alias table gets rebuilt from the loaded weights
+  alias_p.clear();
   HierarchicalMutator::LoadGlobalState(fp);
 }
@@ -22,14 +22,39 @@ limitations under the License.
 #include "runresult.h"
 #include "mutex.h"
 #include "range.h"
+#include "cmplog.h"
+#include "dictionary.h"
 
 #include <vector>
 #include <set>
+#include <atomic>
+#include <memory>
 
 #define DETERMINISTIC_MUTATE_BYTES_NEXT 20
 #define DETERMINISTIC_MUTATE_BYTES_PREVIOUS 3
-
-#define REPEAT_STATS 11
+// hot regions are handed out to the deterministic
+// mutators in chunks of this many bytes
+#define DETERMINISTIC_CHUNK_SIZE 4
+
+// limits on the work CmpLogMutator does per sample
+#define CMPLOG_MAX_COMPARISONS 1024
+#define CMPLOG_MAX_MATCHES 8
+#define CMPLOG_MAX_REPLACEMENTS 4096
+
+// how often (in executions) a thread merges its
+// mutator yield statistics into the shared ones
+#define ADAPTIVE_SELECT_MERGE_INTERVAL 1000
+// once the shared statistics cover this many executions,
+// they are halved, so that the weights follow the
+// changes in what works during the fuzzing session
+#define ADAPTIVE_SELECT_WINDOW 1000000
+// fraction of the weight that is always
+// distributed according to the initial probabilities
+#define ADAPTIVE_SELECT_EXPLORATION 0.1
+// number of finds at the average yield each mutator
+// starts with, keeps the weights of rarely selected
+// mutators from jumping around
+#define ADAPTIVE_SELECT_PRIOR_FINDS 4
 
 class MutatorSampleContext {
 public:
@@ -49,14 +74,51 @@ public:
   virtual void AddHotOffset(MutatorSampleContext *context, size_t hot_offset) { }
   virtual void SaveContext(MutatorSampleContext *context, FILE *fp) { };
   virtual void LoadContext(MutatorSampleContext *context, FILE *fp) { };
+  // like the other methods, only called on the thread that uses
+  // the mutator. State shared with the mutators of other threads
+  // must be safe to save while they are using it
   virtual void SaveGlobalState(FILE *fp) { };
   virtual void LoadGlobalState(FILE *fp) { };
   virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) = 0;
+  // mutates using only the work in context that can be split
+  // between threads (deterministic mutations), while another thread
+  // may be running a round on the same context. Returns the mutator
+  // that made the mutation, which gets the NotifyResult call,
+  // or NULL if there is no such work left.
+  virtual Mutator *MutateShared(Sample *inout_sample, MutatorSampleContext *context, PRNG *prng, std::vector<Sample *> &all_samples) {
+    return NULL;
+  }
   virtual void NotifyResult(RunResult result, bool has_new_coverage) { }
+  // RecordMutation appends the choices made during the Mutate() calls
+  // since the last record (e.g. which child mutator was selected) to
+  // record. NotifyRecordedResult reports a result to the mutators
+  // those choices point to, reading the record from *pos onwards.
+  // This lets results be reported after the mutator has already
+  // produced further samples (see MutantPipeline).
+  virtual void RecordMutation(std::vector<uint64_t> &record) { }
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) {
+    NotifyResult(result, has_new_coverage);
+  }
+  // with -effector_map, called before every NotifyResult
+  // (or NotifyRecordedResult) with HashCoverage() of the
+  // full coverage of the run, or 0 if the sample wasn't run
+  virtual void NotifyCoverageHash(uint64_t coverage_hash) { }
+  // with -cmplog, a sample for which NeedsCmpLog returns true
+  // is run with comparison logging before its round, and
+  // the logged comparisons are passed to AddCmpLog
+  virtual bool NeedsCmpLog(MutatorSampleContext *context) { return false; }
+  virtual void AddCmpLog(MutatorSampleContext *context, Sample *sample, std::vector<CmpLogEntry> &entries) { }
+  // called for every sample added to the corpus, with the
+  // offset of the mutation that made it interesting
+  virtual void AddInterestingSample(Sample *sample, size_t hot_offset) { }
   virtual bool CanGenerateSample() { return false;  }
   virtual bool GenerateSample(Sample* sample, PRNG* prng) { return false; }
   virtual void AddMutator(Mutator *mutator) { child_mutators.push_back(mutator); }
   virtual void SetRanges(std::vector<Range>* ranges) { }
+  // returns true if the mutator records all in-place
+  // changes to the sample with Sample::Patch(), so that
+  // mutated samples can be reverted cheaply
+  virtual bool SupportsPatching() { return false; }
 
 protected:
   // a helper function to get a random chunk of sample (with size samplesize)
@@ -106,12 +168,59 @@ public:
       child_mutators[i]->NotifyResult(result, has_new_coverage);
     }
   }
+
+  virtual void RecordMutation(std::vector<uint64_t> &record) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->RecordMutation(record);
+    }
+  }
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->NotifyRecordedResult(record, pos, result, has_new_coverage);
+    }
+  }
+
+  // the hash goes to all the mutators, those that
+  // need it keep it until their NotifyResult
+  virtual void NotifyCoverageHash(uint64_t coverage_hash) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->NotifyCoverageHash(coverage_hash);
+    }
+  }
   
   virtual void AddHotOffset(MutatorSampleContext *context, size_t hot_offset) override {
     for (size_t i = 0; i < child_mutators.size(); i++) {
       child_mutators[i]->AddHotOffset(context->child_contexts[i], hot_offset);
     }
   }
+
+  virtual Mutator *MutateShared(Sample *inout_sample, MutatorSampleContext *context, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      Mutator *mutator = child_mutators[i]->MutateShared(inout_sample, context->child_contexts[i], prng, all_samples);
+      if (mutator) return mutator;
+    }
+    return NULL;
+  }
+
+  virtual bool NeedsCmpLog(MutatorSampleContext *context) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      if (child_mutators[i]->NeedsCmpLog(context->child_contexts[i])) return true;
+    }
+    return false;
+  }
+
+  virtual void AddCmpLog(MutatorSampleContext *context, Sample *sample, std::vector<CmpLogEntry> &entries) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->AddCmpLog(context->child_contexts[i], sample, entries);
+    }
+  }
+
+  virtual void AddInterestingSample(Sample *sample, size_t hot_offset) override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      child_mutators[i]->AddInterestingSample(sample, hot_offset);
+    }
+  }
   
   virtual void SetRanges(std::vector<Range>* ranges) override {
     for (size_t i = 0; i < child_mutators.size(); i++) {
@@ -119,6 +228,13 @@ public:
     }
   }
 
+  virtual bool SupportsPatching() override {
+    for (size_t i = 0; i < child_mutators.size(); i++) {
+      if (!child_mutators[i]->SupportsPatching()) return false;
+    }
+    return true;
+  }
+
   virtual void SaveContext(MutatorSampleContext *context, FILE *fp) override {
     for (size_t i = 0; i < child_mutators.size(); i++) {
       child_mutators[i]->SaveContext(context->child_contexts[i], fp);
@@ -252,6 +368,16 @@ public:
     child_mutators[context->current_mutator_index]->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void RecordMutation(std::vector<uint64_t> &record) override {
+    record.push_back(context->current_mutator_index);
+    child_mutators[context->current_mutator_index]->RecordMutation(record);
+  }
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override {
+    uint64_t mutator_index = record[(*pos)++];
+    child_mutators[mutator_index]->NotifyRecordedResult(record, pos, result, has_new_coverage);
+  }
+
 protected:
   MutatorSequenceContext *context;
   bool restart_each_round;
@@ -271,6 +397,16 @@ class SelectMutator : public HierarchicalMutator {
     child_mutators[last_mutator_index]->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void RecordMutation(std::vector<uint64_t> &record) override {
+    record.push_back(last_mutator_index);
+    child_mutators[last_mutator_index]->RecordMutation(record);
+  }
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override {
+    uint64_t mutator_index = record[(*pos)++];
+    child_mutators[mutator_index]->NotifyRecordedResult(record, pos, result, has_new_coverage);
+  }
+
   virtual bool GenerateSample(Sample* sample, PRNG* prng) override {
     int mutator_index = prng->Rand() % child_mutators.size();
     for (size_t i = 0; i < child_mutators.size(); i++) {
@@ -324,6 +460,16 @@ public:
     child_mutators[last_mutator_index]->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void RecordMutation(std::vector<uint64_t> &record) override {
+    record.push_back(last_mutator_index);
+    child_mutators[last_mutator_index]->RecordMutation(record);
+  }
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override {
+    uint64_t mutator_index = record[(*pos)++];
+    child_mutators[mutator_index]->NotifyRecordedResult(record, pos, result, has_new_coverage);
+  }
+
   virtual bool GenerateSample(Sample* sample, PRNG* prng) override {
     double psum = 0;
     size_t last_generator = 0;
@@ -353,67 +499,161 @@ protected:
   std::vector<double> probabilities;
 };
 
+// yield statistics of the child mutators of an AdaptivePSelectMutator,
+// shared between the corresponding mutators of all fuzzing threads
+class MutatorYieldStats {
+public:
+  // adds the executions and finds of a single thread and
+  // computes the new selection weights from the totals
+  void Merge(std::vector<double> &probabilities,
+             std::vector<uint64_t> &execs,
+             std::vector<uint64_t> &finds,
+             std::vector<double> &weights);
+
+  // returns false if nothing was learned yet
+  bool GetWeights(std::vector<double> &weights);
+
+  void Save(FILE *fp);
+  void Load(FILE *fp);
+
+protected:
+  void ComputeWeights(std::vector<double> &probabilities);
+
+  Mutex mutex;
+  std::vector<double> total_execs;
+  std::vector<double> total_finds;
+  std::vector<double> weights;
+};
+
+// PSelectMutator that learns which child mutators produce new
+// coverage (or crashes) on the current target and selects them
+// more often. The probabilities passed to AddMutator are used
+// as the prior, and every mutator keeps some of its initial
+// probability so that the weights can recover when the target
+// behavior changes. Selection takes constant time, using an
+// alias table built from the weights.
+class AdaptivePSelectMutator : public PSelectMutator {
+public:
+  // stats is shared by the mutators at the
+  // same position in the trees of all threads
+  AdaptivePSelectMutator(MutatorYieldStats *stats) {
+    this->stats = stats;
+    num_notifications = 0;
+  }
+
+  virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override;
+  virtual void RecordMutation(std::vector<uint64_t> &record) override;
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override;
+  virtual void SaveGlobalState(FILE *fp) override;
+  virtual void LoadGlobalState(FILE *fp) override;
+
+protected:
+  void BuildAliasTable(std::vector<double> &weights);
+  // credits the mutators in used with the result
+  void UpdateStats(RunResult result, bool has_new_coverage);
+
+  MutatorYieldStats *stats;
+
+  // mutators used since the last NotifyResult call
+  // (a single execution can stack several mutations)
+  std::vector<bool> used;
+  // not yet merged into stats
+  std::vector<uint64_t> execs;
+  std::vector<uint64_t> finds;
+  uint64_t num_notifications;
+
+  std::vector<double> alias_p;
+  std::vector<size_t> alias_index;
+};
+
+// stack depths up to this are learned by an adaptive RepeatMutator
+#define REPEAT_MAX_DEPTH 32
+// repeat probability the adaptive depth distribution starts from
+#define REPEAT_INITIAL_P 0.75
+
+// executions and finds of an adaptive RepeatMutator per stack depth,
+// shared by the corresponding mutators of all fuzzing threads.
+// Threads add their counts without locking
+class RepeatMutatorStats {
+public:
+  RepeatMutatorStats();
+
+  // adds the counts of a single thread, which are reset
+  void Merge(uint64_t *execs, uint64_t *finds);
+
+  // computes the probability of selecting each depth
+  void GetDepthDistribution(double *distribution);
+
+  void Save(FILE *fp);
+  void Load(FILE *fp);
+
+protected:
+  // index 0 corresponds to depth 1
+  std::atomic<uint64_t> total_execs[REPEAT_MAX_DEPTH];
+  std::atomic<uint64_t> total_finds[REPEAT_MAX_DEPTH];
+  std::atomic<bool> halving;
+};
+
 // mutator that runs child mutators repeatedly
 // (in the same Mutate() call)
+// If repeat_p is positive, the child mutator is repeated with
+// probability repeat_p after every run. Otherwise, the number of
+// repeats is drawn from a distribution over stack depths that is
+// learned from which depths produce new coverage or crashes.
 class RepeatMutator : public HierarchicalMutator {
 public:
-  RepeatMutator(Mutator *mutator, double repeat_p) {
-    AddMutator(mutator);
-    this->repeat_p = repeat_p;
-    if(repeat_p <= 0) adaptible = true;
-  }
+  // stats is shared by the mutators at the same position
+  // in the trees of all threads. If NULL, an adaptive
+  // mutator only learns from its own thread
+  RepeatMutator(Mutator *mutator, double repeat_p, RepeatMutatorStats *stats = NULL);
+  ~RepeatMutator();
 
-  virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override {
-    if(adaptible) {
-      repeat_p = adapted_repeat_p;
-    }
-    
-    // run the mutator at least once
-    last_num_repeats = 1;
-    bool ret = child_mutators[0]->Mutate(inout_sample, prng, all_samples);
-    if (!ret) return false;
-    while (prng->RandReal() < repeat_p) {
-      last_num_repeats++;
-      child_mutators[0]->Mutate(inout_sample, prng, all_samples);
-    }
-    return true;
-  }
+  virtual bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
 
-  void UpdateStats();
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override;
 
-  virtual void NotifyResult(RunResult result, bool has_new_coverage) override {
-    if(adaptible && has_new_coverage) {
-      UpdateStats();
-    }
-    HierarchicalMutator::NotifyResult(result, has_new_coverage);
-  }
+  virtual void RecordMutation(std::vector<uint64_t> &record) override;
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override;
   
   virtual void SaveGlobalState(FILE *fp) override;
   
   virtual void LoadGlobalState(FILE *fp) override;
   
+protected:
+  size_t GetAdaptedDepth(PRNG *prng);
+  void UpdateStats(RunResult result, bool has_new_coverage);
+
 public:
   double repeat_p;
   bool adaptible;
   size_t last_num_repeats;
-  
-  // for adapting repeat probability
-  static Mutex stats_mutex;
-  static uint64_t stats[REPEAT_STATS];
-  static uint64_t nstats;
-  static uint64_t next_stat;
-  static uint64_t median_num_repeats;
-  static float adapted_repeat_p;
+
+protected:
+  RepeatMutatorStats *stats;
+  bool owns_stats;
+
+  // counts not yet merged into stats
+  uint64_t execs[REPEAT_MAX_DEPTH];
+  uint64_t finds[REPEAT_MAX_DEPTH];
+  uint64_t num_notifications;
+
+  // cumulative depth distribution, refreshed on every merge
+  double depth_cdf[REPEAT_MAX_DEPTH];
+  bool depth_cdf_valid;
 };
 
 class ByteFlipMutator : public Mutator {
 public:
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 };
 
 class ArithmeticMutator : public Mutator {
 public:
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 private:
   template<typename T>
   bool MutateArithmeticValue(Sample *inout_sample, PRNG *prng, int flip_endian);
@@ -426,6 +666,7 @@ public:
     { }
 
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 
 protected:
 
@@ -441,6 +682,7 @@ public:
     { }
 
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 
 protected:
   int min_append;
@@ -454,6 +696,7 @@ public:
     { }
 
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 
 protected:
   int min_insert;
@@ -469,6 +712,7 @@ public:
   { }
 
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 
 protected:
   int min_block_size;
@@ -477,14 +721,36 @@ protected:
   int max_duplicate_cnt;
 };
 
+// If tokens is not NULL, about half of the mutations insert or
+// overwrite a token from the table instead of an interesting value.
+// Tokens are harvested from the operands of logged comparisons
+// and from strings at the hot offsets of new samples, and their
+// yield is tracked in the table.
 class InterestingValueMutator : public Mutator {
 public:
-  InterestingValueMutator(bool use_default_values = false);
+  InterestingValueMutator(bool use_default_values = false, TokenTable *tokens = NULL);
 
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
+
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override;
+  virtual void RecordMutation(std::vector<uint64_t> &record) override;
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override;
+
+  virtual void AddCmpLog(MutatorSampleContext *context, Sample *sample, std::vector<CmpLogEntry> &entries) override;
+  virtual void AddInterestingSample(Sample *sample, size_t hot_offset) override;
+
+  virtual void SaveGlobalState(FILE *fp) override;
+  virtual void LoadGlobalState(FILE *fp) override;
 
 protected:
+  bool MutateToken(Sample *inout_sample, PRNG *prng);
+
   std::vector<Sample> interesting_values;
+
+  TokenTable *tokens;
+  // token used by the last mutation, or -1
+  int64_t last_token;
 };
 
 class SpliceMutator : public Mutator {
@@ -492,6 +758,7 @@ public:
   SpliceMutator(int points, double displacement_p) : points(points), displacement_p(displacement_p) { }
 
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 
 protected:
   int points;
@@ -544,6 +811,16 @@ public:
     last_mutator->NotifyResult(result, has_new_coverage);
   }
 
+  virtual void RecordMutation(std::vector<uint64_t> &record) override {
+    record.push_back(last_mutator == deterministic_mutator ? 0 : 1);
+    last_mutator->RecordMutation(record);
+  }
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override {
+    Mutator *mutator = record[(*pos)++] ? nondeterministic_mutator : deterministic_mutator;
+    mutator->NotifyRecordedResult(record, pos, result, has_new_coverage);
+  }
+
 protected:
   size_t current_round;
   size_t num_rounds_deterministic;
@@ -553,35 +830,163 @@ protected:
   Mutator *last_mutator;
 };
 
+// values in the effector map
+#define EFFECTOR_UNKNOWN 0
+#define EFFECTOR_NONE 1
+#define EFFECTOR_EFFECT 2
+
+// pending_probe values other than 0 (no probe) and the
+// baseline run are the probed position + EFFECTOR_PROBE_OFFSET
+#define EFFECTOR_PROBE_BASELINE 1
+#define EFFECTOR_PROBE_OFFSET 2
+
+// whether flipping a byte of a sample changes the coverage,
+// shared by the deterministic mutators of the sample
+// so that every byte gets probed only once
+class EffectorMap {
+public:
+  EffectorMap() {
+    baseline_requested = false;
+    baseline_hash = 0;
+  }
+
+  uint8_t GetEffect(size_t pos);
+  void SetEffect(size_t pos, uint8_t effect);
+  // returns true if the caller should run the unmodified sample
+  bool RequestBaseline();
+  // updates the map with the result of a probe
+  void ResolveProbe(uint64_t probe, uint64_t coverage_hash);
+
+  void Save(FILE *fp);
+  void Load(FILE *fp);
+
+protected:
+  // indexed by position
+  std::vector<uint8_t> effects;
+  // the unmodified sample was handed out to get baseline_hash
+  bool baseline_requested;
+  // coverage hash of the unmodified sample, 0 if unknown
+  uint64_t baseline_hash;
+
+  Mutex mutex;
+};
+
+// Hot regions are split into chunks that are claimed by the
+// mutators working on the context, so that several threads can
+// do the deterministic mutations of the same sample.
+// The progress within a chunk is kept by the mutator that
+// claimed it, the context only knows which chunks are done.
 class BaseDeterministicContext : public MutatorSampleContext {
 public:
   BaseDeterministicContext() {
-    cur_region = 0;
+    effector_map = std::make_shared<EffectorMap>();
+    owns_effector_map = true;
   }
   
   struct MutateRegion {
+    uint64_t start;
+    uint64_t end;
+    // bytes before this were handed out in chunks
+    uint64_t claimed;
+  };
+
+  struct MutateChunk {
     uint64_t start;
     uint64_t end;
     uint64_t cur;
     uint64_t cur_progress;
+    // next byte to probe for the effector map
+    uint64_t probe_cur;
   };
   
   std::vector<MutateRegion> regions;
-  uint64_t cur_region;
+  // chunks given back before they were done,
+  // handed out again before the new ones
+  std::vector<MutateChunk> released_chunks;
+  // chunks currently claimed by a mutator. They are saved
+  // as released chunks, so that after restoring the state
+  // they get mutated from the start.
+  std::vector<MutateChunk> active_chunks;
+
+  std::shared_ptr<EffectorMap> effector_map;
+  // only the context that created the map saves it
+  bool owns_effector_map;
   
   void AddHotOffset(size_t offset);
+
+  // returns false if all the chunks were handed out
+  bool ClaimChunk(MutateChunk *chunk);
+  // done is false if the chunk should be handed out again
+  void ReleaseChunk(MutateChunk *chunk, bool done);
   
-  bool GetNextByteToMutate(size_t *pos, size_t *progress, size_t max_progress);
-  
+  // if probe is not NULL, the bytes of a chunk are probed before
+  // they are mutated (*probe is set to true for those), and bytes
+  // without effect on the coverage are skipped
+  bool GetNextByteToMutate(MutateChunk *chunk, size_t *pos, size_t *progress, size_t max_progress, bool *probe = NULL);
+
+  // returns true if the caller should run the unmodified sample
+  bool RequestBaseline();
+
+  void Save(FILE *fp);
+  void Load(FILE *fp);
+
   Mutex mutex;
 };
 
+// With the effector map, the sample is first run unmodified and then
+// with each byte of a hot region flipped once. Bytes whose flip doesn't
+// change the coverage hash are skipped by the deterministic mutations.
 class BaseDeterministicMutator : public Mutator {
 public:
+  BaseDeterministicMutator() {
+    context = NULL;
+    use_effector_map = false;
+    pending_probe = 0;
+    last_coverage_hash = 0;
+    chunk_context = NULL;
+    effector_map_source = NULL;
+  }
+
+  void SetUseEffectorMap(bool use_effector_map) {
+    this->use_effector_map = use_effector_map;
+  }
+
+  // the contexts of this mutator use the effector map of the context
+  // source created last. MutatorSequence creates the contexts of its
+  // mutators for a sample one after the other, so source must come
+  // before this mutator in the same sequence.
+  void ShareEffectorMap(BaseDeterministicMutator *source) {
+    effector_map_source = source;
+  }
+
   virtual MutatorSampleContext *CreateSampleContext(Sample *sample) override;
+
+  virtual void NotifyCoverageHash(uint64_t coverage_hash) override {
+    last_coverage_hash = coverage_hash;
+  }
+
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override {
+    ResolveProbe(pending_probe);
+    pending_probe = 0;
+  }
+
+  virtual void RecordMutation(std::vector<uint64_t> &record) override {
+    record.push_back(pending_probe);
+    pending_probe = 0;
+  }
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override {
+    ResolveProbe(record[(*pos)++]);
+  }
   
   virtual void InitRound(Sample *input_sample, MutatorSampleContext *context) override {
-    this->context = (BaseDeterministicContext *)context;
+    SetContext((BaseDeterministicContext *)context);
+  }
+
+  virtual Mutator *MutateShared(Sample *inout_sample, MutatorSampleContext *context, PRNG *prng, std::vector<Sample *> &all_samples) override {
+    SetContext((BaseDeterministicContext *)context);
+    if (!Mutate(inout_sample, prng, all_samples)) return NULL;
+    return this;
   }
   
   virtual void AddHotOffset(MutatorSampleContext *context, size_t hot_offset) override {
@@ -589,32 +994,43 @@ public:
   }
   
   virtual void SaveContext(MutatorSampleContext *context, FILE *fp) override {
-    BaseDeterministicContext *current_context = (BaseDeterministicContext *)context;
-    current_context->mutex.Lock();
-    uint64_t num_regions = current_context->regions.size();
-    fwrite(&num_regions, sizeof(num_regions), 1, fp);
-    fwrite(&current_context->cur_region, sizeof(current_context->cur_region), 1, fp);
-    fwrite(&current_context->regions[0], sizeof(current_context->regions[0]), num_regions, fp);
-    current_context->mutex.Unlock();
+    ((BaseDeterministicContext *)context)->Save(fp);
   }
 
   virtual void LoadContext(MutatorSampleContext *context, FILE *fp) override {
-    BaseDeterministicContext *current_context = (BaseDeterministicContext *)context;
-    current_context->mutex.Lock();
-    uint64_t num_regions;
-    fread(&num_regions, sizeof(num_regions), 1, fp);
-    fread(&current_context->cur_region, sizeof(current_context->cur_region), 1, fp);
-    current_context->regions.resize(num_regions);
-    fread(&current_context->regions[0], sizeof(current_context->regions[0]), num_regions, fp);
-    current_context->mutex.Unlock();
+    ((BaseDeterministicContext *)context)->Load(fp);
   }
   
   BaseDeterministicContext *context;
+
+protected:
+  // gives the claimed chunk back if it belongs to a different context
+  void SetContext(BaseDeterministicContext *context);
+  // gets the next byte to mutate like GetNextByteToMutate. If *probe
+  // is set on return, inout_sample was already turned into a probe
+  // for the effector map and shouldn't be mutated further
+  bool GetNextMutation(Sample *inout_sample, size_t *pos, size_t *progress, size_t max_progress, bool *probe);
+  void ResolveProbe(uint64_t probe) {
+    if (probe) context->effector_map->ResolveProbe(probe, last_coverage_hash);
+  }
+
+  bool use_effector_map;
+  // probe produced by the last Mutate call, see EFFECTOR_PROBE_OFFSET
+  uint64_t pending_probe;
+  uint64_t last_coverage_hash;
+
+  // the chunk this mutator is working on, if chunk_context is not NULL
+  BaseDeterministicContext::MutateChunk chunk;
+  BaseDeterministicContext *chunk_context;
+
+  BaseDeterministicMutator *effector_map_source;
+  std::weak_ptr<EffectorMap> last_effector_map;
 };
 
 class DeterministicByteFlipMutator : public BaseDeterministicMutator {
 public:
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
 };
 
 class DeterministicInterestingValueMutator : public BaseDeterministicMutator {
@@ -622,26 +1038,120 @@ public:
   DeterministicInterestingValueMutator(bool use_default_values = false);
   
   bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
+
+  // dictionary tokens are tried at every position,
+  // after the default interesting values
+  void AddDictionary(std::vector<std::string> &dictionary);
 
 protected:
   std::vector<Sample> interesting_values;
 };
 
-// Mutator that mutates only set ranges using a child mutator
+class CmpLogContext : public MutatorSampleContext {
+public:
+  CmpLogContext() : has_cmplog(false), cur(0) { }
+
+  // bytes at pos replaced with data
+  struct Replacement {
+    uint64_t pos;
+    uint64_t size;
+    std::string data;
+  };
+
+  // the comparisons of the sample were logged
+  bool has_cmplog;
+  std::vector<Replacement> replacements;
+  // next replacement to try
+  uint64_t cur;
+};
+
+// Input-to-state replacement: the sample is run once with comparison
+// logging (see -cmplog), and wherever an operand of a comparison appears
+// in the sample (as is, byte-swapped or off by one), it gets replaced
+// with the other operand. Each replacement is tried once per sample.
+class CmpLogMutator : public Mutator {
+public:
+  CmpLogMutator() : context(NULL) { }
+
+  virtual MutatorSampleContext *CreateSampleContext(Sample *sample) override {
+    return new CmpLogContext;
+  }
+
+  virtual void InitRound(Sample *input_sample, MutatorSampleContext *context) override {
+    this->context = (CmpLogContext *)context;
+  }
+
+  virtual bool NeedsCmpLog(MutatorSampleContext *context) override {
+    return !((CmpLogContext *)context)->has_cmplog;
+  }
+
+  virtual void AddCmpLog(MutatorSampleContext *context, Sample *sample, std::vector<CmpLogEntry> &entries) override;
+
+  virtual void SaveContext(MutatorSampleContext *context, FILE *fp) override;
+  virtual void LoadContext(MutatorSampleContext *context, FILE *fp) override;
+
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+  bool SupportsPatching() override { return true; }
+
+protected:
+  typedef std::set<std::pair<uint64_t, std::string>> ReplacementSet;
+
+  // adds a replacement for every place where the sample contains pattern
+  void AddReplacements(CmpLogContext *context, Sample *sample, const std::string &pattern,
+                       const std::string &replacement, ReplacementSet &seen);
+  // replacements of the integer from with the integer to, size bytes wide
+  void AddIntegerReplacements(CmpLogContext *context, Sample *sample, uint64_t from,
+                              uint64_t to, size_t size, ReplacementSet &seen);
+
+  CmpLogContext *context;
+};
+
+// number of notifications after which the range weights are recomputed
+#define RANGE_WEIGHTS_INTERVAL 100
+// the execs and finds of a range are halved when
+// its execs reach this, so that the yield stays recent
+#define RANGE_YIELD_WINDOW 10000
+
+// Mutator that mutates only set ranges using a child mutator.
+// Ranges are selected with probability proportional to how often
+// the target reads them, scaled by how often mutations in the
+// range found new coverage or crashes (see ComputeYieldWeights)
 class RangeMutator : public HierarchicalMutator {
 public:
-  RangeMutator(Mutator* child_mutator) {
+  RangeMutator(Mutator* child_mutator) : ranges(NULL), last_range(-1), num_notifications(0) {
     AddMutator(child_mutator);
   }
 
   virtual void SetRanges(std::vector<Range>* ranges) override {
     HierarchicalMutator::SetRanges(ranges);
     this->ranges = ranges;
+    last_range = -1;
+    UpdateWeights();
   }
 
   virtual bool Mutate(Sample* inout_sample, PRNG* prng, std::vector<Sample*>& all_samples) override;
 
+  virtual void NotifyResult(RunResult result, bool has_new_coverage) override;
+
+  virtual void RecordMutation(std::vector<uint64_t> &record) override;
+
+  virtual void NotifyRecordedResult(std::vector<uint64_t> &record, size_t *pos, RunResult result, bool has_new_coverage) override;
+
 protected:
+  void UpdateWeights();
+  void UpdateStats(RunResult result, bool has_new_coverage);
 
   std::vector<Range> *ranges;
+
+  // index of the range mutated last, or -1
+  int64_t last_range;
+  uint64_t num_notifications;
+
+  // cumulative selection weights of the ranges
+  std::vector<double> range_cdf;
+  // allocated here to avoid allocating on every update
+  std::vector<double> prior, execs, finds, weights;
+
+  Sample range_sample;
 };
@@ -0,0 +1,422 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "chunkmutator.h"
+
+// size of the data added or removed when resizing a chunk
+#define CHUNK_MAX_RESIZE 64
+// number of bytes changed when mutating the data of a chunk
+#define CHUNK_MAX_BYTE_MUTATIONS 8
+// number of times to try to find a mutation that can be made
+#define CHUNK_MUTATION_ATTEMPTS 4
+
+#define CHUNK_CRC_SIZE 4
+
+class Crc32Table {
+public:
+  Crc32Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      }
+      table[i] = c;
+    }
+  }
+
+  uint32_t Update(uint32_t crc, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+  }
+
+protected:
+  uint32_t table[256];
+};
+
+static Crc32Table crc32_table;
+
+ChunkFormat::ChunkFormat() {
+  header_size = 0;
+  type_size = 4;
+  length_size = 4;
+  big_endian = false;
+  length_first = false;
+  has_crc = false;
+  align = 1;
+  total_length_offset = 0;
+  total_length_size = 0;
+  total_length_bias = 0;
+}
+
+bool ChunkFormat::Parse(const char *spec) {
+  if (!strcmp(spec, "png")) {
+    header_size = 8;
+    type_size = 4;
+    length_size = 4;
+    big_endian = true;
+    length_first = true;
+    has_crc = true;
+    align = 1;
+    total_length_size = 0;
+    return true;
+  }
+
+  // the chunks inside the top-level RIFF chunk
+  if (!strcmp(spec, "riff")) {
+    header_size = 12;
+    type_size = 4;
+    length_size = 4;
+    big_endian = false;
+    length_first = false;
+    has_crc = false;
+    align = 2;
+    // "RIFF", then the size of everything after the size field
+    total_length_offset = 4;
+    total_length_size = 4;
+    total_length_bias = -8;
+    return true;
+  }
+
+  std::string spec_str(spec);
+  size_t pos = 0;
+  while (pos < spec_str.size()) {
+    size_t end = spec_str.find(',', pos);
+    if (end == std::string::npos) end = spec_str.size();
+    std::string item = spec_str.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t eq = item.find('=');
+    if (eq == std::string::npos) return false;
+    std::string key = item.substr(0, eq);
+    std::string value_str = item.substr(eq + 1);
+    char *value_end;
+    unsigned long long value;
+    if (key == "total_bias") {
+      value = (unsigned long long)strtoll(value_str.c_str(), &value_end, 0);
+    } else {
+      value = strtoull(value_str.c_str(), &value_end, 0);
+    }
+    if (value_str.empty() || *value_end) return false;
+
+    if (key == "header") {
+      header_size = (size_t)value;
+    } else if (key == "type") {
+      type_size = (size_t)value;
+    } else if (key == "length") {
+      length_size = (size_t)value;
+    } else if (key == "big_endian") {
+      big_endian = (value != 0);
+    } else if (key == "length_first") {
+      length_first = (value != 0);
+    } else if (key == "crc") {
+      has_crc = (value != 0);
+    } else if (key == "align") {
+      align = (size_t)value;
+    } else if (key == "total_offset") {
+      total_length_offset = (size_t)value;
+    } else if (key == "total_length") {
+      total_length_size = (size_t)value;
+    } else if (key == "total_bias") {
+      total_length_bias = (int64_t)value;
+    } else {
+      return false;
+    }
+  }
+
+  if ((length_size != 1) && (length_size != 2) &&
+      (length_size != 4) && (length_size != 8))
+  {
+    return false;
+  }
+  if (type_size > 16) return false;
+  if (!align) return false;
+  if (total_length_size > 8) return false;
+  if ((total_length_offset + total_length_size) > header_size) return false;
+
+  return true;
+}
+
+MutatorSampleContext *ChunkMutator::CreateSampleContext(Sample *sample) {
+  return new ChunkMutatorContext();
+}
+
+void ChunkMutator::InitRound(Sample *input_sample, MutatorSampleContext *context) {
+  current_context = (ChunkMutatorContext *)context;
+  ParseChunks(input_sample, current_context->chunks);
+  current_context->sample_size = input_sample->size;
+}
+
+uint64_t ChunkMutator::ReadField(char *data, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    size_t index = format.big_endian ? i : (size - i - 1);
+    value = (value << 8) | (uint8_t)data[index];
+  }
+  return value;
+}
+
+void ChunkMutator::WriteField(char *data, size_t size, uint64_t value) {
+  for (size_t i = 0; i < size; i++) {
+    size_t index = format.big_endian ? (size - i - 1) : i;
+    data[index] = (char)(value & 0xFF);
+    value >>= 8;
+  }
+}
+
+size_t ChunkMutator::GetChunkSize(size_t data_size) {
+  size_t size = format.type_size + format.length_size + data_size;
+  if (format.has_crc) size += CHUNK_CRC_SIZE;
+  if (size % format.align) size += format.align - (size % format.align);
+  return size;
+}
+
+void ChunkMutator::ParseChunks(Sample *sample, std::vector<Chunk> &chunks) {
+  chunks.clear();
+
+  size_t fields_size = format.type_size + format.length_size;
+  size_t length_offset = format.length_first ? 0 : format.type_size;
+
+  size_t pos = format.header_size;
+  while ((pos + fields_size) <= sample->size) {
+    uint64_t data_size = ReadField(sample->bytes + pos + length_offset, format.length_size);
+    if (data_size > (sample->size - pos)) break;
+    size_t chunk_size = GetChunkSize((size_t)data_size);
+    if (chunk_size > (sample->size - pos)) break;
+
+    Chunk chunk;
+    chunk.offset = pos;
+    chunk.data_size = (size_t)data_size;
+    chunk.size = chunk_size;
+    chunks.push_back(chunk);
+
+    pos += chunk_size;
+  }
+}
+
+size_t ChunkMutator::GetInsertOffset(std::vector<Chunk> &chunks, size_t index) {
+  if (index < chunks.size()) return chunks[index].offset;
+  if (chunks.empty()) return format.header_size;
+  return chunks.back().offset + chunks.back().size;
+}
+
+void ChunkMutator::FixChunk(Sample *sample, Chunk &chunk, size_t data_size) {
+  size_t data_offset = GetDataOffset(chunk);
+  size_t new_size = GetChunkSize(data_size);
+
+  // CRC and padding
+  size_t old_tail = chunk.size - (data_offset - chunk.offset) - chunk.data_size;
+  size_t new_tail = new_size - (data_offset - chunk.offset) - data_size;
+  size_t tail_offset = data_offset + data_size;
+  if (old_tail != new_tail) {
+    sample->Splice(tail_offset, old_tail, new_tail);
+    memset(sample->bytes + tail_offset, 0, new_tail);
+  }
+
+  chunk.data_size = data_size;
+  chunk.size = new_size;
+
+  size_t length_offset = chunk.offset + (format.length_first ? 0 : format.type_size);
+  sample->Patch(length_offset, format.length_size);
+  WriteField(sample->bytes + length_offset, format.length_size, data_size);
+
+  if (format.has_crc) {
+    size_t type_offset = chunk.offset + (format.length_first ? format.length_size : 0);
+    uint32_t crc = 0xFFFFFFFF;
+    crc = crc32_table.Update(crc, sample->bytes + type_offset, format.type_size);
+    crc = crc32_table.Update(crc, sample->bytes + data_offset, data_size);
+    crc ^= 0xFFFFFFFF;
+    sample->Patch(tail_offset, CHUNK_CRC_SIZE);
+    WriteField(sample->bytes + tail_offset, CHUNK_CRC_SIZE, crc);
+  }
+}
+
+void ChunkMutator::FixHeader(Sample *sample) {
+  if (!format.total_length_size) return;
+  if (sample->size < format.header_size) return;
+  int64_t total_length = (int64_t)sample->size + format.total_length_bias;
+  if (total_length < 0) return;
+  char *field = sample->bytes + format.total_length_offset;
+  if (ReadField(field, format.total_length_size) == (uint64_t)total_length) return;
+  sample->Patch(format.total_length_offset, format.total_length_size);
+  WriteField(field, format.total_length_size, (uint64_t)total_length);
+}
+
+bool ChunkMutator::DeleteChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng) {
+  // keep at least one chunk
+  if (chunks.size() < 2) return false;
+  Chunk &chunk = chunks[prng->Rand() % chunks.size()];
+  inout_sample->Splice(chunk.offset, chunk.size, 0);
+  return true;
+}
+
+bool ChunkMutator::DuplicateChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng) {
+  if (chunks.empty()) return false;
+  Chunk &chunk = chunks[prng->Rand() % chunks.size()];
+  if ((inout_sample->size + chunk.size) > Sample::max_size) return false;
+  inout_sample->Splice(chunk.offset + chunk.size, 0, chunk.size);
+  memcpy(inout_sample->bytes + chunk.offset + chunk.size,
+         inout_sample->bytes + chunk.offset, chunk.size);
+  return true;
+}
+
+bool ChunkMutator::MoveChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng) {
+  if (chunks.size() < 2) return false;
+  size_t from = prng->Rand() % chunks.size();
+  // the chunk goes in front of chunks[to], or last
+  size_t to = prng->Rand() % (chunks.size() + 1);
+  if ((to == from) || (to == (from + 1))) return false;
+
+  Chunk &chunk = chunks[from];
+  size_t insert_offset = GetInsertOffset(chunks, to);
+  chunk_copy.assign(inout_sample->bytes + chunk.offset, chunk.size);
+  inout_sample->Splice(chunk.offset, chunk.size, 0);
+  if (insert_offset > chunk.offset) insert_offset -= chunk.size;
+  inout_sample->Splice(insert_offset, 0, chunk_copy.size());
+  memcpy(inout_sample->bytes + insert_offset, chunk_copy.data(), chunk_copy.size());
+  return true;
+}
+
+bool ChunkMutator::SpliceChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng, std::vector<Sample *> &all_samples) {
+  if (all_samples.empty()) return false;
+  if (inout_sample->size < format.header_size) return false;
+
+  Sample *other_sample = all_samples[prng->Rand() % all_samples.size()];
+  // the sample might not be in memory
+  if ((other_sample == inout_sample) || !other_sample->bytes) return false;
+
+  ParseChunks(other_sample, other_chunks);
+  if (other_chunks.empty()) return false;
+  Chunk &other_chunk = other_chunks[prng->Rand() % other_chunks.size()];
+  if ((inout_sample->size + other_chunk.size) > Sample::max_size) return false;
+
+  size_t insert_offset = GetInsertOffset(chunks, prng->Rand() % (chunks.size() + 1));
+  inout_sample->Splice(insert_offset, 0, other_chunk.size);
+  memcpy(inout_sample->bytes + insert_offset,
+         other_sample->bytes + other_chunk.offset, other_chunk.size);
+  return true;
+}
+
+bool ChunkMutator::MutateChunkData(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng) {
+  if (chunks.empty()) return false;
+  Chunk &chunk = chunks[prng->Rand() % chunks.size()];
+  if (!chunk.data_size) return false;
+
+  size_t data_offset = GetDataOffset(chunk);
+  int num_mutations = prng->Rand(1, CHUNK_MAX_BYTE_MUTATIONS);
+  for (int i = 0; i < num_mutations; i++) {
+    size_t pos = data_offset + prng->Rand() % chunk.data_size;
+    inout_sample->Patch(pos, 1);
+    inout_sample->bytes[pos] = (char)prng->Rand(0, 255);
+  }
+
+  FixChunk(inout_sample, chunk, chunk.data_size);
+  return true;
+}
+
+bool ChunkMutator::ResizeChunkData(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng) {
+  if (chunks.empty()) return false;
+  Chunk &chunk = chunks[prng->Rand() % chunks.size()];
+  size_t data_offset = GetDataOffset(chunk);
+
+  if (chunk.data_size && (prng->Rand() % 2)) {
+    size_t remove = prng->Rand(1, CHUNK_MAX_RESIZE);
+    if (remove > chunk.data_size) remove = chunk.data_size;
+    size_t pos = data_offset + prng->Rand() % (chunk.data_size - remove + 1);
+    inout_sample->Splice(pos, remove, 0);
+    FixChunk(inout_sample, chunk, chunk.data_size - remove);
+    return true;
+  }
+
+  size_t insert = prng->Rand(1, CHUNK_MAX_RESIZE);
+  // leave room for the padding and the CRC
+  size_t room = Sample::max_size - inout_sample->size;
+  if (room <= (format.align + CHUNK_CRC_SIZE)) return false;
+  room -= format.align + CHUNK_CRC_SIZE;
+  if (insert > room) insert = room;
+  if (format.length_size < sizeof(uint64_t)) {
+    uint64_t max_data_size = (1ULL << (format.length_size * 8)) - 1;
+    if (chunk.data_size >= max_data_size) return false;
+    if (insert > (max_data_size - chunk.data_size)) insert = (size_t)(max_data_size - chunk.data_size);
+  }
+
+  size_t pos = data_offset + prng->Rand() % (chunk.data_size + 1);
+  inout_sample->Splice(pos, 0, insert);
+  for (size_t i = 0; i < insert; i++) {
+    inout_sample->bytes[pos + i] = (char)prng->Rand(0, 255);
+  }
+  FixChunk(inout_sample, chunk, chunk.data_size + insert);
+  return true;
+}
+
+bool ChunkMutator::Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) {
+  // the chunks parsed at the start of the round can be used
+  // as long as the structure of the sample didn't change
+  // (e.g. through an earlier mutation in the same iteration)
+  bool use_context = false;
+  if (current_context && (inout_sample->size == current_context->sample_size)) {
+    use_context = true;
+    size_t length_offset = format.length_first ? 0 : format.type_size;
+    for (Chunk &chunk : current_context->chunks) {
+      uint64_t data_size = ReadField(inout_sample->bytes + chunk.offset + length_offset, format.length_size);
+      if (data_size != chunk.data_size) {
+        use_context = false;
+        break;
+      }
+    }
+  }
+  if (use_context) {
+    chunks = current_context->chunks;
+  } else {
+    ParseChunks(inout_sample, chunks);
+  }
+
+  size_t old_size = inout_sample->size;
+
+  for (int i = 0; i < CHUNK_MUTATION_ATTEMPTS; i++) {
+    bool mutated = false;
+    switch (prng->Rand() % 6) {
+    case 0:
+      mutated = DeleteChunk(inout_sample, chunks, prng);
+      break;
+    case 1:
+      mutated = DuplicateChunk(inout_sample, chunks, prng);
+      break;
+    case 2:
+      mutated = MoveChunk(inout_sample, chunks, prng);
+      break;
+    case 3:
+      mutated = SpliceChunk(inout_sample, chunks, prng, all_samples);
+      break;
+    case 4:
+      mutated = MutateChunkData(inout_sample, chunks, prng);
+      break;
+    case 5:
+      mutated = ResizeChunkData(inout_sample, chunks, prng);
+      break;
+    }
+    if (mutated) break;
+  }
+
+  if (inout_sample->size != old_size) FixHeader(inout_sample);
+
+  return true;
+}
@@ -0,0 +1,120 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../../mutator.h"
+
+// Describes a chunked binary format (PNG, RIFF, TLV protocols...):
+// a fixed-size file header followed by chunks of
+// [type][length][data][crc][padding], where the length field
+// gives the size of the data and can come before the type field.
+// The CRC is a CRC-32 of the type and the data.
+// The header can contain a field with the size of the whole sample
+// plus a bias (e.g. the RIFF size, which doesn't count the first 8 bytes).
+// A format is given either as a preset name ("png", "riff")
+// or as a comma-separated list of key=value pairs:
+// header=<bytes>, type=<bytes>, length=<bytes>,
+// big_endian=<0|1>, length_first=<0|1>, crc=<0|1>, align=<bytes>,
+// total_offset=<bytes>, total_length=<bytes>, total_bias=<bytes>
+struct ChunkFormat {
+  ChunkFormat();
+
+  // returns false if the spec can't be parsed
+  bool Parse(const char *spec);
+
+  size_t header_size;
+  size_t type_size;
+  size_t length_size;
+  bool big_endian;
+  bool length_first;
+  bool has_crc;
+  // chunks are padded to a multiple of align bytes
+  size_t align;
+  // size field in the header, total_length_size is 0 if there is none
+  size_t total_length_offset;
+  size_t total_length_size;
+  int64_t total_length_bias;
+};
+
+struct Chunk {
+  // offset of the chunk in the sample
+  size_t offset;
+  // size of the data
+  size_t data_size;
+  // size of the whole chunk
+  size_t size;
+};
+
+// the chunks of the sample a round starts with
+class ChunkMutatorContext : public MutatorSampleContext {
+public:
+  ChunkMutatorContext() : sample_size(0) { }
+
+  std::vector<Chunk> chunks;
+  size_t sample_size;
+};
+
+// Mutates samples of a chunked format at chunk granularity:
+// deletes, duplicates, moves and mutates chunks and inserts
+// chunks from other samples, fixing up the length fields,
+// CRCs and padding of the chunks it changes.
+// Bytes that don't parse as chunks are left as they are.
+class ChunkMutator : public Mutator {
+public:
+  ChunkMutator(ChunkFormat &format) : format(format), current_context(NULL) { }
+
+  MutatorSampleContext *CreateSampleContext(Sample *sample) override;
+  void InitRound(Sample *input_sample, MutatorSampleContext *context) override;
+  bool Mutate(Sample *inout_sample, PRNG *prng, std::vector<Sample *> &all_samples) override;
+
+protected:
+  // parses the chunks of the sample that are complete
+  void ParseChunks(Sample *sample, std::vector<Chunk> &chunks);
+
+  uint64_t ReadField(char *data, size_t size);
+  void WriteField(char *data, size_t size, uint64_t value);
+
+  size_t GetChunkSize(size_t data_size);
+  size_t GetDataOffset(Chunk &chunk) { return chunk.offset + format.type_size + format.length_size; }
+  // offset of the chunk that would take the place of chunks[index]
+  size_t GetInsertOffset(std::vector<Chunk> &chunks, size_t index);
+
+  // rewrites the length field, the CRC and the padding
+  // of a chunk whose data now has data_size bytes
+  void FixChunk(Sample *sample, Chunk &chunk, size_t data_size);
+  // rewrites the size field in the header after the sample size changed
+  void FixHeader(Sample *sample);
+
+  bool DeleteChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng);
+  bool DuplicateChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng);
+  bool MoveChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng);
+  bool SpliceChunk(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng, std::vector<Sample *> &all_samples);
+  bool MutateChunkData(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng);
+  bool ResizeChunkData(Sample *inout_sample, std::vector<Chunk> &chunks, PRNG *prng);
+
+  ChunkFormat format;
+
+  ChunkMutatorContext *current_context;
+
+  // allocated here to avoid allocating for each iteration
+  std::vector<Chunk> chunks;
+  std::vector<Chunk> other_chunks;
+  std::string chunk_copy;
+};
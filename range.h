@@ -16,10 +16,19 @@ limitations under the License.
 
 #pragma once
 
+#include <inttypes.h>
+#include <stddef.h>
+
 class Range {
 public:
   size_t from;
   size_t to;
+  // how many times the target read the range in a run
+  uint64_t reads = 1;
+  // recent executions of mutations made in the range and how
+  // many of them found new coverage or crashes (see RangeMutator)
+  uint64_t execs = 0;
+  uint64_t finds = 0;
 
   bool operator<(const Range& other) const {
     return this->from < other.from;
@@ -27,7 +27,7 @@ SHMRangeTracker::SHMRangeTracker(char* name, size_t size) {
   shm.Open(name, size);
   data = (uint32_t *)shm.GetData();
   data[0] = 0;
-  max_ranges = (size - sizeof(uint32_t)) / sizeof(uint32_t);
+  max_values = (size - sizeof(uint32_t)) / sizeof(uint32_t);
 }
 
 SHMRangeTracker::~SHMRangeTracker() {
@@ -38,11 +38,15 @@ void SHMRangeTracker::ExtractRanges(std::vector<Range>* ranges) {
   uint32_t* buf = data;
   size_t numranges = *buf; buf++;
 
+  bool read_counts = (numranges & RANGE_SHM_READ_COUNTS) != 0;
+  numranges &= ~(size_t)RANGE_SHM_READ_COUNTS;
+  size_t range_values = read_counts ? 3 : 2;
+
   if (!numranges) return;
 
-  if (numranges > max_ranges) {
+  if (numranges > (max_values / range_values)) {
     WARN("Number of ranges exceeds buffer size.");
-    numranges = max_ranges;
+    numranges = max_values / range_values;
   }
 
   std::vector<Range> tmpranges;
@@ -50,12 +54,19 @@ void SHMRangeTracker::ExtractRanges(std::vector<Range>* ranges) {
   for (size_t i = 0; i < numranges; i++) {
     tmpranges[i].from = *buf; buf++;
     tmpranges[i].to = *buf; buf++;
+    if (read_counts) {
+      tmpranges[i].reads = *buf; buf++;
+    }
   }
 
-  ConsolidateRanges(tmpranges, *ranges);
+  if (read_counts) {
+    ConsolidateRanges(tmpranges, *ranges);
+  } else {
+    MergeRanges(tmpranges, *ranges);
+  }
 }
 
-void SHMRangeTracker::ConsolidateRanges(std::vector<Range>& inranges, std::vector<Range>& outranges) {
+void SHMRangeTracker::MergeRanges(std::vector<Range>& inranges, std::vector<Range>& outranges) {
   if (inranges.empty()) return;
 
   std::sort(inranges.begin(), inranges.end());
@@ -77,6 +88,41 @@ void SHMRangeTracker::ConsolidateRanges(std::vector<Range>& inranges, std::vecto
       outranges.push_back(*currange);
     }
   }
+}
+
+void SHMRangeTracker::ConsolidateRanges(std::vector<Range>& inranges, std::vector<Range>& outranges) {
+  if (inranges.empty()) return;
+
+  // a range adds its reads at from and removes them at to
+  std::vector<std::pair<size_t, int64_t>> events;
+  events.reserve(inranges.size() * 2);
+  for (Range& range : inranges) {
+    if ((range.from >= range.to) || !range.reads) continue;
+    events.push_back({ range.from, (int64_t)range.reads });
+    events.push_back({ range.to, -(int64_t)range.reads });
+  }
+
+  std::sort(events.begin(), events.end());
+
+  int64_t reads = 0;
+  size_t from = 0;
+  for (auto& event : events) {
+    if ((reads > 0) && (event.first > from)) {
+      Range* lastrange = outranges.empty() ? NULL : &outranges[outranges.size() - 1];
+      // adjacent ranges read equally often are joined
+      if (lastrange && (lastrange->to == from) && (lastrange->reads == (uint64_t)reads)) {
+        lastrange->to = event.first;
+      } else {
+        Range range;
+        range.from = from;
+        range.to = event.first;
+        range.reads = (uint64_t)reads;
+        outranges.push_back(range);
+      }
+    }
+    reads += event.second;
+    from = event.first;
+  }
 
   // printf("SHMRangeTracker::ConsolidateRanges %zd %zd\n", inranges.size(), outranges.size());
 }
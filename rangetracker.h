@@ -19,6 +19,10 @@ limitations under the License.
 // sufficient for 1000-1 ranges
 #define RANGE_SHM_SIZE 4096
 
+// if set in the first number of the shared memory, every range
+// is followed by the number of times it was read, see README_ranges.md
+#define RANGE_SHM_READ_COUNTS 0x80000000
+
 #include <vector>
 
 #include "range.h"
@@ -54,9 +58,16 @@ public:
   virtual void ExtractRanges(std::vector<Range>* ranges) override;
 
 protected:
+  // merges overlapping and touching ranges,
+  // used when the target doesn't report read counts
+  void MergeRanges(std::vector<Range>& inranges, std::vector<Range>& outranges);
+
+  // splits the ranges into ranges that don't overlap,
+  // each with the total number of reads covering it
   void ConsolidateRanges(std::vector<Range>& inranges, std::vector<Range>& outranges);
 
   SharedMemory shm;
   uint32_t* data;
-  size_t max_ranges;
+  // number of uint32 values after the range count
+  size_t max_values;
 };
@@ -19,6 +19,10 @@ limitations under the License.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <new>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "common.h"
 #include "sample.h"
 #include "mutex.h"
@@ -27,33 +31,73 @@ size_t Sample::max_size = DEFAULT_MAX_SAMPLE_SIZE;
 
 Sample::Sample() {
   size = 0;
+  capacity = 0;
+  owns_bytes = true;
   bytes = NULL;
+  patch_log_valid = false;
+  patched_bytes = 0;
 }
 
 Sample::~Sample() {
-  if(bytes) free(bytes);
+  FreeBytes();
 }
 
-void Sample::Clear() {
-  if (bytes) free(bytes);
+void Sample::FreeBytes() {
+  if (bytes && owns_bytes) free(bytes);
   bytes = NULL;
+  capacity = 0;
+  owns_bytes = true;
+  patch_log_valid = false;
+}
+
+void Sample::Clear() {
+  FreeBytes();
   filename.clear();
 }
 
 Sample::Sample(const Sample &in) {
   size = in.size;
+  capacity = size;
+  owns_bytes = true;
+  patch_log_valid = false;
+  patched_bytes = 0;
   bytes = (char *)malloc(size);
   memcpy(bytes,in.bytes,size);
   filename = in.filename;
 }
 
 Sample& Sample::operator= (const Sample &in) {
-  if(bytes) free(bytes);
+  if (this != &in) Assign(in);
+  return *this;
+}
+
+void Sample::Reserve(size_t new_capacity) {
+  if (new_capacity <= capacity) return;
+  size_t grown_capacity = capacity * 2;
+  if (grown_capacity > max_size) grown_capacity = max_size;
+  if (new_capacity < grown_capacity) new_capacity = grown_capacity;
+  if (!owns_bytes) {
+    char *new_bytes = (char *)malloc(new_capacity);
+    memcpy(new_bytes, bytes, size);
+    bytes = new_bytes;
+    owns_bytes = true;
+  } else {
+    bytes = (char *)realloc(bytes, new_capacity);
+  }
+  capacity = new_capacity;
+}
+
+void Sample::Assign(const Sample &in) {
+  if (in.size > capacity) {
+    // no need to preserve the old contents
+    FreeBytes();
+    bytes = (char *)malloc(in.size);
+    capacity = in.size;
+  }
   size = in.size;
-  bytes = (char *)malloc(size);
-  memcpy(bytes,in.bytes,size);
+  if (size) memcpy(bytes, in.bytes, size);
   filename = in.filename;
-  return *this;
+  patch_log_valid = false;
 }
 
 int Sample::Save() {
@@ -70,9 +114,64 @@ int Sample::Load() {
   return Load(filename.c_str());
 }
 
+void Sample::UseBuffer(char *buffer, size_t capacity, size_t size) {
+  if (bytes == buffer) return;
+  FreeBytes();
+  bytes = buffer;
+  this->capacity = capacity;
+  owns_bytes = false;
+  this->size = size;
+}
+
+void Sample::Detach() {
+  if (owns_bytes) return;
+  char *new_bytes = (char *)malloc(size);
+  memcpy(new_bytes, bytes, size);
+  bytes = new_bytes;
+  capacity = size;
+  owns_bytes = true;
+}
+
+void Sample::SetBytes(char *new_bytes, size_t new_size) {
+  FreeBytes();
+  bytes = new_bytes;
+  size = new_size;
+  capacity = new_size;
+}
+
+void Sample::StartPatchLog() {
+  patch_log.clear();
+  patched_bytes = 0;
+  patch_log_valid = true;
+}
+
+bool Sample::RevertPatches(Sample &base) {
+  if (!patch_log_valid || (size != base.size)) return false;
+  for (SamplePatch &patch : patch_log) {
+    memcpy(bytes + patch.offset, base.bytes + patch.offset, patch.size);
+  }
+  patch_log.clear();
+  patched_bytes = 0;
+  return true;
+}
+
+size_t Sample::FindFirstPatchDiff(Sample &base) {
+  if (!patch_log_valid || (size != base.size)) return FindFirstDiff(base);
+  size_t first_diff = size;
+  for (SamplePatch &patch : patch_log) {
+    if (patch.offset >= first_diff) continue;
+    for (size_t i = patch.offset; i < patch.offset + patch.size; i++) {
+      if (bytes[i] != base.bytes[i]) {
+        first_diff = i;
+        break;
+      }
+    }
+  }
+  return first_diff;
+}
+
 void Sample::FreeMemory() {
-  if (bytes) free(bytes);
-  bytes = NULL;
+  FreeBytes();
 }
 
 void Sample::EnsureLoaded() {
@@ -105,43 +204,62 @@ int Sample::Load(const char * filename) {
   fseek(fp,0,SEEK_END);
   size = ftell(fp);
   fseek(fp,0,SEEK_SET);
-  if(bytes) free(bytes);
+  FreeBytes();
   bytes = (char *)malloc(size);
+  capacity = size;
   fread(bytes, size, 1, fp);
   fclose(fp);
   return 1;
 }
 
 void Sample::Init(const char *data, size_t size) {
-  if(bytes) free(bytes);
+  if (size > capacity) {
+    FreeBytes();
+    bytes = (char *)malloc(size);
+    capacity = size;
+  }
   this->size = size;
-  bytes = (char *)malloc(size);
   memcpy(bytes,data,size);
+  patch_log_valid = false;
 }
 
 void Sample::Init(size_t size) {
-  if(bytes) free(bytes);
+  if (size > capacity) {
+    FreeBytes();
+    bytes = (char *)malloc(size);
+    capacity = size;
+  }
   this->size = size;
-  bytes = (char *)malloc(size);
   memset(bytes,0,size);
+  patch_log_valid = false;
 }
 
 void Sample::Append(char *data, size_t size) {
   size_t oldsize = this->size;
+  Reserve(oldsize + size);
   this->size += size;
-  bytes = (char *)realloc(bytes,this->size);
   memcpy(bytes+oldsize,data,size);
+  patch_log_valid = false;
 }
 
+// keeps the allocation so that the sample can grow again
+// without reallocating
 void Sample::Trim(size_t new_size) {
   if (new_size > this->size) return;
   this->size = new_size;
-  if(new_size == 0) {
-    free(bytes);
-    bytes = NULL;
-  } else {
-    bytes = (char *)realloc(bytes, this->size);
+  patch_log_valid = false;
+}
+
+void Sample::Splice(size_t offset, size_t remove_size, size_t insert_size) {
+  size_t old_size = size;
+  size_t new_size = old_size - remove_size + insert_size;
+  Reserve(new_size);
+  size_t tail = offset + remove_size;
+  if ((tail < old_size) && (remove_size != insert_size)) {
+    memmove(bytes + offset + insert_size, bytes + tail, old_size - tail);
   }
+  size = new_size;
+  patch_log_valid = false;
 }
 
 void Sample::Crop(size_t from, size_t to, Sample* out) {
@@ -161,9 +279,10 @@ void Sample::Resize(size_t new_size) {
     return;
   } else {
     size_t old_size = size;
+    Reserve(new_size);
     this->size = new_size;
-    bytes = (char *)realloc(bytes, this->size);
     memset(bytes + old_size, 0, new_size - old_size);
+    patch_log_valid = false;
   }
 }
 
@@ -176,108 +295,411 @@ size_t Sample::FindFirstDiff(Sample &other) {
   return minsize;
 }
 
-static SampleTrie sample_trie;
+#define HASH_MULTIPLIER1 0xa0761d6478bd642fULL
+#define HASH_MULTIPLIER2 0xe7037ed1a0b428dbULL
+
+static inline uint64_t HashMix(uint64_t a, uint64_t b) {
+  // the high and low halves of a 128-bit product
+#if defined(_MSC_VER) && defined(_M_X64)
+  uint64_t high;
+  uint64_t low = _umul128(a, b, &high);
+  return high ^ low;
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+  return __umulh(a, b) ^ (a * b);
+#elif defined(__SIZEOF_INT128__)
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)(product >> 64) ^ (uint64_t)product;
+#else
+  // 32-bit targets, from four 32x32 bit products
+  uint64_t a_low = (uint32_t)a, a_high = a >> 32;
+  uint64_t b_low = (uint32_t)b, b_high = b >> 32;
+  uint64_t low_low = a_low * b_low;
+  uint64_t high_low = a_high * b_low;
+  uint64_t low_high = a_low * b_high;
+  uint64_t high_high = a_high * b_high;
+  uint64_t cross = (low_low >> 32) + (uint32_t)high_low + low_high;
+  uint64_t high = high_high + (high_low >> 32) + (cross >> 32);
+  uint64_t low = (cross << 32) | (uint32_t)low_low;
+  return high ^ low;
+#endif
+}
 
-SampleTrie::SampleTrieNode::SampleTrieNode() {
-  leaf = true;
-  constant_part = NULL;
-  constant_part_size = 0;
+static inline uint64_t ReadWord(const char *p) {
+  uint64_t ret;
+  memcpy(&ret, p, sizeof(ret));
+  return ret;
 }
 
-SampleTrie::SampleTrieNode::~SampleTrieNode() {
-  if(constant_part) free(constant_part);
-  for(auto iter = children.begin(); iter != children.end(); iter++) {
-    delete iter->second;
+// processes 32 bytes per iteration in 4 independent lanes,
+// so that the multiplications can execute in parallel
+uint64_t Sample::HashBytes(const char *data, size_t size) {
+  uint64_t lanes[4] = {
+    HASH_MULTIPLIER1, HASH_MULTIPLIER2,
+    HASH_MULTIPLIER1 ^ size, HASH_MULTIPLIER2 ^ size
+  };
+
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    for (int lane = 0; lane < 4; lane++) {
+      lanes[lane] = HashMix(lanes[lane] ^ ReadWord(data + i + lane * 8), HASH_MULTIPLIER1);
+    }
   }
+
+  uint64_t hash = lanes[0] ^ HashMix(lanes[1], HASH_MULTIPLIER2) ^
+                  HashMix(lanes[2], HASH_MULTIPLIER1) ^ lanes[3];
+
+  for (; i + 8 <= size; i += 8) {
+    hash = HashMix(hash ^ ReadWord(data + i), HASH_MULTIPLIER2);
+  }
+  if (i < size) {
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    hash = HashMix(hash ^ tail, HASH_MULTIPLIER1);
+  }
+
+  return HashMix(hash, HASH_MULTIPLIER2 ^ size);
 }
 
-Mutex SampleTrie::sample_trie_mutex;
+RecentSampleSet::RecentSampleSet(int size_log2) {
+  slots.resize((size_t)1 << size_log2, 0);
+  mask = slots.size() - 1;
+}
+
+bool RecentSampleSet::CheckAndAdd(uint64_t hash) {
+  // 0 marks an empty slot
+  if (!hash) hash = 1;
+
+  uint64_t *slot1 = &slots[hash & mask];
+  uint64_t *slot2 = &slots[(hash >> 32) & mask];
+  if ((*slot1 == hash) || (*slot2 == hash)) return true;
+
+  if (!*slot1) {
+    *slot1 = hash;
+  } else if (!*slot2) {
+    *slot2 = hash;
+  } else {
+    // evict one of the entries
+    if (hash >> 63) *slot1 = hash;
+    else *slot2 = hash;
+  }
+  return false;
+}
+
+#define SAMPLE_TRIE_ARENA_CHUNK_SIZE (1024 * 1024)
+
+SampleTrie::Node48::Node48() : Node(NODE48) {
+  for (int i = 0; i < 256; i++) child_index[i] = 0;
+}
+
+SampleTrie::Node256::Node256() : Node(NODE256) {
+  for (int i = 0; i < 256; i++) children[i] = NULL;
+}
+
+SampleTrie::SampleTrie() {
+  arena_pos = NULL;
+  arena_remaining = 0;
+  root = AllocNode<Node256>();
+}
+
+SampleTrie::~SampleTrie() {
+  // all nodes are trivially destructible
+  for (char *chunk : arena_chunks) {
+    free(chunk);
+  }
+}
+
+template<typename T> T *SampleTrie::AllocNode() {
+  size_t size = (sizeof(T) + 7) & ~(size_t)7;
+  arena_mutex.Lock();
+  if (arena_remaining < size) {
+    arena_pos = (char *)malloc(SAMPLE_TRIE_ARENA_CHUNK_SIZE);
+    arena_remaining = SAMPLE_TRIE_ARENA_CHUNK_SIZE;
+    arena_chunks.push_back(arena_pos);
+  }
+  void *ret = arena_pos;
+  arena_pos += size;
+  arena_remaining -= size;
+  arena_mutex.Unlock();
+  return new(ret) T();
+}
 
-void SampleTrie::SampleTrieNode::InitConstantPart(Sample *sample,
-                                                  size_t from, size_t to)
-{
-  if(constant_part) free(constant_part);
-  constant_part = NULL;
-  constant_part_size = to - from;
-  if(!constant_part_size) return;
-  constant_part = (char *)malloc(constant_part_size);
-  memcpy(constant_part, sample->bytes + from, constant_part_size);
+bool SampleTrie::ReadLock(Node *node, uint64_t *version) {
+  uint64_t v = node->version.load();
+  if (v & 3) return false;
+  *version = v;
+  return true;
+}
+
+bool SampleTrie::CheckVersion(Node *node, uint64_t version) {
+  return node->version.load() == version;
+}
+
+bool SampleTrie::UpgradeLock(Node *node, uint64_t version) {
+  return node->version.compare_exchange_strong(version, version + 2);
+}
+
+void SampleTrie::WriteUnlock(Node *node) {
+  node->version.fetch_add(2);
+}
+
+void SampleTrie::WriteUnlockObsolete(Node *node) {
+  node->version.fetch_add(3);
+}
+
+SampleTrie::Node *SampleTrie::FindChild(Node *node, uint8_t key) {
+  switch (node->type) {
+  case NODE4: {
+    Node4 *n = (Node4 *)node;
+    uint32_t num_children = n->num_children;
+    if (num_children > 4) return NULL;
+    for (uint32_t i = 0; i < num_children; i++) {
+      if (n->keys[i] == key) return n->children[i];
+    }
+    return NULL;
+  }
+  case NODE16: {
+    Node16 *n = (Node16 *)node;
+    uint32_t num_children = n->num_children;
+    if (num_children > 16) return NULL;
+    for (uint32_t i = 0; i < num_children; i++) {
+      if (n->keys[i] == key) return n->children[i];
+    }
+    return NULL;
+  }
+  case NODE48: {
+    Node48 *n = (Node48 *)node;
+    uint8_t index = n->child_index[key];
+    if (!index) return NULL;
+    return n->children[index - 1];
+  }
+  case NODE256:
+    return ((Node256 *)node)->children[key];
+  }
+  return NULL;
+}
+
+bool SampleTrie::IsFull(Node *node) {
+  switch (node->type) {
+  case NODE4:
+    return node->num_children == 4;
+  case NODE16:
+    return node->num_children == 16;
+  case NODE48:
+    return node->num_children == 48;
+  default:
+    return false;
+  }
+}
+
+void SampleTrie::AddChild(Node *node, uint8_t key, Node *child) {
+  uint32_t num_children = node->num_children;
+  switch (node->type) {
+  case NODE4: {
+    Node4 *n = (Node4 *)node;
+    n->keys[num_children] = key;
+    n->children[num_children] = child;
+    break;
+  }
+  case NODE16: {
+    Node16 *n = (Node16 *)node;
+    n->keys[num_children] = key;
+    n->children[num_children] = child;
+    break;
+  }
+  case NODE48: {
+    Node48 *n = (Node48 *)node;
+    n->children[num_children] = child;
+    n->child_index[key] = (uint8_t)(num_children + 1);
+    break;
+  }
+  case NODE256:
+    ((Node256 *)node)->children[key] = child;
+    break;
+  }
+  node->num_children = num_children + 1;
+}
+
+void SampleTrie::ReplaceChild(Node *node, uint8_t key, Node *child) {
+  switch (node->type) {
+  case NODE4: {
+    Node4 *n = (Node4 *)node;
+    for (uint32_t i = 0; i < n->num_children; i++) {
+      if (n->keys[i] == key) n->children[i] = child;
+    }
+    break;
+  }
+  case NODE16: {
+    Node16 *n = (Node16 *)node;
+    for (uint32_t i = 0; i < n->num_children; i++) {
+      if (n->keys[i] == key) n->children[i] = child;
+    }
+    break;
+  }
+  case NODE48: {
+    Node48 *n = (Node48 *)node;
+    n->children[n->child_index[key] - 1] = child;
+    break;
+  }
+  case NODE256:
+    ((Node256 *)node)->children[key] = child;
+    break;
+  }
+}
+
+SampleTrie::Node *SampleTrie::Grow(Node *node) {
+  Node *new_node;
+  switch (node->type) {
+  case NODE4: {
+    Node4 *n = (Node4 *)node;
+    Node16 *n16 = AllocNode<Node16>();
+    for (uint32_t i = 0; i < n->num_children; i++) {
+      n16->keys[i] = n->keys[i].load();
+      n16->children[i] = n->children[i].load();
+    }
+    new_node = n16;
+    break;
+  }
+  case NODE16: {
+    Node16 *n = (Node16 *)node;
+    Node48 *n48 = AllocNode<Node48>();
+    for (uint32_t i = 0; i < n->num_children; i++) {
+      n48->children[i] = n->children[i].load();
+      n48->child_index[n->keys[i]] = (uint8_t)(i + 1);
+    }
+    new_node = n48;
+    break;
+  }
+  case NODE48: {
+    Node48 *n = (Node48 *)node;
+    Node256 *n256 = AllocNode<Node256>();
+    for (int key = 0; key < 256; key++) {
+      uint8_t index = n->child_index[key];
+      if (index) n256->children[key] = n->children[index - 1].load();
+    }
+    new_node = n256;
+    break;
+  }
+  default:
+    FATAL("Growing a full-sized trie node");
+  }
+  new_node->prefix = node->prefix.load();
+  new_node->prefix_size = node->prefix_size.load();
+  new_node->num_children = node->num_children.load();
+  return new_node;
+}
+
+SampleTrie::Node *SampleTrie::NewLeaf(Sample *sample, size_t from) {
+  Node4 *leaf = AllocNode<Node4>();
+  leaf->prefix = sample->bytes + from;
+  leaf->prefix_size = sample->size - from;
+  return leaf;
 }
 
 size_t SampleTrie::AddSample(Sample *sample) {
   if(sample->size == 0) return 0;
-  
-  sample_trie_mutex.Lock();
-  
-  if(root == NULL) {
-    root = new SampleTrieNode;
-    root->InitConstantPart(sample, 0, sample->size);
-    
-    sample_trie_mutex.Unlock();
-    return 0;
-  }
-  
-  SampleTrieNode *cur_node = root;
-  size_t cur_sample_pos = 0;
-  size_t cur_constant_pos = 0;
-  
-  while(1) {
-    
-   if(cur_sample_pos >= sample->size) {
+
+  const char *bytes = sample->bytes;
+
+restart:
+  Node *parent = NULL;
+  uint64_t parent_version = 0;
+  uint8_t parent_key = 0;
+
+  Node *node = root;
+  uint64_t version;
+  if (!ReadLock(node, &version)) goto restart;
+
+  size_t pos = 0;
+
+  while (1) {
+    const char *prefix = node->prefix;
+    size_t prefix_size = node->prefix_size;
+    // prefix and prefix_size must be consistent before
+    // reading the prefix bytes
+    if (!CheckVersion(node, version)) goto restart;
+
+    size_t match = 0;
+    while ((match < prefix_size) && (pos + match < sample->size) &&
+           (prefix[match] == bytes[pos + match]))
+    {
+      match++;
+    }
+
+    if (pos + match >= sample->size) {
       // normally, we'd need to split the current node
       // and mark it as leaf
       // but for the purpose of this trie there is no need
       // as we just want to know where one sample differs
       // from the rest
-     sample_trie_mutex.Unlock();
+      if (!CheckVersion(node, version)) goto restart;
       return sample->size;
     }
-      
-    unsigned char cur_char = (unsigned char)sample->bytes[cur_sample_pos];
-    if(cur_constant_pos >= cur_node->constant_part_size) {
-      auto iter = cur_node->children.find(cur_char);
-      if(iter != cur_node->children.end()) {
-        cur_node = iter->second;
-        cur_sample_pos++;
-        cur_constant_pos = 0;
-        continue;
-      } else {
-        size_t ret = cur_sample_pos;
-        SampleTrieNode *new_node = new SampleTrieNode;
-        new_node->InitConstantPart(sample, cur_sample_pos+1, sample->size);
-        cur_node->children[cur_char] = new_node;
-        
-        sample_trie_mutex.Unlock();
-        return cur_sample_pos;
+
+    if (match < prefix_size) {
+      // the sample differs within the prefix, split the node:
+      // a new node with the common part of the prefix
+      // replaces node in the parent
+      if (!UpgradeLock(parent, parent_version)) goto restart;
+      if (!UpgradeLock(node, version)) {
+        WriteUnlock(parent);
+        goto restart;
       }
+
+      Node4 *split = AllocNode<Node4>();
+      split->prefix = prefix;
+      split->prefix_size = match;
+      AddChild(split, (uint8_t)prefix[match], node);
+      AddChild(split, (uint8_t)bytes[pos + match], NewLeaf(sample, pos + match + 1));
+
+      node->prefix = prefix + match + 1;
+      node->prefix_size = prefix_size - match - 1;
+
+      ReplaceChild(parent, parent_key, split);
+
+      WriteUnlock(node);
+      WriteUnlock(parent);
+      return pos + match;
     }
-      
-    unsigned char trie_char = (unsigned char)cur_node->constant_part[cur_constant_pos];
-    if(trie_char == cur_char) {
-      cur_sample_pos++;
-      cur_constant_pos++;
-      continue;
-    } else {
-      SampleTrieNode *new_node1 = new SampleTrieNode;
-      new_node1->constant_part_size = cur_node->constant_part_size - cur_constant_pos - 1;
-      if(new_node1->constant_part_size) {
-        new_node1->constant_part = (char *)malloc(new_node1->constant_part_size);
-        memcpy(new_node1->constant_part, cur_node->constant_part + cur_constant_pos + 1, new_node1->constant_part_size);
+
+    pos += prefix_size;
+    uint8_t key = (uint8_t)bytes[pos];
+    Node *child = FindChild(node, key);
+    if (!CheckVersion(node, version)) goto restart;
+
+    if (!child) {
+      if (!IsFull(node)) {
+        if (!UpgradeLock(node, version)) goto restart;
+        AddChild(node, key, NewLeaf(sample, pos + 1));
+        WriteUnlock(node);
+        return pos;
+      }
+
+      // replace node with a larger copy.
+      // The root is never full, so there is always a parent
+      if (!UpgradeLock(parent, parent_version)) goto restart;
+      if (!UpgradeLock(node, version)) {
+        WriteUnlock(parent);
+        goto restart;
       }
-      new_node1->children = cur_node->children;
-      cur_node->children.clear();
-      cur_node->constant_part_size = cur_constant_pos;
-      cur_node->constant_part = (char *)realloc(cur_node->constant_part, cur_constant_pos);
-      cur_node->children[trie_char] = new_node1;
-        
-      SampleTrieNode *new_node2 = new SampleTrieNode;
-      new_node2->InitConstantPart(sample, cur_sample_pos+1, sample->size);
-      cur_node->children[cur_char] = new_node2;
-      
-      sample_trie_mutex.Unlock();
-      return cur_sample_pos;
+      Node *new_node = Grow(node);
+      AddChild(new_node, key, NewLeaf(sample, pos + 1));
+      ReplaceChild(parent, parent_key, new_node);
+      WriteUnlockObsolete(node);
+      WriteUnlock(parent);
+      return pos;
     }
+
+    if (parent && !CheckVersion(parent, parent_version)) goto restart;
+
+    parent = node;
+    parent_version = version;
+    parent_key = key;
+
+    node = child;
+    if (!ReadLock(node, &version)) goto restart;
+    // the child pointer must still be valid
+    if (!CheckVersion(parent, parent_version)) goto restart;
+
+    pos++;
   }
-  
-  sample_trie_mutex.Unlock();
 }
@@ -17,17 +17,32 @@ limitations under the License.
 #pragma once
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <unordered_map>
 #include <string>
+#include <vector>
+#include <atomic>
 
 #include "mutex.h"
 
 #define DEFAULT_MAX_SAMPLE_SIZE 1000000
 
+// a range of bytes modified in place
+struct SamplePatch {
+  size_t offset;
+  size_t size;
+};
+
 class Sample {
 public:
   char *bytes;
   size_t size;
+  // number of bytes allocated, can be larger than size
+  // so that samples can be reused and grown in place
+  size_t capacity;
+  // false if bytes point to a buffer owned by someone else
+  // (e.g. a shared memory sample delivery buffer)
+  bool owns_bytes;
   std::string filename;
 
   Sample();
@@ -52,8 +67,59 @@ public:
   void Init(const char *data, size_t size);
   void Init(size_t size);
 
+  // makes sure there is space for at least new_capacity bytes,
+  // preserving the current contents. The capacity grows
+  // geometrically (up to max_size), so that a sample that keeps
+  // growing by small amounts is only reallocated a few times
+  void Reserve(size_t new_capacity);
+
+  // replaces the contents with a copy of in,
+  // reusing the existing allocation if it is large enough
+  void Assign(const Sample &in);
+
+  // makes the sample use an externally owned buffer of the given
+  // capacity, so that it can be modified in place. If the sample
+  // later needs to grow past the capacity, it moves to its own memory.
+  void UseBuffer(char *buffer, size_t capacity, size_t size = 0);
+
+  // copies the contents of an external buffer into own memory
+  void Detach();
+
+  // takes ownership of new_bytes, which must be allocated with malloc
+  void SetBytes(char *new_bytes, size_t new_size);
+
+  // starts recording in-place modifications, so that the sample
+  // can later be reverted to its current contents (the base)
+  // by copying back only the modified bytes.
+  void StartPatchLog();
+
+  // records that size bytes at offset are about to be modified.
+  // Any modification that goes through other Sample methods
+  // invalidates the log.
+  void Patch(size_t offset, size_t size) {
+    if (!patch_log_valid) return;
+    patch_log.push_back({offset, size});
+    patched_bytes += size;
+    // copying the whole sample is cheaper at this point
+    if (patched_bytes > (size_t)(this->size / 2)) patch_log_valid = false;
+  }
+
+  // restores the contents of base, which must be the same as
+  // when StartPatchLog() was called. Returns false if that can't
+  // be done from the patch log, in which case the sample is unchanged.
+  bool RevertPatches(Sample &base);
+
+  // same as FindFirstDiff(base), but only looks at the patched
+  // bytes if possible
+  size_t FindFirstPatchDiff(Sample &base);
+
   void Append(char *data, size_t size);
 
+  // replaces remove_size bytes at offset with insert_size bytes
+  // of unspecified content that the caller fills in, moving the
+  // rest of the sample in place
+  void Splice(size_t offset, size_t remove_size, size_t insert_size);
+
   void Trim(size_t new_size);
   
   void Resize(size_t new_size);
@@ -62,35 +128,129 @@ public:
 
   size_t FindFirstDiff(Sample &other);
 
+  uint64_t Hash() { return HashBytes(bytes, size); }
+
+  static uint64_t HashBytes(const char *data, size_t size);
+
   static size_t max_size;
+
+protected:
+  void FreeBytes();
+
+  bool patch_log_valid;
+  size_t patched_bytes;
+  std::vector<SamplePatch> patch_log;
+};
+
+// remembers the hashes of recently seen samples.
+// A hash can be stored in one of two slots of a fixed-size
+// table, and when both are taken one of them gets evicted,
+// so the set holds an approximation of the last samples seen.
+class RecentSampleSet {
+public:
+  RecentSampleSet(int size_log2);
+
+  // returns true if the hash was already in the set,
+  // otherwise adds it
+  bool CheckAndAdd(uint64_t hash);
+
+protected:
+  std::vector<uint64_t> slots;
+  uint64_t mask;
 };
 
 // a Trie-like structure whose purpose is to be able to
 // quickly identify the first byte of a sample
-// that differs from the samples seen so far
+// that differs from the samples seen so far.
+// It is a radix trie with adaptively sized nodes (as in ART),
+// where the compressed paths point into the samples themselves,
+// so samples added to the trie must not be modified or freed
+// for as long as the trie exists.
+// Lookups are optimistic and don't take any locks, an insert only
+// locks the node it changes (and its parent if the node gets replaced).
 class SampleTrie {
 public:
-  SampleTrie() {
-    root = NULL;
-  }
-  
+  SampleTrie();
+  ~SampleTrie();
+
+  // adds the sample and returns the offset of its
+  // first byte that differs from all previous samples.
+  // Can be called from any thread.
   size_t AddSample(Sample *sample);
 
 protected:
-  struct SampleTrieNode {
-    SampleTrieNode();
-    ~SampleTrieNode();
-    
-    void InitConstantPart(Sample *sample, size_t from, size_t to);
+  enum NodeType {
+    NODE4,
+    NODE16,
+    NODE48,
+    NODE256,
+  };
 
-    char *constant_part;
-    size_t constant_part_size;
+  // version is used as an optimistic lock:
+  // bit 0 is set for obsolete (replaced) nodes,
+  // bit 1 is set while the node is being modified,
+  // and every modification increments the rest
+  struct Node {
+    Node(NodeType type) : version(0), prefix(NULL), prefix_size(0),
+      type(type), num_children(0) {}
 
-    std::unordered_map<unsigned char, SampleTrieNode*> children;
-    bool leaf;
+    std::atomic<uint64_t> version;
+    // the bytes every sample in the subtree has in common,
+    // before the child key
+    std::atomic<const char *> prefix;
+    std::atomic<size_t> prefix_size;
+    NodeType type;
+    std::atomic<uint32_t> num_children;
+  };
+
+  struct Node4 : Node {
+    Node4() : Node(NODE4) {}
+    std::atomic<uint8_t> keys[4];
+    std::atomic<Node *> children[4];
   };
-  
-  static Mutex sample_trie_mutex;
-  SampleTrieNode *root;
-};
 
+  struct Node16 : Node {
+    Node16() : Node(NODE16) {}
+    std::atomic<uint8_t> keys[16];
+    std::atomic<Node *> children[16];
+  };
+
+  struct Node48 : Node {
+    Node48();
+    // index into children + 1, 0 if there is no child
+    std::atomic<uint8_t> child_index[256];
+    std::atomic<Node *> children[48];
+  };
+
+  struct Node256 : Node {
+    Node256();
+    std::atomic<Node *> children[256];
+  };
+
+  Node *FindChild(Node *node, uint8_t key);
+  bool IsFull(Node *node);
+  // the node must be locked and not full
+  void AddChild(Node *node, uint8_t key, Node *child);
+  // the node must be locked
+  void ReplaceChild(Node *node, uint8_t key, Node *child);
+  // a copy of node with space for more children
+  Node *Grow(Node *node);
+  Node *NewLeaf(Sample *sample, size_t from);
+
+  bool ReadLock(Node *node, uint64_t *version);
+  bool CheckVersion(Node *node, uint64_t version);
+  bool UpgradeLock(Node *node, uint64_t version);
+  void WriteUnlock(Node *node);
+  void WriteUnlockObsolete(Node *node);
+
+  template<typename T> T *AllocNode();
+
+  Node256 *root;
+
+  // nodes are never freed individually, as readers might
+  // still be looking at replaced nodes
+  Mutex arena_mutex;
+  std::vector<char *> arena_chunks;
+  char *arena_pos;
+  size_t arena_remaining;
+};
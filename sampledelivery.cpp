@@ -17,13 +17,185 @@ limitations under the License.
 #include "common.h"
 #include "sampledelivery.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+FileSampleDelivery::FileSampleDelivery() {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  file_handle = INVALID_HANDLE_VALUE;
+#else
+  fd = -1;
+#endif
+  keep_open = true;
+  skip_unchanged = false;
+  have_last_sample = false;
+  last_size = 0;
+  last_hash = 0;
+}
+
+FileSampleDelivery::~FileSampleDelivery() {
+  CloseFile();
+}
+
+void FileSampleDelivery::Init(int argc, char **argv) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  keep_open = GetBinaryOption("-delivery_keep_open", argc, argv, false);
+#endif
+  skip_unchanged = GetBinaryOption("-delivery_skip_unchanged", argc, argv, false);
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+
+void FileSampleDelivery::CloseFile() {
+  if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+  file_handle = INVALID_HANDLE_VALUE;
+}
+
+void FileSampleDelivery::SetFilename(std::string filename) {
+  CloseFile();
+  this->filename = filename;
+  have_last_sample = false;
+  if (!keep_open) return;
+  // the target must be able to open the file while we hold it
+  file_handle = CreateFileA(filename.c_str(),
+    GENERIC_WRITE,
+    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    NULL,
+    CREATE_ALWAYS,
+    FILE_ATTRIBUTE_NORMAL,
+    NULL);
+  if (file_handle == INVALID_HANDLE_VALUE) {
+    FATAL("Error creating %s", filename.c_str());
+  }
+}
+
+bool FileSampleDelivery::UseMemoryFile() {
+  return false;
+}
+
 int FileSampleDelivery::DeliverSample(Sample *sample) {
-  return sample->Save(filename.c_str());
+  uint64_t hash = 0;
+  if (skip_unchanged) {
+    hash = sample->Hash();
+    if (have_last_sample && (sample->size == last_size) && (hash == last_hash)) {
+      return 1;
+    }
+  }
+  have_last_sample = false;
+  // if the write fails, the file size is unknown
+  size_t file_size = last_size;
+  last_size = SIZE_MAX;
+
+  if (!keep_open) {
+    // same sharing as fopen, the file is closed again before the target runs
+    file_handle = CreateFileA(filename.c_str(),
+      GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE,
+      NULL,
+      CREATE_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) return 0;
+    file_size = 0;
+  }
+
+  OVERLAPPED overlapped = {};
+  DWORD written;
+  bool ok = WriteFile(file_handle, sample->bytes, (DWORD)sample->size, &written, &overlapped) &&
+            (written == sample->size);
+  if (ok && (sample->size < file_size)) {
+    LARGE_INTEGER offset;
+    offset.QuadPart = sample->size;
+    ok = SetFilePointerEx(file_handle, offset, NULL, FILE_BEGIN) &&
+         SetEndOfFile(file_handle);
+  }
+  if (!keep_open) CloseFile();
+  if (!ok) return 0;
+
+  last_size = sample->size;
+  last_hash = hash;
+  have_last_sample = true;
+  return 1;
 }
 
+#else
+
+void FileSampleDelivery::CloseFile() {
+  if (fd != -1) close(fd);
+  fd = -1;
+}
+
+void FileSampleDelivery::SetFilename(std::string filename) {
+  CloseFile();
+  this->filename = filename;
+  have_last_sample = false;
+  fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    FATAL("Error creating %s", filename.c_str());
+  }
+}
+
+bool FileSampleDelivery::UseMemoryFile() {
+#if defined(__linux__)
+  int memfd = memfd_create("jackalope_input", MFD_CLOEXEC);
+  if (memfd == -1) return false;
+  CloseFile();
+  fd = memfd;
+  have_last_sample = false;
+  // unlike /proc/self, this doesn't depend on
+  // the target inheriting the descriptor
+  filename = std::string("/proc/") + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+  return true;
+#else
+  return false;
+#endif
+}
+
+int FileSampleDelivery::DeliverSample(Sample *sample) {
+  uint64_t hash = 0;
+  if (skip_unchanged) {
+    hash = sample->Hash();
+    if (have_last_sample && (sample->size == last_size) && (hash == last_hash)) {
+      return 1;
+    }
+  }
+  have_last_sample = false;
+  // if the write fails, the file size is unknown
+  size_t file_size = last_size;
+  last_size = SIZE_MAX;
+
+  const char *data = sample->bytes;
+  size_t remaining = sample->size;
+  off_t offset = 0;
+  while (remaining) {
+    ssize_t written = pwrite(fd, data, remaining, offset);
+    if (written <= 0) return 0;
+    data += written;
+    offset += written;
+    remaining -= written;
+  }
+  if ((sample->size < file_size) && ftruncate(fd, sample->size)) {
+    return 0;
+  }
+
+  last_size = sample->size;
+  last_hash = hash;
+  have_last_sample = true;
+  return 1;
+}
+
+#endif
+
 SHMSampleDelivery::SHMSampleDelivery(char *name, size_t size) {
   shmobj.Open(name, size);
   shm = shmobj.GetData();
+  attached_sample = NULL;
 }
 
 SHMSampleDelivery::~SHMSampleDelivery() {
@@ -34,7 +206,20 @@ int SHMSampleDelivery::DeliverSample(Sample *sample) {
   uint32_t *size_ptr = (uint32_t *)shm;
   unsigned char *data_ptr = shm + 4;
   *size_ptr = (uint32_t)sample->size;
+  // the sample is already in place
+  if (sample->bytes == (char *)data_ptr) return 1;
+  // the attached sample is about to be overwritten,
+  // move it to its own memory first
+  if (attached_sample && (attached_sample->bytes == (char *)data_ptr)) {
+    attached_sample->Detach();
+  }
   memcpy(data_ptr, sample->bytes, sample->size);
   return 1;
 }
 
+bool SHMSampleDelivery::AttachSample(Sample *sample) {
+  sample->UseBuffer((char *)shm + 4, shmobj.GetSize() - 4);
+  attached_sample = sample;
+  return true;
+}
+
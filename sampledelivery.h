@@ -27,26 +27,62 @@ public:
 
   // returns nonzero on success
   virtual int DeliverSample(Sample *sample) = 0;
+
+  // if the sample delivery has a buffer the target reads samples from,
+  // makes sample use it so that the sample can be built in place
+  // and delivered without copying. Returns false if not supported.
+  virtual bool AttachSample(Sample *sample) { return false; }
 };
 
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+#include "windows.h"
+#endif
+
+// keeps the file open for the whole session, so delivering
+// a sample is a write (and a truncate if the sample got smaller).
+// On Windows, the file is only kept open with -delivery_keep_open,
+// since a target that doesn't allow other writers can't open it then.
+// With -delivery_skip_unchanged, nothing is written if the sample
+// is the same as the last one.
 class FileSampleDelivery : public SampleDelivery {
 public:
+  FileSampleDelivery();
+  ~FileSampleDelivery();
+
+  void Init(int argc, char **argv);
+
+  // creates the file samples get written to
+  void SetFilename(std::string filename);
+
+  // uses an anonymous in-memory file (Linux only) that the
+  // target can open as /proc/<fuzzer pid>/fd/<n>.
+  // Returns false if not supported.
+  bool UseMemoryFile();
 
-  void SetFilename(std::string filename) {
-    this->filename = filename;
-  }
+  std::string &GetFilename() { return filename; }
 
   int DeliverSample(Sample *sample);
   
 protected:
+  void CloseFile();
 
   std::string filename;
-};
+
+  bool keep_open;
+  bool skip_unchanged;
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
-#include "windows.h"
+  HANDLE file_handle;
+#else
+  int fd;
 #endif
 
+  // the contents of the file, assuming the target doesn't change it
+  bool have_last_sample;
+  size_t last_size;
+  uint64_t last_hash;
+};
+
 class SHMSampleDelivery : public SampleDelivery {
 public:
   SHMSampleDelivery(char *name, size_t size);
@@ -54,8 +90,13 @@ public:
 
   int DeliverSample(Sample *sample);
 
+  bool AttachSample(Sample *sample);
+
 protected:
   SharedMemory shmobj;
   unsigned char *shm;
+
+  // the sample that was last built in the shared memory
+  Sample *attached_sample;
 };
 
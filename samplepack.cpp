@@ -0,0 +1,241 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <list>
+
+#include "common.h"
+#include "directory.h"
+#include "samplepack.h"
+
+#define SAMPLE_PACK_PREFIX "pack."
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+SamplePack::SamplePack() : current_segment(NULL) { }
+
+SamplePack::~SamplePack() {
+  for (Segment *segment : segments) {
+    if (segment) CloseSegment(segment);
+  }
+}
+
+std::string SamplePack::GetSegmentPath(uint64_t segment) {
+  return DirJoin(dir, std::string(SAMPLE_PACK_PREFIX) + std::to_string(segment));
+}
+
+void SamplePack::Init(std::string &dir, bool restore) {
+  this->dir = dir;
+
+  std::list<std::string> files;
+  GetFilesInDirectory(dir, files);
+
+  std::string prefix = DirJoin(dir, SAMPLE_PACK_PREFIX);
+  for (std::string &file : files) {
+    if (file.compare(0, prefix.size(), prefix) != 0) continue;
+    const char *index_str = file.c_str() + prefix.size();
+    char *end;
+    uint64_t index = strtoull(index_str, &end, 10);
+    if ((end == index_str) || *end) continue;
+
+    if (!restore) {
+      RemoveFile(file);
+      continue;
+    }
+
+    // samples from the previous session are only read,
+    // new samples go to new pack files
+    Segment *segment = OpenSegment(index, 0, false);
+    if (!segment) continue;
+    if (index >= segments.size()) segments.resize(index + 1, NULL);
+    segments[index] = segment;
+  }
+}
+
+void SamplePack::Add(Sample *sample, Sample *out_sample, uint64_t *segment, uint64_t *offset) {
+  mutex.Lock();
+
+  if (!current_segment || (current_segment->used + sample->size > current_segment->size)) {
+    uint64_t segment_size = SAMPLE_PACK_SEGMENT_SIZE;
+    if (sample->size > segment_size) segment_size = sample->size;
+    uint64_t index = segments.size();
+    current_segment = OpenSegment(index, segment_size, true);
+    if (!current_segment) {
+      FATAL("Error creating sample pack %s", GetSegmentPath(index).c_str());
+    }
+    segments.push_back(current_segment);
+  }
+
+  *segment = segments.size() - 1;
+  *offset = current_segment->used;
+  WriteSegment(current_segment, current_segment->used, sample->bytes, sample->size);
+  current_segment->used += sample->size;
+
+  out_sample->UseBuffer(current_segment->data + *offset, sample->size, sample->size);
+
+  mutex.Unlock();
+}
+
+bool SamplePack::Get(uint64_t segment, uint64_t offset, uint64_t size, Sample *sample) {
+  mutex.Lock();
+  if ((segment >= segments.size()) || !segments[segment] ||
+      (offset + size > segments[segment]->used))
+  {
+    mutex.Unlock();
+    return false;
+  }
+  sample->UseBuffer(segments[segment]->data + offset, size, size);
+  mutex.Unlock();
+  return true;
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+
+SamplePack::Segment *SamplePack::OpenSegment(uint64_t index, uint64_t size, bool create) {
+  Segment *segment = new Segment();
+  segment->path = GetSegmentPath(index);
+
+  segment->file_handle = CreateFileA(segment->path.c_str(),
+    GENERIC_READ | GENERIC_WRITE,
+    FILE_SHARE_READ,
+    NULL,
+    create ? CREATE_ALWAYS : OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL,
+    NULL);
+  if (segment->file_handle == INVALID_HANDLE_VALUE) {
+    delete segment;
+    return NULL;
+  }
+
+  LARGE_INTEGER file_size;
+  if (create) {
+    file_size.QuadPart = size;
+    SetFilePointerEx(segment->file_handle, file_size, NULL, FILE_BEGIN);
+    SetEndOfFile(segment->file_handle);
+    segment->used = 0;
+  } else {
+    GetFileSizeEx(segment->file_handle, &file_size);
+    size = file_size.QuadPart;
+    segment->used = size;
+  }
+  segment->size = size;
+
+  if (!size) {
+    CloseHandle(segment->file_handle);
+    delete segment;
+    return NULL;
+  }
+
+  segment->mapping_handle = CreateFileMapping(segment->file_handle,
+    NULL, PAGE_READONLY, 0, 0, NULL);
+  if (segment->mapping_handle == NULL) {
+    FATAL("CreateFileMapping failed, %x", GetLastError());
+  }
+
+  segment->data = (char *)MapViewOfFile(segment->mapping_handle,
+    FILE_MAP_READ, 0, 0, (SIZE_T)size);
+  if (!segment->data) {
+    FATAL("MapViewOfFile failed");
+  }
+
+  return segment;
+}
+
+void SamplePack::CloseSegment(Segment *segment) {
+  UnmapViewOfFile(segment->data);
+  CloseHandle(segment->mapping_handle);
+  CloseHandle(segment->file_handle);
+  delete segment;
+}
+
+// writes to the file are visible through the mapping
+void SamplePack::WriteSegment(Segment *segment, uint64_t offset, char *data, size_t size) {
+  OVERLAPPED overlapped = {};
+  overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written;
+  if (!WriteFile(segment->file_handle, data, (DWORD)size, &written, &overlapped) ||
+      (written != size))
+  {
+    FATAL("Error writing to sample pack %s", segment->path.c_str());
+  }
+}
+
+#else
+
+SamplePack::Segment *SamplePack::OpenSegment(uint64_t index, uint64_t size, bool create) {
+  Segment *segment = new Segment();
+  segment->path = GetSegmentPath(index);
+
+  int flags = create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY;
+  segment->fd = open(segment->path.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (segment->fd == -1) {
+    delete segment;
+    return NULL;
+  }
+
+  if (create) {
+    // the file is sparse until samples get written to it
+    if (ftruncate(segment->fd, size) == -1) {
+      FATAL("Error creating sample pack %s", segment->path.c_str());
+    }
+    segment->used = 0;
+  } else {
+    struct stat st;
+    fstat(segment->fd, &st);
+    size = st.st_size;
+    segment->used = size;
+  }
+  segment->size = size;
+
+  if (!size) {
+    close(segment->fd);
+    delete segment;
+    return NULL;
+  }
+
+  segment->data = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, segment->fd, 0);
+  if (segment->data == MAP_FAILED) {
+    FATAL("Error mapping sample pack %s", segment->path.c_str());
+  }
+
+  return segment;
+}
+
+void SamplePack::CloseSegment(Segment *segment) {
+  munmap(segment->data, segment->size);
+  close(segment->fd);
+  delete segment;
+}
+
+// writes to the file are visible through the mapping
+void SamplePack::WriteSegment(Segment *segment, uint64_t offset, char *data, size_t size) {
+  while (size) {
+    ssize_t written = pwrite(segment->fd, data, size, offset);
+    if (written <= 0) {
+      FATAL("Error writing to sample pack %s", segment->path.c_str());
+    }
+    data += written;
+    offset += written;
+    size -= written;
+  }
+}
+
+#endif
@@ -0,0 +1,87 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+#include "windows.h"
+#endif
+
+#include "sample.h"
+#include "mutex.h"
+
+// size of a pack file, samples that don't fit
+// into a pack file get a pack file of their own
+#define SAMPLE_PACK_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// An append-only store for corpus samples.
+// Samples are written into fixed-size pack files (pack.<n>)
+// that are memory-mapped read-only, so that every sample is
+// accessible without a heap copy and the OS page cache
+// decides which parts of the corpus are kept in memory.
+// Samples are identified by their pack file and offset.
+class SamplePack {
+public:
+  SamplePack();
+  ~SamplePack();
+
+  // opens the pack files in dir. If the previous state
+  // isn't going to be restored, they are deleted.
+  void Init(std::string &dir, bool restore);
+
+  // appends a copy of sample to the pack, and turns out_sample
+  // into a read-only view of the packed copy.
+  // Can be called from any thread.
+  void Add(Sample *sample, Sample *out_sample, uint64_t *segment, uint64_t *offset);
+
+  // turns sample into a read-only view of the packed data.
+  // Returns false if the data isn't in the pack.
+  bool Get(uint64_t segment, uint64_t offset, uint64_t size, Sample *sample);
+
+protected:
+  struct Segment {
+    std::string path;
+    uint64_t size;
+    uint64_t used;
+    char *data;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    HANDLE file_handle;
+    HANDLE mapping_handle;
+#else
+    int fd;
+#endif
+  };
+
+  std::string GetSegmentPath(uint64_t segment);
+  // creates a pack file of the given size if it doesn't exist
+  Segment *OpenSegment(uint64_t segment, uint64_t size, bool create);
+  void CloseSegment(Segment *segment);
+  void WriteSegment(Segment *segment, uint64_t offset, char *data, size_t size);
+
+  std::string dir;
+
+  Mutex mutex;
+
+  // indexed by the pack file number,
+  // NULL for pack files that don't exist
+  std::vector<Segment *> segments;
+  // the pack file new samples are appended to
+  Segment *current_segment;
+};
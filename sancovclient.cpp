@@ -26,6 +26,7 @@ limitations under the License.
 #include <errno.h>
 
 #include "sancovclient.h"
+#include "cmplog.h"
 
 #define FUZZ_CHILD_CTRL_IN 1000
 #define FUZZ_CHILD_CTRL_OUT 1001
@@ -33,6 +34,13 @@ limitations under the License.
 #define COV_SHM_SIZE 0x100000
 #define MAX_EDGES ((COV_SHM_SIZE - 4) * 8)
 
+// the target is compiled with Clang (see README_sancov.md)
+#if defined(__clang__)
+#define NO_COVERAGE __attribute__((no_sanitize("coverage")))
+#else
+#define NO_COVERAGE
+#endif
+
 #define CHECK(cond) if (!(cond)) { fprintf(stderr, "\"" #cond "\" failed\n"); _exit(-1); }
 
 #define SAY(...)    printf(__VA_ARGS__)
@@ -57,6 +65,10 @@ struct cov_shmem_data {
 struct cov_shmem_data* cov_shmem;
 uint32_t *__edges_start, *__edges_stop;
 
+// NULL unless the fuzzer runs with -cmplog
+CmpLogShmemData* cmplog_shmem;
+
+NO_COVERAGE
 void __sanitizer_cov_reset_edgeguards() {
     uint64_t N = 0;
     for (uint32_t *x = __edges_start; x < __edges_stop && N < MAX_EDGES; x++)
@@ -66,7 +78,7 @@ void __sanitizer_cov_reset_edgeguards() {
 extern char **environ;
 
 
-extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
     // Avoid duplicate initialization
     if (start == stop || *start)
         return;
@@ -102,9 +114,24 @@ extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *s
 
     cov_shmem->num_edges = stop - start;
     printf("[COV] edge counters initialized. Shared memory: %s with %u edges\n", shm_key, cov_shmem->num_edges);
+
+    const char* cmplog_shm_key = getenv("CMPLOG_SHM_ID");
+    if (cmplog_shm_key) {
+        int fd = shm_open(cmplog_shm_key, O_RDWR, S_IREAD | S_IWRITE);
+        if (fd <= -1) {
+            fprintf(stderr, "Failed to open shared memory region: %s\n", strerror(errno));
+            _exit(-1);
+        }
+
+        cmplog_shmem = (CmpLogShmemData*) mmap(0, CMPLOG_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (cmplog_shmem == MAP_FAILED) {
+            fprintf(stderr, "Failed to mmap shared memory region\n");
+            _exit(-1);
+        }
+    }
 }
 
-extern "C" void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
     // There's a small race condition here: if this function executes in two threads for the same
     // edge at the same time, the first thread might disable the edge (by setting the guard to zero)
     // before the second thread fetches the guard value (and thus the index). However, our
@@ -117,6 +144,79 @@ extern "C" void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
     *guard = 0;
 }
 
+// Comparison hooks, called for every comparison when the target
+// is compiled with -fsanitize-coverage=trace-cmp. Like the other
+// hooks, they must not be instrumented themselves.
+NO_COVERAGE
+static void log_cmp(uint8_t type, const void *op1, size_t size1, const void *op2, size_t size2) {
+    if (!cmplog_shmem || !cmplog_shmem->enabled) return;
+    uint32_t index = __atomic_fetch_add(&cmplog_shmem->num_entries, 1, __ATOMIC_RELAXED);
+    if (index >= CMPLOG_MAX_ENTRIES) return;
+    if (size1 > CMPLOG_OPERAND_SIZE) size1 = CMPLOG_OPERAND_SIZE;
+    if (size2 > CMPLOG_OPERAND_SIZE) size2 = CMPLOG_OPERAND_SIZE;
+    CmpLogEntry *entry = &cmplog_shmem->entries[index];
+    entry->type = type;
+    entry->size1 = (uint8_t)size1;
+    entry->size2 = (uint8_t)size2;
+    memcpy(entry->op1, op1, size1);
+    memcpy(entry->op2, op2, size2);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_cmp1(uint8_t arg1, uint8_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 1, &arg2, 1);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_cmp2(uint16_t arg1, uint16_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 2, &arg2, 2);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_cmp4(uint32_t arg1, uint32_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 4, &arg2, 4);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_cmp8(uint64_t arg1, uint64_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 8, &arg2, 8);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_const_cmp1(uint8_t arg1, uint8_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 1, &arg2, 1);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_const_cmp2(uint16_t arg1, uint16_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 2, &arg2, 2);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_const_cmp4(uint32_t arg1, uint32_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 4, &arg2, 4);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_const_cmp8(uint64_t arg1, uint64_t arg2) {
+    log_cmp(CMPLOG_INTEGER, &arg1, 8, &arg2, 8);
+}
+
+// cases[0] is the number of cases, cases[1] the size of val in bits
+extern "C" NO_COVERAGE void __sanitizer_cov_trace_switch(uint64_t val, uint64_t *cases) {
+    size_t size = cases[1] / 8;
+    for (uint64_t i = 0; i < cases[0]; i++) {
+        // the values are little-endian, the lower bytes come first
+        log_cmp(CMPLOG_INTEGER, &val, size, &cases[i + 2], size);
+    }
+}
+
+// called by the sanitizer runtime (e.g. ASan) for the intercepted
+// functions. Only the compared part of the memory is logged
+extern "C" NO_COVERAGE void __sanitizer_weak_hook_memcmp(void *caller_pc, const void *s1, const void *s2, size_t n, int result) {
+    log_cmp(CMPLOG_MEMORY, s1, n, s2, n);
+}
+
+extern "C" NO_COVERAGE void __sanitizer_weak_hook_strncmp(void *caller_pc, const char *s1, const char *s2, size_t n, int result) {
+    log_cmp(CMPLOG_MEMORY, s1, strnlen(s1, n), s2, strnlen(s2, n));
+}
+
+extern "C" NO_COVERAGE void __sanitizer_weak_hook_strcmp(void *caller_pc, const char *s1, const char *s2, int result) {
+    __sanitizer_weak_hook_strncmp(caller_pc, s1, s2, CMPLOG_OPERAND_SIZE, result);
+}
+
 void __pre_fuzz() {
   // printf("__pre_fuzz\n");
   __sanitizer_cov_reset_edgeguards();
@@ -45,6 +45,7 @@ extern char **environ;
 SanCovInstrumentation::SanCovInstrumentation(int thread_id) {
   this->thread_id = thread_id;
   cov_shm = NULL;
+  cmplog_shm = NULL;
   pid = 0;
   return_value = 0;
   module_name = "target";
@@ -56,6 +57,11 @@ SanCovInstrumentation::~SanCovInstrumentation() {
     shm_unlink(coverage_shm_name.c_str());
     close(cov_shm_fd);
   }
+  if(cmplog_shm) {
+    munmap(cmplog_shm, CMPLOG_SHM_SIZE);
+    shm_unlink(cmplog_shm_name.c_str());
+    close(cmplog_shm_fd);
+  }
 }
 
 void SanCovInstrumentation::Init(int argc, char **argv) {
@@ -68,10 +74,19 @@ void SanCovInstrumentation::Init(int argc, char **argv) {
   additional_env.push_back(std::string("SAMPLE_SHM_ID=") + sample_shm_name);
   additional_env.push_back(std::string("COV_SHM_ID=") + coverage_shm_name);
   additional_env.push_back(std::string("ASAN_OPTIONS=exitcode=") + std::to_string(ASAN_EXIT_STATUS));
+
+  bool cmplog = GetBinaryOption("-cmplog", argc, argv, false);
+  if(cmplog) {
+    cmplog_shm_name = std::string("/shm_fuzz_cmplog_") + std::to_string(getpid()) + "_" + std::to_string(thread_id);
+    additional_env.push_back(std::string("CMPLOG_SHM_ID=") + cmplog_shm_name);
+  }
+
   ComputeEnvp(additional_env);
   
   // set up shmem for coverage
   SetUpShmem();
+
+  if(cmplog) SetUpCmpLogShmem();
   
   virgin_bits = (uint8_t *)malloc(COVERAGE_SHM_SIZE);
   memset(virgin_bits, 0xff, COVERAGE_SHM_SIZE);
@@ -108,6 +123,27 @@ void SanCovInstrumentation::SetUpShmem() {
   memset(cov_shm, 0, COVERAGE_SHM_SIZE);
 }
 
+void SanCovInstrumentation::SetUpCmpLogShmem() {
+  cmplog_shm_fd = shm_open(cmplog_shm_name.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (cmplog_shm_fd == -1)
+  {
+    FATAL("Error creating shared memory");
+  }
+
+  if (ftruncate(cmplog_shm_fd, CMPLOG_SHM_SIZE) == -1)
+  {
+    FATAL("Error creating shared memory");
+  }
+
+  cmplog_shm = (CmpLogShmemData *)mmap(NULL, CMPLOG_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, cmplog_shm_fd, 0);
+  if (cmplog_shm == MAP_FAILED)
+  {
+    FATAL("Error creating shared memory");
+  }
+
+  memset(cmplog_shm, 0, CMPLOG_SHM_SIZE);
+}
+
 void SanCovInstrumentation::ComputeEnvp(std::list<std::string> &additional_env) {
   int environ_size = 0;
   char **p = environ;
@@ -365,6 +401,18 @@ void SanCovInstrumentation::ClearCoverage() {
   memset(cov_shm->edges, 0, size);
 }
 
+void SanCovInstrumentation::SetCmpLog(bool enabled) {
+  cmplog_shm->num_entries = 0;
+  cmplog_shm->enabled = enabled;
+}
+
+void SanCovInstrumentation::GetCmpLog(std::vector<CmpLogEntry> &entries) {
+  // entries past the end of the buffer are counted, but not written
+  size_t num_entries = cmplog_shm->num_entries;
+  if(num_entries > CMPLOG_MAX_ENTRIES) num_entries = CMPLOG_MAX_ENTRIES;
+  entries.assign(cmplog_shm->entries, cmplog_shm->entries + num_entries);
+}
+
 void SanCovInstrumentation::IgnoreCoverage(Coverage &coverage) {
   ModuleCoverage *target_coverage = GetModuleCoverage(coverage, module_name);
   if(!target_coverage) return;
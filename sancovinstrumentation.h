@@ -41,6 +41,10 @@ public:
 
   uint64_t GetReturnValue() override { return return_value; }
 
+  bool SupportsCmpLog() override { return cmplog_shm != NULL; }
+  void SetCmpLog(bool enabled) override;
+  void GetCmpLog(std::vector<CmpLogEntry> &entries) override;
+
   std::string GetCrashName() override;
 
 protected:
@@ -58,6 +62,7 @@ protected:
   }
 
   void SetUpShmem();
+  void SetUpCmpLogShmem();
   void ComputeEnvp(std::list<std::string> &additional_env);
 
   void StartTarget(int argc, char** argv);
@@ -82,6 +87,11 @@ protected:
   
   int cov_shm_fd;
   coverage_shmem_data* cov_shm;
+
+  // only with -cmplog
+  std::string cmplog_shm_name;
+  int cmplog_shm_fd;
+  CmpLogShmemData* cmplog_shm;
   
   uint8_t* virgin_bits;
   
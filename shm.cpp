@@ -34,6 +34,8 @@ SharedMemory::~SharedMemory() {
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
 
 void SharedMemory::Open(char* name, size_t size) {
+  this->size = size;
+
   shm_handle = CreateFileMapping(
     INVALID_HANDLE_VALUE,
     NULL,
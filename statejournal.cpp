@@ -0,0 +1,403 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <list>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "coverage.h"
+#include "directory.h"
+#include "statejournal.h"
+
+// every state file starts with hex('fuzzjrnl')
+#define JOURNAL_MAGIC 0x66757a7a6a726e6cULL
+
+#define JOURNAL_SEGMENT_PREFIX "state.journal."
+
+#define JOURNAL_COPY_BUFFER_SIZE 65536
+
+// closed segments are folded into state.dat once they add up to
+// this fraction of its size, so that the cost of compacting stays
+// proportional to the changes rather than to the whole state
+#define JOURNAL_COMPACT_RATIO 0.5
+// or once there are this many of them
+#define JOURNAL_COMPACT_SEGMENTS 64
+
+static int64_t FileTell(FILE *fp) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  return _ftelli64(fp);
+#else
+  return ftello(fp);
+#endif
+}
+
+static void FileSeek(FILE *fp, int64_t offset) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  _fseeki64(fp, offset, SEEK_SET);
+#else
+  fseeko(fp, offset, SEEK_SET);
+#endif
+}
+
+// makes sure the contents of the file are on the disk
+static void FileSync(FILE *fp) {
+  fflush(fp);
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  _commit(_fileno(fp));
+#else
+  fsync(fileno(fp));
+#endif
+}
+
+// reserves space for the record header,
+// returns the offset of the record
+static int64_t StartRecord(FILE *fp) {
+  int64_t start = FileTell(fp);
+  JournalRecordHeader header = {};
+  fwrite(&header, sizeof(header), 1, fp);
+  return start;
+}
+
+// the header is written only once the payload is complete,
+// so a record interrupted by a crash is seen as JOURNAL_RECORD_NONE.
+// Seeking also flushes the payload to the file.
+static void FinishRecord(FILE *fp, int64_t start, JournalRecordType type, uint64_t key) {
+  int64_t end = FileTell(fp);
+  JournalRecordHeader header;
+  header.type = type;
+  header.reserved = 0;
+  header.key = key;
+  header.size = end - start - sizeof(header);
+  FileSeek(fp, start);
+  fwrite(&header, sizeof(header), 1, fp);
+  FileSeek(fp, end);
+}
+
+static void CopyRecord(JournalSnapshot *snapshot, JournalRecord &record, JournalRecordType type, uint64_t key, FILE *out) {
+  if (!record.Exists()) return;
+
+  JournalRecordHeader header;
+  header.type = type;
+  header.reserved = 0;
+  header.key = key;
+  header.size = record.size;
+  fwrite(&header, sizeof(header), 1, out);
+
+  FILE *in = snapshot->SeekRecord(record);
+  char *buf = (char *)malloc(JOURNAL_COPY_BUFFER_SIZE);
+  uint64_t remaining = record.size;
+  while (remaining) {
+    size_t chunk = JOURNAL_COPY_BUFFER_SIZE;
+    if (chunk > remaining) chunk = (size_t)remaining;
+    if (fread(buf, 1, chunk, in) != chunk) {
+      FATAL("Error reading state journal");
+    }
+    fwrite(buf, 1, chunk, out);
+    remaining -= chunk;
+  }
+  free(buf);
+}
+
+JournalSnapshot::~JournalSnapshot() {
+  for (FILE *fp : files) {
+    fclose(fp);
+  }
+}
+
+FILE *JournalSnapshot::SeekRecord(JournalRecord &record) {
+  FILE *fp = files[record.file_index];
+  FileSeek(fp, record.offset);
+  return fp;
+}
+
+void JournalSnapshot::ReadRecordTail(JournalRecord &record, std::string &data) {
+  FILE *fp = files[record.file_index];
+  uint64_t consumed = FileTell(fp) - record.offset;
+  if (consumed > record.size) {
+    FATAL("Read past the end of a state journal record");
+  }
+  data.resize((size_t)(record.size - consumed));
+  if (data.empty()) return;
+  if (fread(&data[0], 1, data.size(), fp) != data.size()) {
+    FATAL("Error reading state journal");
+  }
+}
+
+StateJournal::StateJournal() : fp(NULL), current_segment(0), first_segment(0),
+  state_size(0), closed_size(0),
+  record_start(0), record_type(JOURNAL_RECORD_NONE), record_key(0) { }
+
+StateJournal::~StateJournal() {
+  if (fp) fclose(fp);
+}
+
+std::string StateJournal::GetSegmentPath(uint64_t segment) {
+  return DirJoin(out_dir, std::string(JOURNAL_SEGMENT_PREFIX) + std::to_string(segment));
+}
+
+void StateJournal::Init(std::string &out_dir, bool restore) {
+  this->out_dir = out_dir;
+  state_path = DirJoin(out_dir, "state.dat");
+
+  std::list<std::string> files;
+  GetFilesInDirectory(out_dir, files);
+
+  std::string prefix = DirJoin(out_dir, JOURNAL_SEGMENT_PREFIX);
+  std::vector<uint64_t> segments;
+  for (std::string &file : files) {
+    if (file.compare(0, prefix.size(), prefix) != 0) continue;
+    const char *index_str = file.c_str() + prefix.size();
+    char *end;
+    uint64_t index = strtoull(index_str, &end, 10);
+    if ((end == index_str) || *end) continue;
+    segments.push_back(index);
+  }
+
+  uint64_t min_segment = 0;
+  uint64_t max_segment = 0;
+  for (size_t i = 0; i < segments.size(); i++) {
+    if (!i || segments[i] < min_segment) min_segment = segments[i];
+    if (!i || segments[i] > max_segment) max_segment = segments[i];
+  }
+
+  if (!restore) {
+    // start from scratch, so that the state of the
+    // previous session doesn't get mixed with this one
+    for (uint64_t segment : segments) {
+      std::string path = GetSegmentPath(segment);
+      RemoveFile(path);
+    }
+    RemoveFile(state_path);
+  }
+
+  if (segments.empty()) {
+    current_segment = 0;
+  } else {
+    current_segment = max_segment + 1;
+  }
+
+  first_segment = (restore && !segments.empty()) ? min_segment : current_segment;
+
+  state_size = GetFileSize(state_path);
+  closed_size = 0;
+  for (uint64_t segment = first_segment; segment < current_segment; segment++) {
+    std::string path = GetSegmentPath(segment);
+    closed_size += GetFileSize(path);
+  }
+
+  OpenSegment(current_segment);
+}
+
+void StateJournal::OpenSegment(uint64_t segment) {
+  std::string path = GetSegmentPath(segment);
+  fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    FATAL("Error creating state journal %s", path.c_str());
+  }
+  uint64_t magic = JOURNAL_MAGIC;
+  fwrite(&magic, sizeof(magic), 1, fp);
+  fflush(fp);
+  current_segment = segment;
+}
+
+FILE *StateJournal::BeginRecord(JournalRecordType type, uint64_t key) {
+  mutex.Lock();
+  record_type = type;
+  record_key = key;
+  record_start = StartRecord(fp);
+  return fp;
+}
+
+void StateJournal::EndRecord() {
+  FinishRecord(fp, record_start, record_type, record_key);
+  mutex.Unlock();
+}
+
+void StateJournal::Rotate() {
+  mutex.Lock();
+  closed_size += FileTell(fp);
+  fclose(fp);
+  OpenSegment(current_segment + 1);
+  mutex.Unlock();
+}
+
+bool StateJournal::ReadFile(std::string &path, JournalSnapshot *snapshot) {
+  FILE *in = fopen(path.c_str(), "rb");
+  if (!in) return false;
+
+  uint64_t magic;
+  if (fread(&magic, sizeof(magic), 1, in) != 1) {
+    // created, but nothing was written to it
+    fclose(in);
+    return false;
+  }
+  if (magic != JOURNAL_MAGIC) {
+    FATAL("%s is not a valid state file. Was it saved by an older version?", path.c_str());
+  }
+
+  fseek(in, 0, SEEK_END);
+  uint64_t file_size = FileTell(in);
+  FileSeek(in, sizeof(magic));
+
+  int file_index = (int)snapshot->files.size();
+  snapshot->files.push_back(in);
+
+  bool have_records = false;
+  while (1) {
+    JournalRecordHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1) break;
+
+    JournalRecord record;
+    record.file_index = file_index;
+    record.offset = FileTell(in);
+    record.size = header.size;
+
+    if ((header.type == JOURNAL_RECORD_NONE) ||
+        (record.offset + record.size > file_size))
+    {
+      WARN("Incomplete record in %s, ignoring the rest of the file", path.c_str());
+      break;
+    }
+
+    if (header.type == JOURNAL_RECORD_END) break;
+
+    have_records = true;
+
+    switch (header.type) {
+    case JOURNAL_RECORD_COUNTERS:
+      snapshot->counters = record;
+      break;
+    case JOURNAL_RECORD_COVERAGE:
+      snapshot->coverage.push_back(record);
+      break;
+    case JOURNAL_RECORD_MUTATOR_STATE:
+      snapshot->mutator_state = record;
+      break;
+    case JOURNAL_RECORD_SERVER_STATE:
+      snapshot->server_state = record;
+      break;
+    case JOURNAL_RECORD_ENTRY:
+      snapshot->entries[header.key] = record;
+      break;
+    default:
+      WARN("Unknown record type %u in %s", header.type, path.c_str());
+      break;
+    }
+
+    FileSeek(in, record.offset + record.size);
+  }
+
+  return have_records;
+}
+
+bool StateJournal::Load(JournalSnapshot *snapshot) {
+  mutex.Lock();
+  uint64_t last_segment = current_segment;
+  mutex.Unlock();
+
+  bool have_state = ReadFile(state_path, snapshot);
+
+  // a session interrupted before its first compaction
+  // only has journal segments
+  for (uint64_t segment = first_segment; segment < last_segment; segment++) {
+    std::string path = GetSegmentPath(segment);
+    if (ReadFile(path, snapshot)) have_state = true;
+  }
+
+  return have_state;
+}
+
+void StateJournal::Compact() {
+  mutex.Lock();
+  uint64_t last_segment = current_segment;
+  mutex.Unlock();
+
+  if (first_segment == last_segment) return;
+
+  JournalSnapshot *snapshot = new JournalSnapshot();
+  Load(snapshot);
+
+  std::string tmp_path = state_path + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "wb");
+  if (!out) {
+    FATAL("Error saving state");
+  }
+
+  uint64_t magic = JOURNAL_MAGIC;
+  fwrite(&magic, sizeof(magic), 1, out);
+
+  CopyRecord(snapshot, snapshot->counters, JOURNAL_RECORD_COUNTERS, 0, out);
+
+  Coverage coverage;
+  for (JournalRecord &record : snapshot->coverage) {
+    Coverage record_coverage;
+    ReadCoverageBinary(record_coverage, snapshot->SeekRecord(record));
+    MergeCoverage(coverage, record_coverage);
+  }
+  int64_t start = StartRecord(out);
+  WriteCoverageBinary(coverage, out);
+  FinishRecord(out, start, JOURNAL_RECORD_COVERAGE, 0);
+
+  CopyRecord(snapshot, snapshot->mutator_state, JOURNAL_RECORD_MUTATOR_STATE, 0, out);
+  CopyRecord(snapshot, snapshot->server_state, JOURNAL_RECORD_SERVER_STATE, 0, out);
+
+  for (auto iter = snapshot->entries.begin(); iter != snapshot->entries.end(); iter++) {
+    CopyRecord(snapshot, iter->second, JOURNAL_RECORD_ENTRY, iter->first, out);
+  }
+
+  JournalRecordHeader end_header = {};
+  end_header.type = JOURNAL_RECORD_END;
+  fwrite(&end_header, sizeof(end_header), 1, out);
+
+  // the segments are deleted right after the rename
+  FileSync(out);
+  uint64_t new_state_size = FileTell(out);
+  fclose(out);
+  delete snapshot;
+
+  if (!RenameFile(tmp_path, state_path)) {
+    FATAL("Error saving state");
+  }
+
+  // delete in order, so that the segments that
+  // remain after an interruption are always the newest ones
+  for (uint64_t segment = first_segment; segment < last_segment; segment++) {
+    std::string path = GetSegmentPath(segment);
+    RemoveFile(path);
+  }
+
+  mutex.Lock();
+  first_segment = last_segment;
+  state_size = new_state_size;
+  closed_size = 0;
+  mutex.Unlock();
+}
+
+bool StateJournal::NeedsCompaction() {
+  mutex.Lock();
+  bool ret = false;
+  if (first_segment != current_segment) {
+    ret = ((current_segment - first_segment) >= JOURNAL_COMPACT_SEGMENTS) ||
+          (closed_size >= state_size * JOURNAL_COMPACT_RATIO);
+  }
+  mutex.Unlock();
+  return ret;
+}
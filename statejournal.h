@@ -0,0 +1,151 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "mutex.h"
+
+// Fuzzer state is stored as a sequence of records.
+// state.dat holds a compacted copy of the state, while changes
+// since the last compaction are appended to journal segments
+// (state.journal.<n>) as they happen. Restoring the state means
+// reading state.dat followed by all of the segments in order,
+// where for keyed records the latest version wins.
+
+enum JournalRecordType {
+  JOURNAL_RECORD_NONE = 0,
+  // uint64 num_samples, num_samples_discarded, total_execs
+  JOURNAL_RECORD_COUNTERS,
+  // coverage added since the previous coverage record
+  JOURNAL_RECORD_COVERAGE,
+  // Mutator::SaveGlobalState()
+  JOURNAL_RECORD_MUTATOR_STATE,
+  // CoverageClient::SaveState()
+  JOURNAL_RECORD_SERVER_STATE,
+  // SampleQueueEntry::Save() followed by Mutator::SaveContext(),
+  // keyed by the sample index
+  JOURNAL_RECORD_ENTRY,
+  // the last record in state.dat
+  JOURNAL_RECORD_END,
+};
+
+struct JournalRecordHeader {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t key;
+  uint64_t size;
+};
+
+// location of a record payload within one of the files
+// of a JournalSnapshot
+struct JournalRecord {
+  JournalRecord() : file_index(-1), offset(0), size(0) {}
+
+  bool Exists() { return file_index >= 0; }
+
+  int file_index;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// the state folded from state.dat and the journal segments.
+// Only record locations are kept in memory, payloads are
+// read from the underlying files when needed.
+class JournalSnapshot {
+public:
+  ~JournalSnapshot();
+
+  // positions the corresponding file at the start of the record
+  FILE *SeekRecord(JournalRecord &record);
+
+  // reads the part of the record payload that follows
+  // the current position of the record's file
+  void ReadRecordTail(JournalRecord &record, std::string &data);
+
+  std::vector<FILE *> files;
+
+  JournalRecord counters;
+  JournalRecord mutator_state;
+  JournalRecord server_state;
+  std::vector<JournalRecord> coverage;
+  // ordered by sample index
+  std::map<uint64_t, JournalRecord> entries;
+};
+
+class StateJournal {
+public:
+  StateJournal();
+  ~StateJournal();
+
+  // opens a new journal segment in out_dir. If the previous state
+  // isn't going to be restored, it is deleted.
+  void Init(std::string &out_dir, bool restore);
+
+  // appends a record to the current segment. The payload gets
+  // written to the returned file between BeginRecord and EndRecord.
+  // Can be called from any thread, other writers are blocked
+  // until EndRecord.
+  FILE *BeginRecord(JournalRecordType type, uint64_t key = 0);
+  void EndRecord();
+
+  // closes the current segment and starts a new one.
+  // Closed segments are folded by the next Compact() call.
+  void Rotate();
+
+  // returns true if the closed segments got large
+  // (or many) enough to be worth compacting
+  bool NeedsCompaction();
+
+  // folds state.dat and all closed segments into a new state.dat
+  // and deletes the folded segments.
+  // Must not be called concurrently with itself or Load().
+  void Compact();
+
+  // folds state.dat and all closed segments into snapshot.
+  // Returns false if neither state.dat nor any of the
+  // segments hold a record.
+  bool Load(JournalSnapshot *snapshot);
+
+protected:
+  std::string GetSegmentPath(uint64_t segment);
+  void OpenSegment(uint64_t segment);
+  // returns true if the file holds at least one record
+  bool ReadFile(std::string &path, JournalSnapshot *snapshot);
+
+  std::string out_dir;
+  std::string state_path;
+
+  Mutex mutex;
+
+  FILE *fp;
+  uint64_t current_segment;
+  // the oldest segment not yet folded into state.dat
+  uint64_t first_segment;
+
+  uint64_t state_size;
+  // total size of the segments before current_segment
+  uint64_t closed_size;
+
+  int64_t record_start;
+  JournalRecordType record_type;
+  uint64_t record_key;
+};